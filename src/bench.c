@@ -0,0 +1,354 @@
+#include "flv.h"
+#include "pacer.h"
+#include <librtmp/amf.h>
+#include <librtmp/log.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_RESULTS (32)
+#define PACING_MESSAGES (200)
+#define PACING_INTERVAL_US (5000)
+#define PACING_MESSAGE_SIZE (65536)
+// small inputs are walked repeatedly until a repetition takes at least this long
+#define MIN_SECONDS (0.2)
+
+typedef struct {
+  const char *name;
+  const char *unit;
+  double value; // median of the repetitions
+  double best;
+  bool lower_is_better;
+} bench_result_t;
+
+static flv_reader_t *reader;
+static uint64_t first_tag;
+static int repeat = 5;
+static bench_result_t results[MAX_RESULTS];
+static int result_count;
+
+void bench_tag_parse();
+void bench_annexb();
+void bench_adts();
+void bench_amf_decode();
+void bench_pacer();
+void add_result(const char *, const char *, double *, int, bool);
+void write_results(const char *, const char *, const char *);
+int compare_results(const char *, double);
+
+void usage(char *program_name) {
+  printf("Usage: %s [-r repeat] [-o results.json] [-l label] [-c baseline.json] [-t threshold%%] infile\n", program_name);
+  exit(-1);
+}
+
+int main(int argc, char *argv[]) {
+  RTMP_LogSetLevel(RTMP_LOGINFO);
+
+  char *prog = argv[0];
+  char *output = NULL;
+  char *label = "";
+  char *baseline = NULL;
+  double threshold = 10;
+  int c;
+  while ((c = getopt(argc, argv, "r:o:l:c:t:")) != -1) {
+    switch (c) {
+    case 'r':
+      repeat = atoi(optarg);
+      break;
+    case 'o':
+      output = optarg;
+      break;
+    case 'l':
+      label = optarg;
+      break;
+    case 'c':
+      baseline = optarg;
+      break;
+    case 't':
+      threshold = atof(optarg);
+      break;
+    default:
+      usage(prog);
+      break;
+    }
+  }
+  if (optind >= argc || repeat < 1) usage(prog);
+
+  reader = flv_open(argv[optind]);
+  if (reader == NULL || reader->map == NULL) {
+    RTMP_Log(RTMP_LOGERROR, "open %s FAILED, a regular flv file is required", argv[optind]);
+    return -1;
+  }
+  first_tag = reader->pos;
+
+  bench_tag_parse();
+  bench_annexb();
+  bench_adts();
+  bench_amf_decode();
+  bench_pacer();
+
+  for (int i = 0; i < result_count; ++i) {
+    printf("%-24s %14.1f %-8s (best %.1f)\n", results[i].name, results[i].value, results[i].unit, results[i].best);
+  }
+
+  if (output) write_results(output, label, argv[optind]);
+  flv_close(reader);
+
+  return baseline ? compare_results(baseline, threshold) : 0;
+}
+
+/*
+ * flv_read_tag() over every tag, plus the video tag header
+ */
+void bench_tag_parse() {
+  double tags_per_sec[repeat], mb_per_sec[repeat];
+
+  for (int r = 0; r < repeat; ++r) {
+    size_t tags = 0, passes = 0;
+    uint64_t checksum = 0;
+    double begin = flv_now(), elapsed;
+
+    do {
+      flv_tag_t tag;
+      flv_video_t video;
+      reader->pos = first_tag;
+      while (flv_read_tag(reader, &tag) > 0) {
+        checksum += tag.timestamp;
+        if (0 == flv_parse_video(&tag, &video)) checksum += video.frame_type + video.codec_id + video.avc_packet_type + video.composition_time;
+        ++tags;
+      }
+      ++passes;
+    } while ((elapsed = flv_now() - begin) < MIN_SECONDS);
+
+    tags_per_sec[r] = tags / elapsed;
+    mb_per_sec[r] = passes * reader->size / elapsed / 1024 / 1024;
+    if (checksum == 0) RTMP_Log(RTMP_LOGDEBUG, "tag parse: empty checksum");
+  }
+
+  add_result("tag_parse", "tags/s", tags_per_sec, repeat, false);
+  add_result("tag_parse_bytes", "MB/s", mb_per_sec, repeat, false);
+}
+
+/*
+ * AVCC length prefixed NALUs to start code prefixed NALUs, as write_annexb_frame() in parser does
+ */
+void bench_annexb() {
+  static const byte startcode[] = {0x00, 0x00, 0x00, 0x01};
+  double mb_per_sec[repeat];
+  size_t capacity = 16 * 1024 * 1024;
+  byte *out = malloc(capacity);
+
+  for (int r = 0; r < repeat; ++r) {
+    size_t bytes = 0;
+    double begin = flv_now(), elapsed;
+
+    do {
+      flv_tag_t tag;
+      flv_video_t video;
+      flv_nalu_iter_t iter;
+      const byte *nalu;
+      uint32_t nalu_len;
+      uint8_t length_size = 4;
+
+      reader->pos = first_tag;
+      while (flv_read_tag(reader, &tag) > 0) {
+        if (0 != flv_parse_video(&tag, &video) || FLV_CODEC_ID_AVC != video.codec_id) continue;
+        if (AVC_SEQUENCE_HEADER == video.avc_packet_type) {
+          flv_avc_config_t config;
+          if (0 == flv_parse_avc_config(video.data, video.size, &config)) length_size = config.length_size;
+          continue;
+        }
+        if (AVC_NALU != video.avc_packet_type) continue;
+
+        size_t written = 0;
+        flv_nalu_iter_init(&iter, video.data, video.size, length_size);
+        while (flv_nalu_next(&iter, &nalu, &nalu_len) && written + 4 + nalu_len <= capacity) {
+          memcpy(out + written, startcode, sizeof(startcode));
+          memcpy(out + written + 4, nalu, nalu_len);
+          written += 4 + nalu_len;
+        }
+        bytes += written;
+      }
+    } while ((elapsed = flv_now() - begin) < MIN_SECONDS);
+
+    mb_per_sec[r] = bytes / elapsed / 1024 / 1024;
+  }
+
+  free(out);
+  add_result("avcc_annexb", "MB/s", mb_per_sec, repeat, false);
+}
+
+/*
+ * raw AAC frames to ADTS, as parser -a does
+ */
+void bench_adts() {
+  double mb_per_sec[repeat];
+  size_t capacity = 1024 * 1024;
+  byte *out = malloc(capacity);
+
+  for (int r = 0; r < repeat; ++r) {
+    size_t bytes = 0;
+    double begin = flv_now(), elapsed;
+
+    do {
+      flv_tag_t tag;
+      flv_audio_t audio;
+      flv_adts_t adts;
+      bool ready = false;
+
+      reader->pos = first_tag;
+      while (flv_read_tag(reader, &tag) > 0) {
+        if (0 != flv_parse_audio(&tag, &audio) || FLV_SOUND_FORMAT_AAC != audio.sound_format) continue;
+        if (AAC_SEQUENCE_HEADER == audio.aac_packet_type) {
+          flv_aac_config_t config;
+          ready = 0 == flv_parse_aac_config(audio.data, audio.size, &config) && 0 == flv_adts_init(&adts, &config);
+          continue;
+        }
+        if (!ready || audio.size + sizeof(adts.header) > capacity) continue;
+
+        // the output buffer is reused, it only has to stay hot
+        memcpy(out, flv_adts_header(&adts, audio.size), sizeof(adts.header));
+        memcpy(out + sizeof(adts.header), audio.data, audio.size);
+        bytes += sizeof(adts.header) + audio.size;
+      }
+    } while ((elapsed = flv_now() - begin) < MIN_SECONDS);
+
+    mb_per_sec[r] = bytes / elapsed / 1024 / 1024;
+  }
+
+  free(out);
+  add_result("aac_adts", "MB/s", mb_per_sec, repeat, false);
+}
+
+/*
+ * AMF_Decode of the first script data tag (onMetaData)
+ */
+void bench_amf_decode() {
+  const int iterations = 10000;
+  double decodes_per_sec[repeat];
+
+  flv_tag_t tag;
+  if (flv_read_tag_at(reader, first_tag, &tag) <= 0 || TAGTYPE_SCRIPTDATAOBJECT != tag.tag_type) {
+    RTMP_Log(RTMP_LOGWARNING, "amf decode: first tag isn't script data, skipped");
+    return;
+  }
+
+  for (int r = 0; r < repeat; ++r) {
+    double begin = flv_now();
+    for (int i = 0; i < iterations; ++i) {
+      AMFObject obj;
+      AMF_Decode(&obj, (const char *) tag.data, tag.data_size, FALSE);
+      AMF_Reset(&obj);
+    }
+    decodes_per_sec[r] = iterations / (flv_now() - begin);
+  }
+
+  add_result("amf_decode", "decodes/s", decodes_per_sec, repeat, false);
+}
+
+/*
+ * pacer.c as replay uses it: the drop policy over every video tag (queue alternating around the
+ * thresholds), and how far the token bucket's sends drift from the rate it was given
+ */
+void bench_pacer() {
+  double admits_per_sec[repeat], wait_drift[repeat];
+
+  for (int r = 0; r < repeat; ++r) {
+    pacer_t pacer;
+    size_t tags = 0, dropped = 0;
+    double begin = flv_now(), elapsed;
+    do {
+      flv_tag_t tag;
+      pacer_init(&pacer, 0, 0, 64 * 1024);
+      reader->pos = first_tag;
+      while (flv_read_tag(reader, &tag) > 0) {
+        if (TAGTYPE_VIDEODATA != tag.tag_type) continue;
+        int64_t queued = (int64_t) (tags % 4) * 48 * 1024; // below, above threshold, above critical
+        dropped += PACER_DROP == pacer_admit(&pacer, &tag, queued);
+        ++tags;
+      }
+    } while ((elapsed = flv_now() - begin) < MIN_SECONDS);
+    admits_per_sec[r] = tags / elapsed;
+    if (dropped == 0) RTMP_Log(RTMP_LOGDEBUG, "pacer: nothing dropped");
+
+    // one message per PACING_INTERVAL_US: the full bucket lets the first burst bytes through at once, the last message leaves a debt
+    pacer_init(&pacer, (uint64_t) PACING_MESSAGE_SIZE * 8 * 1000000 / PACING_INTERVAL_US, 0, 0);
+    double expected = ((PACING_MESSAGES - 1) * (double) PACING_MESSAGE_SIZE - pacer.burst) / pacer.rate;
+    begin = flv_now();
+    for (int i = 0; i < PACING_MESSAGES; ++i) pacer_wait(&pacer, PACING_MESSAGE_SIZE);
+    wait_drift[r] = ((flv_now() - begin) - expected) * 1e6 / PACING_MESSAGES;
+  }
+
+  add_result("pacer_admit", "tags/s", admits_per_sec, repeat, false);
+  add_result("pacer_wait_drift", "us/message", wait_drift, repeat, true);
+}
+
+void add_result(const char *name, const char *unit, double *values, int count, bool lower_is_better) {
+  if (result_count >= MAX_RESULTS) return;
+
+  // insertion sort, count is the number of repetitions
+  for (int i = 1; i < count; ++i) {
+    double v = values[i];
+    int j = i - 1;
+    for (; j >= 0 && values[j] > v; --j) values[j + 1] = values[j];
+    values[j + 1] = v;
+  }
+
+  bench_result_t *result = &results[result_count++];
+  result->name = name;
+  result->unit = unit;
+  result->value = values[count / 2];
+  result->best = lower_is_better ? values[0] : values[count - 1];
+  result->lower_is_better = lower_is_better;
+}
+
+/*
+ * one result per line, so compare_results() doesn't need a json parser
+ */
+void write_results(const char *path, const char *label, const char *infile) {
+  FILE *file = fopen(path, "w");
+  if (!file) {
+    RTMP_Log(RTMP_LOGERROR, "open %s FAILED", path);
+    return;
+  }
+
+  fprintf(file, "{\"label\": \"%s\", \"time\": %ld, \"input\": \"%s\", \"input_bytes\": %lu, \"repeat\": %d, \"results\": [\n", label, (long) time(NULL), infile, (unsigned long) reader->size, repeat);
+  for (int i = 0; i < result_count; ++i) {
+    fprintf(file, "{\"name\": \"%s\", \"unit\": \"%s\", \"value\": %.3f, \"best\": %.3f, \"lower_is_better\": %s}%s\n", results[i].name, results[i].unit, results[i].value, results[i].best,
+            results[i].lower_is_better ? "true" : "false", i + 1 < result_count ? "," : "");
+  }
+  fprintf(file, "]}\n");
+  fclose(file);
+}
+
+/*
+ * @return number of results which regressed by more than threshold percent against the baseline file
+ */
+int compare_results(const char *path, double threshold) {
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    RTMP_Log(RTMP_LOGWARNING, "no baseline %s", path);
+    return 0;
+  }
+
+  int regressions = 0;
+  char line[512], name[64];
+  double value;
+  while (fgets(line, sizeof(line), file)) {
+    if (2 != sscanf(line, "{\"name\": \"%63[^\"]\", \"unit\": \"%*[^\"]\", \"value\": %lf", name, &value)) continue;
+    for (int i = 0; i < result_count; ++i) {
+      if (0 != strcmp(name, results[i].name) || value == 0) continue;
+      double change = (results[i].value - value) / value * 100;
+      bool regressed = results[i].lower_is_better ? change > threshold : -change > threshold;
+      printf("%-24s %14.1f -> %14.1f %+7.1f%%%s\n", name, value, results[i].value, change, regressed ? "  REGRESSION" : "");
+      if (regressed) ++regressions;
+    }
+  }
+
+  fclose(file);
+  return regressions;
+}
+
@@ -0,0 +1,395 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include "bus.h"
+#include "log.h"
+#include <errno.h>
+#include <librtmp/log.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <time.h>
+
+static int map_bus(bus_t *, uint64_t, uint64_t);
+static void evict_overrun(bus_t *, uint64_t, uint64_t);
+static int config_slot(uint8_t, const byte *, uint32_t);
+static void set_config(bus_shared_t *, int, const byte *, const byte *, uint32_t);
+static bool alive(pid_t);
+static long futex(uint32_t *, int, uint32_t, const struct timespec *);
+
+bus_t *bus_create(const char *path, uint64_t capacity) {
+  uint64_t page = sysconf(_SC_PAGESIZE);
+  capacity = (capacity + page - 1) / page * page;
+  uint64_t data_offset = (sizeof(bus_shared_t) + BUS_DESCRIPTORS * sizeof(bus_desc_t) + page - 1) / page * page;
+
+  bus_t *bus = calloc(1, sizeof(bus_t));
+  bus->producer = true;
+  bus->listen_fd = -1;
+  snprintf(bus->path, sizeof(bus->path), "%s", path);
+
+  // sealed size: a reader can't shrink the file under the producer (SIGBUS)
+  bus->fd = memfd_create("flv-bus", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (bus->fd < 0 || 0 != ftruncate(bus->fd, data_offset + capacity) || 0 != fcntl(bus->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) || 0 != map_bus(bus, data_offset, capacity)) {
+    RTMP_Log(RTMP_LOGERROR, "create bus FAILED: %s", strerror(errno));
+    bus_close(bus);
+    return NULL;
+  }
+
+  bus_shared_t *shared = bus->shared;
+  shared->magic = BUS_MAGIC;
+  shared->pid = getpid();
+  shared->capacity = capacity;
+  shared->data_offset = data_offset;
+  for (int i = 0; i < BUS_MAX_READERS; ++i) shared->readers[i].cursor = UINT64_MAX;
+
+  struct sockaddr_un addr = {0};
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+  unlink(path);
+  bus->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (bus->listen_fd < 0 || 0 != bind(bus->listen_fd, (struct sockaddr *) &addr, sizeof(addr)) || 0 != listen(bus->listen_fd, 16)) {
+    RTMP_Log(RTMP_LOGERROR, "listen on %s FAILED: %s", path, strerror(errno));
+    bus_close(bus);
+    return NULL;
+  }
+  return bus;
+}
+
+/*
+ * evict whoever still holds the bytes / descriptor about to be reused, copy the tag in,
+ * then publish it by moving head, and wake the readers only if one is waiting
+ */
+int bus_publish(bus_t *bus, uint8_t type, uint32_t timestamp, const byte *data, uint32_t size) {
+  bus_shared_t *shared = bus->shared;
+  uint64_t length = FLV_TAG_HEADER_SIZE + size;
+  if (length > shared->capacity / 2) {
+    snprintf(bus->error, sizeof(bus->error), "tag of %u bytes doesn't fit the bus", size);
+    return -1;
+  }
+
+  uint64_t seq = shared->head;
+  uint64_t pos = shared->reserved;
+  evict_overrun(bus, seq, pos + length);
+  __atomic_store_n(&shared->reserved, pos + length, __ATOMIC_SEQ_CST);
+
+  // the mirror mapping keeps a wrapping tag contiguous
+  byte *p = bus->data + pos % shared->capacity;
+  byte header[FLV_TAG_HEADER_SIZE] = {type, size >> 16, size >> 8, size, timestamp >> 16, timestamp >> 8, timestamp, timestamp >> 24, 0x00, 0x00, 0x00};
+  memcpy(p, header, FLV_TAG_HEADER_SIZE);
+  memcpy(p + FLV_TAG_HEADER_SIZE, data, size);
+
+  int slot = config_slot(type, data, size);
+  if (slot >= 0) set_config(shared, slot, header, data, size);
+
+  bus_desc_t *desc = &bus->descs[seq % BUS_DESCRIPTORS];
+  desc->pos = pos;
+  desc->data_size = size;
+  desc->timestamp = timestamp;
+  desc->tag_type = type;
+  desc->seq = seq;
+  __atomic_store_n(&shared->head, seq + 1, __ATOMIC_SEQ_CST);
+
+  __atomic_add_fetch(&shared->notify, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&shared->waiters, __ATOMIC_SEQ_CST)) {
+    futex(&shared->notify, FUTEX_WAKE, INT32_MAX, NULL);
+    ++bus->wakeups;
+  }
+
+  ++bus->tags;
+  bus->bytes += length;
+  return 0;
+}
+
+void bus_serve(bus_t *bus) {
+  int client;
+  while ((client = accept4(bus->listen_fd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+    char control[CMSG_SPACE(sizeof(int))] = {0};
+    byte one = 1;
+    struct iovec iov = {&one, 1};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &bus->fd, sizeof(int));
+    if (sendmsg(client, &msg, MSG_NOSIGNAL) < 0) LOG(RTMP_LOGWARNING, "send bus fd FAILED: %s", strerror(errno));
+    close(client);
+  }
+}
+
+bus_t *bus_attach(const char *path) {
+  bus_t *bus = calloc(1, sizeof(bus_t));
+  bus->fd = -1;
+  bus->listen_fd = -1;
+  bus->slot = -1;
+  snprintf(bus->path, sizeof(bus->path), "%s", path);
+
+  struct sockaddr_un addr = {0};
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock < 0 || 0 != connect(sock, (struct sockaddr *) &addr, sizeof(addr))) {
+    RTMP_Log(RTMP_LOGERROR, "connect to %s FAILED: %s", path, strerror(errno));
+    if (sock >= 0) close(sock);
+    bus_close(bus);
+    return NULL;
+  }
+
+  char control[CMSG_SPACE(sizeof(int))];
+  byte one;
+  struct iovec iov = {&one, 1};
+  struct msghdr msg = {0};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) > 0) {
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) memcpy(&bus->fd, CMSG_DATA(cmsg), sizeof(int));
+  }
+  close(sock);
+  if (bus->fd < 0) {
+    RTMP_Log(RTMP_LOGERROR, "receive bus fd FAILED");
+    bus_close(bus);
+    return NULL;
+  }
+
+  // the header tells the layout
+  bus_shared_t header;
+  if (pread(bus->fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != BUS_MAGIC || 0 != map_bus(bus, header.data_offset, header.capacity)) {
+    RTMP_Log(RTMP_LOGERROR, "map bus FAILED");
+    bus_close(bus);
+    return NULL;
+  }
+
+  // a free slot, or one left behind by a dead reader; join at the live edge
+  bus_shared_t *shared = bus->shared;
+  for (int i = 0; i < BUS_MAX_READERS && bus->slot < 0; ++i) {
+    bus_reader_slot_t *reader = &shared->readers[i];
+    uint32_t state = __atomic_load_n(&reader->state, __ATOMIC_SEQ_CST);
+    if (state == BUS_READER_ACTIVE || (state == BUS_READER_EVICTED && alive(reader->pid))) continue;
+    if (!__atomic_compare_exchange_n(&reader->state, &state, BUS_READER_ACTIVE, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) continue;
+    reader->pid = getpid();
+    bus->next = __atomic_load_n(&shared->head, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&reader->cursor, bus->next, __ATOMIC_SEQ_CST);
+    bus->slot = i;
+  }
+  if (bus->slot < 0) {
+    RTMP_Log(RTMP_LOGERROR, "all %d reader slots of %s are taken", BUS_MAX_READERS, path);
+    bus_close(bus);
+    return NULL;
+  }
+  return bus;
+}
+
+int bus_next(bus_t *bus, flv_tag_t *tag) {
+  bus_shared_t *shared = bus->shared;
+  bus_reader_slot_t *reader = &shared->readers[bus->slot];
+
+  while (true) {
+    if (__atomic_load_n(&reader->state, __ATOMIC_SEQ_CST) != BUS_READER_ACTIVE) break;
+    if (bus->next < __atomic_load_n(&shared->head, __ATOMIC_SEQ_CST)) break;
+    if (__atomic_load_n(&shared->closed, __ATOMIC_SEQ_CST)) return 0;
+
+    // the producer bumps notify after moving head: either head moved or the wait returns at once
+    uint32_t notify = __atomic_load_n(&shared->notify, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&shared->waiters, 1, __ATOMIC_SEQ_CST);
+    long ret = 0;
+    if (bus->next == __atomic_load_n(&shared->head, __ATOMIC_SEQ_CST)) {
+      struct timespec timeout = {1, 0};
+      ret = futex(&shared->notify, FUTEX_WAIT, notify, &timeout);
+      ++bus->wakeups;
+    }
+    __atomic_sub_fetch(&shared->waiters, 1, __ATOMIC_SEQ_CST);
+
+    if (ret != 0 && errno == EINTR) {
+      snprintf(bus->error, sizeof(bus->error), "interrupted");
+      return -1;
+    }
+    if (ret != 0 && errno == ETIMEDOUT && !alive(shared->pid)) {
+      snprintf(bus->error, sizeof(bus->error), "producer %d is gone", shared->pid);
+      return 0;
+    }
+  }
+
+  // hold the tag first, then check it wasn't reused before the producer could see that
+  uint64_t seq = bus->next;
+  __atomic_store_n(&reader->cursor, seq, __ATOMIC_SEQ_CST);
+  bus_desc_t desc = bus->descs[seq % BUS_DESCRIPTORS];
+  bool overrun = __atomic_load_n(&shared->head, __ATOMIC_SEQ_CST) - seq >= BUS_DESCRIPTORS || desc.seq != seq ||
+                 __atomic_load_n(&shared->reserved, __ATOMIC_SEQ_CST) > desc.pos + shared->capacity;
+  if (overrun || __atomic_load_n(&reader->state, __ATOMIC_SEQ_CST) != BUS_READER_ACTIVE) {
+    ++bus->evicted;
+    snprintf(bus->error, sizeof(bus->error), "evicted at tag %llu, %llu tags behind", (unsigned long long) seq, (unsigned long long) (shared->head - seq));
+    return -1;
+  }
+
+  tag->offset = desc.pos;
+  tag->tag_type = desc.tag_type;
+  tag->data_size = desc.data_size;
+  tag->timestamp = desc.timestamp;
+  tag->stream_id = 0;
+  tag->head = bus->data + desc.pos % shared->capacity;
+  tag->data = tag->head + FLV_TAG_HEADER_SIZE;
+  bus->next = seq + 1;
+  ++bus->tags;
+  bus->bytes += FLV_TAG_HEADER_SIZE + desc.data_size;
+  return 1;
+}
+
+uint32_t bus_config(bus_t *bus, int slot, byte *buffer) {
+  bus_config_t *config = &bus->shared->configs[slot];
+  uint32_t version, size;
+  do {
+    version = __atomic_load_n(&config->version, __ATOMIC_ACQUIRE);
+    size = config->size;
+    if (size > sizeof(config->tag)) size = 0;
+    memcpy(buffer, config->tag, size);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while ((version & 1) || version != __atomic_load_n(&config->version, __ATOMIC_RELAXED));
+  return size;
+}
+
+void bus_close(bus_t *bus) {
+  if (bus == NULL) return;
+  bus_shared_t *shared = bus->shared;
+
+  if (shared && bus->producer) {
+    __atomic_store_n(&shared->closed, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&shared->notify, 1, __ATOMIC_SEQ_CST);
+    futex(&shared->notify, FUTEX_WAKE, INT32_MAX, NULL);
+  } else if (shared && bus->slot >= 0) {
+    bus_reader_slot_t *reader = &shared->readers[bus->slot];
+    __atomic_store_n(&reader->cursor, UINT64_MAX, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&reader->state, BUS_READER_FREE, __ATOMIC_SEQ_CST);
+  }
+
+  if (bus->listen_fd >= 0) {
+    close(bus->listen_fd);
+    unlink(bus->path);
+  }
+  if (bus->shared) munmap(bus->shared, bus->map_size);
+  if (bus->fd >= 0) close(bus->fd);
+  free(bus);
+}
+
+/*
+ * header + descriptors, then the data ring twice: [data_offset, +capacity) and again right after it
+ */
+static int map_bus(bus_t *bus, uint64_t data_offset, uint64_t capacity) {
+  size_t size = data_offset + 2 * capacity;
+  byte *base = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (base == MAP_FAILED) return -1;
+  bus->shared = (bus_shared_t *) base;
+  bus->map_size = size;
+
+  // readers only write their slot, the data is read only for them
+  int prot = bus->producer ? PROT_READ | PROT_WRITE : PROT_READ;
+  if (MAP_FAILED == mmap(base, data_offset, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, bus->fd, 0)) return -1;
+  if (MAP_FAILED == mmap(base + data_offset, capacity, prot, MAP_SHARED | MAP_FIXED, bus->fd, data_offset)) return -1;
+  if (MAP_FAILED == mmap(base + data_offset + capacity, capacity, prot, MAP_SHARED | MAP_FIXED, bus->fd, data_offset)) return -1;
+
+  bus->descs = (bus_desc_t *) (base + sizeof(bus_shared_t));
+  bus->data = base + data_offset;
+  return 0;
+}
+
+/*
+ * the new tag takes seq and data up to end: a reader holding a tag whose descriptor or bytes
+ * get reused is evicted, the producer never waits
+ */
+static void evict_overrun(bus_t *bus, uint64_t seq, uint64_t end) {
+  bus_shared_t *shared = bus->shared;
+  for (int i = 0; i < BUS_MAX_READERS; ++i) {
+    bus_reader_slot_t *reader = &shared->readers[i];
+    if (__atomic_load_n(&reader->state, __ATOMIC_SEQ_CST) != BUS_READER_ACTIVE) continue;
+    uint64_t cursor = __atomic_load_n(&reader->cursor, __ATOMIC_SEQ_CST);
+    // nothing held, or waiting for this very tag
+    if (cursor >= seq) continue;
+    if (seq - cursor < BUS_DESCRIPTORS && bus->descs[cursor % BUS_DESCRIPTORS].pos + shared->capacity >= end) continue;
+
+    __atomic_store_n(&reader->cursor, UINT64_MAX, __ATOMIC_SEQ_CST);
+    ++reader->evictions;
+    ++bus->evicted;
+    // a dead reader gives its slot back, a live one finds out on its next bus_next()
+    bool dead = !alive(reader->pid);
+    __atomic_store_n(&reader->state, dead ? BUS_READER_FREE : BUS_READER_EVICTED, __ATOMIC_SEQ_CST);
+    LOG(RTMP_LOGWARNING, "bus reader %d (pid %d) %s, %llu tags behind", i, reader->pid, dead ? "is gone" : "evicted", (unsigned long long) (seq - cursor));
+  }
+}
+
+// @return enum bus_configs, -1 for media
+static int config_slot(uint8_t type, const byte *data, uint32_t size) {
+  if (TAGTYPE_SCRIPTDATAOBJECT == type) return BUS_CONFIG_METADATA;
+
+  flv_tag_t tag = {0};
+  tag.tag_type = type;
+  tag.data = data;
+  tag.data_size = size;
+  flv_video_t video;
+  if (0 == flv_parse_video(&tag, &video)) return flv_video_is_config(&video) ? BUS_CONFIG_VIDEO : -1;
+  flv_audio_t audio;
+  if (0 == flv_parse_audio(&tag, &audio)) return FLV_SOUND_FORMAT_AAC == audio.sound_format && AAC_SEQUENCE_HEADER == audio.aac_packet_type ? BUS_CONFIG_AAC : -1;
+  return -1;
+}
+
+// seqlock: odd version while writing, readers retry
+static void set_config(bus_shared_t *shared, int slot, const byte *header, const byte *data, uint32_t size) {
+  if (size > BUS_CONFIG_SIZE) {
+    LOG(RTMP_LOGWARNING, "config tag of %u bytes not kept, limit is %d", size, BUS_CONFIG_SIZE);
+    return;
+  }
+  bus_config_t *config = &shared->configs[slot];
+  __atomic_store_n(&config->version, config->version + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(config->tag, header, FLV_TAG_HEADER_SIZE);
+  memcpy(config->tag + FLV_TAG_HEADER_SIZE, data, size);
+  config->size = FLV_TAG_HEADER_SIZE + size;
+  __atomic_store_n(&config->version, config->version + 1, __ATOMIC_RELEASE);
+}
+
+static bool alive(pid_t pid) { return pid > 0 && !(kill(pid, 0) != 0 && errno == ESRCH); }
+
+// shared (not FUTEX_PRIVATE): the word lives in the memfd mapped by several processes
+static long futex(uint32_t *addr, int op, uint32_t value, const struct timespec *timeout) { return syscall(SYS_futex, addr, op, value, timeout, NULL, 0); }
+
+#else
+
+bus_t *bus_create(const char *path, uint64_t capacity) {
+  RTMP_Log(RTMP_LOGERROR, "the tag bus needs memfd and futex (linux)");
+  return NULL;
+}
+
+int bus_publish(bus_t *bus, uint8_t type, uint32_t timestamp, const byte *data, uint32_t size) { return -1; }
+
+void bus_serve(bus_t *bus) {}
+
+bus_t *bus_attach(const char *path) {
+  RTMP_Log(RTMP_LOGERROR, "the tag bus needs memfd and futex (linux)");
+  return NULL;
+}
+
+int bus_next(bus_t *bus, flv_tag_t *tag) { return -1; }
+
+uint32_t bus_config(bus_t *bus, int slot, byte *buffer) { return 0; }
+
+void bus_close(bus_t *bus) {}
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef BUS_H
+#define BUS_H
+
+#include "flv.h"
+
+/*
+ * shared-memory tag bus (linux): one producer (dump -b) publishes tags into a memfd ring,
+ * any number of reader processes map it and read the tags in place, each with its own cursor.
+ *
+ *   memfd: header | descriptor ring | data ring, the data ring is mapped twice back to back
+ *          so a tag that wraps around is still contiguous
+ *   fd:    handed out over a unix socket (SCM_RIGHTS) by bus_serve()
+ *   wake:  futex on a counter in the header, only called when a reader is waiting
+ *
+ * the producer never waits: before overwriting bytes (or a descriptor) a reader still holds,
+ * that reader is evicted, and its next bus_next() fails. the tag returned by bus_next() stays
+ * valid until the next call.
+ *
+ * the latest video (AVC, HEVC, AV1) / AAC sequence headers and metadata are kept aside (bus_config), so a reader
+ * joining mid-stream can start decoding at the next keyframe.
+ */
+
+#define BUS_MAGIC (0x42564c46) // "FLVB"
+#define BUS_MAX_READERS (16)
+#define BUS_DESCRIPTORS (65536)
+#define BUS_CONFIG_SIZE (4096)
+#define BUS_DEFAULT_CAPACITY (32 * 1024 * 1024)
+
+enum bus_configs { BUS_CONFIG_VIDEO, BUS_CONFIG_AAC, BUS_CONFIG_METADATA, BUS_CONFIG_COUNT };
+enum bus_reader_states { BUS_READER_FREE, BUS_READER_ACTIVE, BUS_READER_EVICTED };
+
+typedef struct {
+  uint64_t seq;
+  uint64_t pos; // of the tag header in the data ring, counted from the start of the stream
+  uint32_t data_size;
+  uint32_t timestamp;
+  uint8_t tag_type;
+} bus_desc_t;
+
+typedef struct {
+  uint32_t version; // odd while the producer writes it
+  uint32_t size; // tag header + data
+  byte tag[FLV_TAG_HEADER_SIZE + BUS_CONFIG_SIZE];
+} bus_config_t;
+
+typedef struct {
+  uint32_t state;
+  int32_t pid;
+  uint64_t cursor; // seq held (or read next), UINT64_MAX: nothing held
+  uint64_t evictions;
+  byte pad[40];
+} bus_reader_slot_t;
+
+typedef struct {
+  uint32_t magic;
+  int32_t pid; // producer
+  uint64_t capacity; // data ring bytes, multiple of the page size
+  uint64_t data_offset;
+  uint64_t head; // seq of the next tag
+  uint64_t reserved; // data ring bytes written, or being written
+  uint32_t notify; // futex, bumped on every publish
+  uint32_t waiters;
+  uint32_t closed;
+  bus_config_t configs[BUS_CONFIG_COUNT];
+  bus_reader_slot_t readers[BUS_MAX_READERS];
+} bus_shared_t;
+
+typedef struct {
+  bool producer;
+  int fd; // memfd
+  int listen_fd; // producer
+  char path[108];
+  bus_shared_t *shared;
+  bus_desc_t *descs;
+  byte *data; // capacity bytes, mirrored
+  size_t map_size;
+  int slot; // reader
+  uint64_t next; // reader: seq to read next
+  // stats
+  uint64_t tags;
+  uint64_t bytes;
+  uint64_t wakeups;
+  uint64_t evicted; // producer: readers evicted, reader: times evicted
+  char error[128];
+} bus_t;
+
+/*
+ * producer
+ */
+// @param[in] path: unix socket readers attach to
+bus_t *bus_create(const char *, uint64_t);
+int bus_publish(bus_t *, uint8_t, uint32_t, const byte *, uint32_t);
+// hand the memfd to every reader waiting on the socket, never blocks
+void bus_serve(bus_t *);
+
+/*
+ * reader
+ */
+bus_t *bus_attach(const char *);
+// @return 1: tag, 0: producer closed the bus, -1: evicted, interrupted by a signal or error, see bus->error
+int bus_next(bus_t *, flv_tag_t *);
+// @brief copy a config tag (header + data) to buffer, at least FLV_TAG_HEADER_SIZE + BUS_CONFIG_SIZE bytes
+// @return size, 0 if there is none
+uint32_t bus_config(bus_t *, int, byte *);
+
+void bus_close(bus_t *);
+
+#endif
@@ -1,85 +1,540 @@
+#include "flv.h"
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <librtmp/log.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
 
-typedef unsigned char byte;
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL (0)
+#endif
 
-static int sockfd = 0;
+#define HANDSHAKE_SIZE (1536)
+// C0 + C1 + C2, S0 + S1 + S2
+#define HANDSHAKE_TOTAL (1 + 2 * HANDSHAKE_SIZE)
+#define RTMP_VERSION (0x03)
+#define MAX_EVENTS (1024)
 
+#define EV_READ (1)
+#define EV_WRITE (2)
+
+enum conn_states { CONNECTING, HANDSHAKING };
+enum failures { FAIL_CONNECT, FAIL_IO, FAIL_VERSION, FAIL_TIMEOUT, FAIL_COUNT };
+static const char *failure_names[] = {"connect", "reset", "bad version", "timeout"};
+
+/*
+ * one handshake, client or server side: out is sent up to sendable, in is read up to HANDSHAKE_TOTAL
+ *   client: out = C0 C1, then C2 (echo of S1) once S0 S1 are in
+ *   server: out = S0 S1 S2 (echo of C1) once C0 C1 are in
+ */
+typedef struct {
+  int fd;
+  bool server;
+  int state;
+  int events;
+  double begin;
+  uint32_t sent;
+  uint32_t sendable;
+  uint32_t received;
+  byte out[HANDSHAKE_TOTAL];
+  byte in[HANDSHAKE_TOTAL];
+} conn_t;
+
+typedef struct {
+#ifdef __linux__
+  int epfd;
+#else
+  struct pollfd *fds; // indexed by fd, fd -1 when unused
+  int nfds;
+#endif
+  int capacity;
+} loop_t;
+
+typedef struct {
+  uint64_t started;
+  uint64_t completed;
+  uint64_t failed[FAIL_COUNT];
+  uint64_t echo_mismatch;
+  double *latency; // ms, per completed handshake
+} stat_t;
+
+static loop_t loop;
+static conn_t **conns; // indexed by fd
+static int max_fds;
+static stat_t stats;
+static uint64_t seed = 88172645463325252ull;
+
+void usage(char *);
+int run_client(struct sockaddr_in *, uint64_t, int, double);
+void serve(int);
+int start_connection(struct sockaddr_in *);
+void handle(int, int);
+void advance(conn_t *);
+void finish(conn_t *, int);
+void report(double);
+uint64_t in_flight();
+int listen_local(uint16_t);
+
+int loop_init(int);
+void loop_set(int, int);
+int loop_wait(int, int *, int *, int);
+
+void fill_random(byte *, size_t);
 void print_addr(struct hostent *, struct sockaddr_in *);
-void random_bytes(byte *buffer, size_t size);
+int compare_double(const void *, const void *);
 void die() { exit(1); }
 
-int main() {
-  RTMP_LogSetLevel(RTMP_LOGALL);
+void usage(char *program_name) {
+  printf("Usage: %s [-v] [-n handshakes] [-c concurrency] [-t timeout_s] [-p port] [-l] [host]\n", program_name);
+  printf("       %s -s port\n", program_name);
+  printf("  -l: against a server stand-in forked on 127.0.0.1, -s: run the stand-in\n");
+  exit(-1);
+}
 
-  struct hostent *host;
-  struct sockaddr_in server;
+int main(int argc, char *argv[]) {
+  RTMP_LogSetLevel(RTMP_LOGINFO);
+
+  uint64_t total = 1;
+  int concurrency = 1;
+  double timeout = 5;
+  uint16_t port = 1935;
+  bool local = false;
+  int serve_port = -1;
+  int c;
+  while ((c = getopt(argc, argv, "vn:c:t:p:ls:")) != -1) {
+    switch (c) {
+    case 'v':
+      RTMP_LogSetLevel(RTMP_LOGDEBUG);
+      break;
+    case 'n':
+      total = strtoull(optarg, NULL, 10);
+      break;
+    case 'c':
+      concurrency = atoi(optarg);
+      break;
+    case 't':
+      timeout = atof(optarg);
+      break;
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 'l':
+      local = true;
+      break;
+    case 's':
+      serve_port = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      break;
+    }
+  }
+  if (total == 0 || concurrency < 1) usage(argv[0]);
 
-  const char hostname[] = "live.nonocast.cn";
-  if ((host = gethostbyname(hostname)) == NULL) {
-    RTMP_Log(RTMP_LOGERROR, "gethostbyname FAILED");
+  signal(SIGPIPE, SIG_IGN);
+  seed ^= (uint64_t) time(NULL) << 20 ^ getpid();
+
+  // thousands of sockets: take the hard limit
+  struct rlimit limit;
+  getrlimit(RLIMIT_NOFILE, &limit);
+  limit.rlim_cur = limit.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &limit);
+  getrlimit(RLIMIT_NOFILE, &limit);
+  max_fds = limit.rlim_cur > 1 << 20 ? 1 << 20 : (int) limit.rlim_cur;
+  if (concurrency > max_fds - 16) concurrency = max_fds - 16;
+
+  conns = calloc(max_fds, sizeof(conn_t *));
+  if (!conns) {
+    RTMP_Log(RTMP_LOGERROR, "out of memory");
     die();
   }
-  memcpy(&server.sin_addr, host->h_addr_list[0], host->h_length);
-  server.sin_family = AF_INET;
-  server.sin_port = htons(1935);
 
-  print_addr(host, &server);
+  if (serve_port >= 0) {
+    int fd = listen_local(serve_port);
+    if (fd < 0) die();
+    RTMP_Log(RTMP_LOGINFO, "handshake stand-in on 127.0.0.1:%d", serve_port);
+    serve(fd);
+    return 0;
+  }
+
+  struct sockaddr_in server = {0};
+  server.sin_family = AF_INET;
+  pid_t child = 0;
+  if (local) {
+    // the stand-in gets its own process, each side creates its event loop after the fork
+    int fd = listen_local(0);
+    if (fd < 0) die();
+    socklen_t len = sizeof(server);
+    getsockname(fd, (struct sockaddr *) &server, &len);
+    if ((child = fork()) == 0) serve(fd);
+    close(fd);
+  } else {
+    struct hostent *host;
+    const char *hostname = optind < argc ? argv[optind] : "live.nonocast.cn";
+    if ((host = gethostbyname(hostname)) == NULL) {
+      RTMP_Log(RTMP_LOGERROR, "gethostbyname FAILED");
+      die();
+    }
+    memcpy(&server.sin_addr, host->h_addr_list[0], host->h_length);
+    server.sin_port = htons(port);
+    print_addr(host, &server);
+  }
 
-  if ((sockfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) == -1) {
-    RTMP_Log(RTMP_LOGERROR, "create socket FAILED");
+  if (0 != loop_init(max_fds)) {
+    RTMP_Log(RTMP_LOGERROR, "event loop FAILED");
     die();
   }
+  int ret = run_client(&server, total, concurrency, timeout);
+
+  if (child > 0) {
+    kill(child, SIGTERM);
+    waitpid(child, NULL, 0);
+  }
+  return ret;
+}
 
-  if (connect(sockfd, (struct sockaddr *) &server, sizeof(server)) == -1) {
-    RTMP_Log(RTMP_LOGERROR, "connect FAILED");
+/*
+ * keep concurrency handshakes in flight until total have finished
+ */
+int run_client(struct sockaddr_in *server, uint64_t total, int concurrency, double timeout) {
+  stats.latency = malloc(total * sizeof(double));
+  int *fds = malloc(MAX_EVENTS * sizeof(int));
+  int *events = malloc(MAX_EVENTS * sizeof(int));
+  double begin = flv_now(), last_check = begin;
+
+  while (stats.started < total || in_flight() > 0) {
+    while (in_flight() < (uint64_t) concurrency && stats.started < total) {
+      ++stats.started;
+      start_connection(server);
+    }
+
+    int count = loop_wait(100, fds, events, MAX_EVENTS);
+    for (int i = 0; i < count; ++i) handle(fds[i], events[i]);
+
+    // handshakes which take longer than timeout
+    if (flv_now() - last_check > 0.1) {
+      last_check = flv_now();
+      for (int fd = 0; fd < max_fds; ++fd) {
+        if (conns[fd] && last_check - conns[fd]->begin > timeout) finish(conns[fd], FAIL_TIMEOUT);
+      }
+    }
+  }
+
+  report(flv_now() - begin);
+  free(fds);
+  free(events);
+  free(stats.latency);
+  return stats.completed == total ? 0 : -1;
+}
+
+int start_connection(struct sockaddr_in *server) {
+  int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (fd < 0 || fd >= max_fds) {
+    if (fd >= 0) close(fd);
+    ++stats.failed[FAIL_CONNECT];
+    return -1;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  // a reconnect storm shouldn't run out of ephemeral ports in TIME_WAIT: close with RST
+  struct linger linger = {1, 0};
+  setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+
+  conn_t *conn = calloc(1, sizeof(conn_t));
+  conn->fd = fd;
+  conn->state = CONNECTING;
+  conn->begin = flv_now();
+  conn->out[0] = RTMP_VERSION;
+  // C1: time (4 bytes), zero (4 bytes), random
+  uint32_t t = (uint32_t) time(NULL);
+  conn->out[1] = t >> 24;
+  conn->out[2] = t >> 16;
+  conn->out[3] = t >> 8;
+  conn->out[4] = t;
+  fill_random(conn->out + 9, HANDSHAKE_SIZE - 8);
+  conn->sendable = 1 + HANDSHAKE_SIZE;
+  conns[fd] = conn;
+
+  if (connect(fd, (struct sockaddr *) server, sizeof(*server)) != 0 && errno != EINPROGRESS) {
+    finish(conn, FAIL_CONNECT);
+    return -1;
+  }
+  loop_set(fd, EV_WRITE);
+  conn->events = EV_WRITE;
+  return fd;
+}
+
+/*
+ * the stand-in: accept, answer every C0 C1 with S0 S1 S2, read C2 and close
+ */
+void serve(int listen_fd) {
+  if (0 != loop_init(max_fds)) {
+    RTMP_Log(RTMP_LOGERROR, "event loop FAILED");
     die();
   }
+  fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+  loop_set(listen_fd, EV_READ);
 
-  RTMP_Log(RTMP_LOGDEBUG, "connected OK");
+  int fds[MAX_EVENTS], events[MAX_EVENTS];
+  while (true) {
+    int count = loop_wait(1000, fds, events, MAX_EVENTS);
+    for (int i = 0; i < count; ++i) {
+      if (fds[i] != listen_fd) {
+        handle(fds[i], events[i]);
+        continue;
+      }
 
-  byte c0[1] = {0x03};
-  send(sockfd, c0, 1, 0);
-  RTMP_Log(RTMP_LOGDEBUG, "send c0: %lu", sizeof(c0));
-  RTMP_LogHex(RTMP_LOGDEBUG, c0, 1);
+      int fd;
+      while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+        if (fd >= max_fds) {
+          close(fd);
+          continue;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        conn_t *conn = calloc(1, sizeof(conn_t));
+        conn->fd = fd;
+        conn->server = true;
+        conn->state = HANDSHAKING;
+        conn->begin = flv_now();
+        conn->events = EV_READ;
+        conns[fd] = conn;
+        loop_set(fd, EV_READ);
+      }
+    }
+  }
+}
 
-  byte c1[1536] = {0x00};
-  random_bytes(c1, 1536);
-  send(sockfd, c1, sizeof(c1), 0);
-  RTMP_Log(RTMP_LOGDEBUG, "send c1: %lu", sizeof(c1));
-  RTMP_LogHex(RTMP_LOGDEBUG, c1, 16);
+void handle(int fd, int events) {
+  conn_t *conn = conns[fd];
+  if (conn == NULL) return;
 
-  byte recv_buf[2046];
-  int count;
-  count = recv(sockfd, recv_buf, 1, 0);
-  RTMP_Log(RTMP_LOGDEBUG, "recv s0: %d", count);
-  RTMP_LogHex(RTMP_LOGDEBUG, recv_buf, count);
+  if (conn->state == CONNECTING) {
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (0 != getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) || error != 0) {
+      RTMP_Log(RTMP_LOGDEBUG, "connect FAILED: %s", strerror(error));
+      finish(conn, FAIL_CONNECT);
+      return;
+    }
+    RTMP_Log(RTMP_LOGDEBUG, "connected OK");
+    conn->state = HANDSHAKING;
+  }
 
-  count = recv(sockfd, recv_buf, 1536, 0);
-  RTMP_Log(RTMP_LOGDEBUG, "recv s1: %d", count);
-  RTMP_LogHex(RTMP_LOGDEBUG, recv_buf, 16);
+  if ((events & EV_WRITE) && conn->sent < conn->sendable) {
+    ssize_t n = send(fd, conn->out + conn->sent, conn->sendable - conn->sent, MSG_NOSIGNAL);
+    if (n < 0 && errno != EAGAIN && errno != EINTR) {
+      finish(conn, FAIL_IO);
+      return;
+    }
+    if (n > 0) conn->sent += n;
+  }
 
-  count = send(sockfd, recv_buf, 1536, 0);
-  RTMP_Log(RTMP_LOGDEBUG, "send c2: %d", 1536);
-  RTMP_LogHex(RTMP_LOGDEBUG, recv_buf, 16);
+  if ((events & EV_READ) && conn->received < HANDSHAKE_TOTAL) {
+    ssize_t n = recv(fd, conn->in + conn->received, HANDSHAKE_TOTAL - conn->received, 0);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+      finish(conn, FAIL_IO);
+      return;
+    }
+    if (n > 0) conn->received += n;
+  }
 
-  count = recv(sockfd, recv_buf, 1536, 0);
-  RTMP_Log(RTMP_LOGDEBUG, "recv s2: %d", 1536);
-  RTMP_LogHex(RTMP_LOGDEBUG, recv_buf, 16);
+  advance(conn);
+}
 
-  close(sockfd);
+/*
+ * next step once enough is in, then watch for whatever is still to be sent / read
+ */
+void advance(conn_t *conn) {
+  if (conn->received >= 1 + HANDSHAKE_SIZE && conn->sendable == (conn->server ? 0 : 1 + HANDSHAKE_SIZE)) {
+    if (conn->in[0] != RTMP_VERSION) {
+      finish(conn, FAIL_VERSION);
+      return;
+    }
 
+    if (conn->server) {
+      // S0 S1 S2, S2 echoes C1
+      conn->out[0] = RTMP_VERSION;
+      fill_random(conn->out + 1, HANDSHAKE_SIZE);
+      memset(conn->out + 1, 0, 8);
+      memcpy(conn->out + 1 + HANDSHAKE_SIZE, conn->in + 1, HANDSHAKE_SIZE);
+    } else {
+      // C2 echoes S1
+      RTMP_LogHex(RTMP_LOGDEBUG, conn->in + 1, 16);
+      memcpy(conn->out + 1 + HANDSHAKE_SIZE, conn->in + 1, HANDSHAKE_SIZE);
+    }
+    conn->sendable = HANDSHAKE_TOTAL;
+  }
+
+  if (conn->sent == HANDSHAKE_TOTAL && conn->received == HANDSHAKE_TOTAL) {
+    // S2 should echo C1's random part
+    if (!conn->server && 0 != memcmp(conn->in + 1 + HANDSHAKE_SIZE + 8, conn->out + 1 + 8, HANDSHAKE_SIZE - 8)) ++stats.echo_mismatch;
+    finish(conn, -1);
+    return;
+  }
+
+  int events = (conn->sent < conn->sendable ? EV_WRITE : 0) | (conn->received < HANDSHAKE_TOTAL ? EV_READ : 0);
+  if (events != conn->events) {
+    loop_set(conn->fd, events);
+    conn->events = events;
+  }
+}
+
+/*
+ * @param[in] failure: enum failures, -1 for a completed handshake
+ */
+void finish(conn_t *conn, int failure) {
+  if (!conn->server) {
+    if (failure < 0) {
+      stats.latency[stats.completed++] = (flv_now() - conn->begin) * 1000;
+    } else {
+      ++stats.failed[failure];
+    }
+  }
+
+  loop_set(conn->fd, 0);
+  close(conn->fd);
+  conns[conn->fd] = NULL;
+  free(conn);
+}
+
+uint64_t in_flight() {
+  uint64_t done = stats.completed;
+  for (int i = 0; i < FAIL_COUNT; ++i) done += stats.failed[i];
+  return stats.started - done;
+}
+
+void report(double elapsed) {
+  uint64_t failed = 0;
+  for (int i = 0; i < FAIL_COUNT; ++i) failed += stats.failed[i];
+  RTMP_Log(RTMP_LOGINFO, "handshake: %lu ok, %lu failed in %.2f s, %.0f handshakes/s", (unsigned long) stats.completed, (unsigned long) failed, elapsed, elapsed > 0 ? stats.completed / elapsed : 0);
+  for (int i = 0; i < FAIL_COUNT; ++i) {
+    if (stats.failed[i]) RTMP_Log(RTMP_LOGINFO, "  %s: %lu", failure_names[i], (unsigned long) stats.failed[i]);
+  }
+  if (stats.echo_mismatch) RTMP_Log(RTMP_LOGINFO, "  S2 doesn't echo C1: %lu", (unsigned long) stats.echo_mismatch);
+  if (stats.completed == 0) return;
+
+  qsort(stats.latency, stats.completed, sizeof(double), compare_double);
+  RTMP_Log(RTMP_LOGINFO, "latency: p50 %.3f ms, p99 %.3f ms, max %.3f ms", stats.latency[stats.completed / 2], stats.latency[(stats.completed - 1) * 99 / 100], stats.latency[stats.completed - 1]);
+}
+
+int listen_local(uint16_t port) {
+  int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  struct sockaddr_in addr = {0};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  if (fd < 0 || 0 != bind(fd, (struct sockaddr *) &addr, sizeof(addr)) || 0 != listen(fd, SOMAXCONN)) {
+    RTMP_Log(RTMP_LOGERROR, "listen on 127.0.0.1:%u FAILED: %s", port, strerror(errno));
+    if (fd >= 0) close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/*
+ * event loop: epoll on linux, poll() elsewhere. both level triggered, events 0 removes the fd
+ */
+#ifdef __linux__
+int loop_init(int capacity) {
+  loop.capacity = capacity;
+  loop.epfd = epoll_create1(0);
+  return loop.epfd < 0 ? -1 : 0;
+}
+
+void loop_set(int fd, int events) {
+  struct epoll_event ev = {0};
+  ev.events = (events & EV_READ ? EPOLLIN : 0) | (events & EV_WRITE ? EPOLLOUT : 0);
+  ev.data.fd = fd;
+  if (events == 0) {
+    epoll_ctl(loop.epfd, EPOLL_CTL_DEL, fd, &ev);
+  } else if (0 != epoll_ctl(loop.epfd, EPOLL_CTL_MOD, fd, &ev)) {
+    epoll_ctl(loop.epfd, EPOLL_CTL_ADD, fd, &ev);
+  }
+}
+
+int loop_wait(int timeout_ms, int *fds, int *events, int max) {
+  struct epoll_event ready[MAX_EVENTS];
+  int count = epoll_wait(loop.epfd, ready, max < MAX_EVENTS ? max : MAX_EVENTS, timeout_ms);
+  for (int i = 0; i < count; ++i) {
+    fds[i] = ready[i].data.fd;
+    // errors and hangups show up as a failing read / write
+    events[i] = (ready[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP) ? EV_READ : 0) | (ready[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP) ? EV_WRITE : 0);
+  }
+  return count < 0 ? 0 : count;
+}
+#else
+int loop_init(int capacity) {
+  loop.capacity = capacity;
+  loop.fds = malloc(capacity * sizeof(struct pollfd));
+  if (loop.fds == NULL) return -1;
+  for (int i = 0; i < capacity; ++i) loop.fds[i].fd = -1;
   return 0;
 }
 
+void loop_set(int fd, int events) {
+  loop.fds[fd].fd = events ? fd : -1;
+  loop.fds[fd].events = (events & EV_READ ? POLLIN : 0) | (events & EV_WRITE ? POLLOUT : 0);
+  loop.fds[fd].revents = 0;
+  if (events && fd >= loop.nfds) loop.nfds = fd + 1;
+}
+
+int loop_wait(int timeout_ms, int *fds, int *events, int max) {
+  if (poll(loop.fds, loop.nfds, timeout_ms) <= 0) return 0;
+
+  int count = 0;
+  for (int fd = 0; fd < loop.nfds && count < max; ++fd) {
+    short revents = loop.fds[fd].fd < 0 ? 0 : loop.fds[fd].revents;
+    if (revents == 0) continue;
+    fds[count] = fd;
+    events[count++] = (revents & (POLLIN | POLLERR | POLLHUP) ? EV_READ : 0) | (revents & (POLLOUT | POLLERR | POLLHUP) ? EV_WRITE : 0);
+  }
+  return count;
+}
+#endif
+
+/*
+ * xorshift64, 8 bytes per step instead of rand() per byte
+ */
+void fill_random(byte *buffer, size_t size) {
+  uint64_t x = seed;
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    memcpy(buffer + i, &x, 8);
+  }
+  for (; i < size; ++i) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    buffer[i] = (byte) x;
+  }
+  seed = x;
+}
+
 void print_addr(struct hostent *host, struct sockaddr_in *addr) {
   char buffer[INET_ADDRSTRLEN];
   inet_ntop(AF_INET, &addr->sin_addr, buffer, sizeof(buffer));
@@ -87,8 +542,8 @@ void print_addr(struct hostent *host, struct sockaddr_in *addr) {
   RTMP_Log(RTMP_LOGDEBUG, "%s", buffer);
 }
 
-void random_bytes(byte *buffer, size_t size) {
-  for (int i = 0; i < size; ++i) {
-    buffer[i] = rand() % 0xff;
-  }
-}
\ No newline at end of file
+int compare_double(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
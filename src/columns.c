@@ -0,0 +1,312 @@
+#include "columns.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  byte *data;
+  size_t size;
+  size_t capacity;
+} column_buf_t;
+
+static bool reserve(columns_t *, size_t);
+static bool put(column_buf_t *, const byte *, size_t);
+static bool put_varint(column_buf_t *, uint64_t);
+static bool encode(column_buf_t *, const columns_t *, int, int);
+static int decode(columns_t *, int, int, const byte *, size_t);
+static const byte *get_varint(const byte *, const byte *, uint64_t *);
+static uint64_t nalu_types(const flv_video_t *, uint8_t);
+
+static inline uint64_t zigzag(int64_t v) { return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63); }
+static inline int64_t unzigzag(uint64_t v) { return (int64_t) (v >> 1) ^ -(int64_t) (v & 1); }
+
+// how every column is stored
+static const uint8_t column_encodings[] = {ENCODING_RLE, ENCODING_DELTA_ZIGZAG, ENCODING_ZIGZAG, ENCODING_VARINT, ENCODING_RLE, ENCODING_VARINT, ENCODING_VARINT};
+
+void columns_init(columns_t *columns) {
+  memset(columns, 0, sizeof(columns_t));
+  columns->length_size = 4;
+}
+
+int columns_add(columns_t *columns, const flv_tag_t *tag) {
+  if (!reserve(columns, columns->count + 1)) {
+    snprintf(columns->error, sizeof(columns->error), "out of memory at %zu tags", columns->count);
+    return -1;
+  }
+
+  size_t n = columns->count++;
+  columns->type[n] = tag->tag_type;
+  columns->dts[n] = tag->timestamp;
+  columns->cts[n] = 0;
+  columns->size[n] = tag->data_size;
+  columns->frame_type[n] = 0;
+  columns->nalus[n] = 0;
+  columns->offset[n] = tag->offset;
+
+  flv_video_t video;
+  if (0 != flv_parse_video(tag, &video)) return 0;
+  columns->frame_type[n] = video.frame_type;
+  // AV1 has no composition time, its OBUs aren't NALUs
+  if (FLV_CODEC_ID_AVC != video.codec_id && FLV_CODEC_ID_HEVC != video.codec_id) return 0;
+
+  columns->cts[n] = video.composition_time;
+  if (AVC_SEQUENCE_HEADER == video.avc_packet_type) {
+    flv_avc_config_t avc;
+    flv_hevc_config_t hevc;
+    if (FLV_CODEC_ID_AVC == video.codec_id && 0 == flv_parse_avc_config(video.data, video.size, &avc)) columns->length_size = avc.length_size;
+    if (FLV_CODEC_ID_HEVC == video.codec_id && 0 == flv_parse_hevc_config(video.data, video.size, &hevc)) columns->length_size = hevc.length_size;
+  } else if (AVC_NALU == video.avc_packet_type) {
+    columns->nalus[n] = nalu_types(&video, columns->length_size);
+  }
+  return 0;
+}
+
+int columns_write(const columns_t *columns, const char *path) {
+  column_buf_t out = {0}, column = {0};
+  bool ok = put(&out, (const byte *) COLUMNS_MAGIC, 4) && put(&out, (const byte[]){COLUMNS_VERSION}, 1) && put_varint(&out, columns->count) && put_varint(&out, COLUMN_COUNT);
+  for (int id = 0; ok && id < COLUMN_COUNT; ++id) {
+    column.size = 0;
+    ok = encode(&column, columns, id, column_encodings[id]) && put(&out, (const byte[]){id, column_encodings[id]}, 2) && put_varint(&out, column.size) && put(&out, column.data, column.size);
+  }
+
+  FILE *file = ok ? (0 == strcmp(path, "-") ? stdout : fopen(path, "wb")) : NULL;
+  if (file == NULL || fwrite(out.data, 1, out.size, file) != out.size) ok = false;
+  if (file && file != stdout) fclose(file);
+  if (file == stdout) fflush(stdout);
+  free(out.data);
+  free(column.data);
+  return ok ? 0 : -1;
+}
+
+int columns_read(columns_t *columns, const char *path) {
+  columns_init(columns);
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    snprintf(columns->error, sizeof(columns->error), "open %s FAILED", path);
+    return -1;
+  }
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  byte *data = malloc(size > 0 ? size : 1);
+  bool ok = data && size > 0 && fread(data, 1, size, file) == (size_t) size;
+  fclose(file);
+
+  const byte *p = data, *end = data + size;
+  uint64_t count = 0, column_count = 0;
+  // every tag takes at least a byte of the dts column, a larger count is damage
+  if (!ok || size < 5 || 0 != memcmp(p, COLUMNS_MAGIC, 4) || p[4] != COLUMNS_VERSION || !(p = get_varint(p + 5, end, &count)) || !(p = get_varint(p, end, &column_count)) || count > (uint64_t) size ||
+      !reserve(columns, count)) {
+    snprintf(columns->error, sizeof(columns->error), "%s: not a version %d column file", path, COLUMNS_VERSION);
+    free(data);
+    return -1;
+  }
+  columns->count = count;
+
+  // unknown columns (a later version) are skipped, every known one must be there
+  uint32_t found = 0;
+  for (uint64_t i = 0; i < column_count; ++i) {
+    const byte *column;
+    uint64_t column_size;
+    if (end - p < 2 || !(column = get_varint(p + 2, end, &column_size)) || column_size > (uint64_t) (end - column)) break;
+    if (p[0] < COLUMN_COUNT) {
+      if (0 != decode(columns, p[0], p[1], column, column_size)) break;
+      found |= 1u << p[0];
+    }
+    p = column + column_size;
+  }
+  free(data);
+  if (found != (1u << COLUMN_COUNT) - 1) {
+    snprintf(columns->error, sizeof(columns->error), "%s: damaged or missing columns", path);
+    return -1;
+  }
+
+  // offsets from the gaps
+  for (size_t n = 1; n < columns->count; ++n) columns->offset[n] += columns->offset[n - 1] + FLV_TAG_HEADER_SIZE + columns->size[n - 1] + FLV_PREV_TAG_SIZE;
+  return 0;
+}
+
+int columns_index(const columns_t *columns, flv_index_t *index) {
+  memset(index, 0, sizeof(flv_index_t));
+  if (!(index->entries = malloc(sizeof(flv_index_entry_t) * (columns->count + 1)))) return -1;
+  index->capacity = columns->count + 1;
+  for (size_t n = 0; n < columns->count; ++n) {
+    index->entries[n] = (flv_index_entry_t){columns->offset[n], columns->dts[n], columns->size[n], columns->type[n], columns->frame_type[n]};
+  }
+  index->count = columns->count;
+  return 0;
+}
+
+void columns_free(columns_t *columns) {
+  free(columns->type);
+  free(columns->dts);
+  free(columns->cts);
+  free(columns->size);
+  free(columns->frame_type);
+  free(columns->nalus);
+  free(columns->offset);
+  columns_init(columns);
+}
+
+static bool reserve(columns_t *columns, size_t count) {
+  if (count <= columns->capacity) return true;
+  size_t capacity = columns->capacity ? columns->capacity : 4096;
+  while (capacity < count) {
+    if (capacity > SIZE_MAX / 2 / sizeof(uint64_t)) return false; // the widest column, offset
+    capacity *= 2;
+  }
+
+#define GROW(field) \
+  do { \
+    void *p = realloc(columns->field, capacity * sizeof(*columns->field)); \
+    if (p == NULL) return false; \
+    columns->field = p; \
+  } while (0)
+  GROW(type);
+  GROW(dts);
+  GROW(cts);
+  GROW(size);
+  GROW(frame_type);
+  GROW(nalus);
+  GROW(offset);
+#undef GROW
+
+  columns->capacity = capacity;
+  return true;
+}
+
+static bool put(column_buf_t *buf, const byte *data, size_t size) {
+  if (buf->size + size > buf->capacity) {
+    size_t capacity = buf->capacity ? buf->capacity * 2 : 65536;
+    while (capacity < buf->size + size) capacity *= 2;
+    byte *p = realloc(buf->data, capacity);
+    if (p == NULL) return false;
+    buf->data = p;
+    buf->capacity = capacity;
+  }
+  memcpy(buf->data + buf->size, data, size);
+  buf->size += size;
+  return true;
+}
+
+// LEB128: 7 bits per byte, low group first
+static bool put_varint(column_buf_t *buf, uint64_t v) {
+  byte bytes[10];
+  size_t n = 0;
+  while (v >= 0x80) {
+    bytes[n++] = (byte) v | 0x80;
+    v >>= 7;
+  }
+  bytes[n++] = (byte) v;
+  return put(buf, bytes, n);
+}
+
+static const byte *get_varint(const byte *p, const byte *end, uint64_t *v) {
+  *v = 0;
+  for (int shift = 0; p < end && shift < 64; shift += 7) {
+    byte b = *p++;
+    *v |= (uint64_t) (b & 0x7f) << shift;
+    if (!(b & 0x80)) return p;
+  }
+  return NULL;
+}
+
+/*
+ * the column as signed / unsigned 64-bit values, so every encoding works on every column
+ */
+static inline int64_t column_value(const columns_t *columns, int id, size_t n) {
+  switch (id) {
+  case COLUMN_TYPE: return columns->type[n];
+  case COLUMN_DTS: return columns->dts[n];
+  case COLUMN_CTS: return columns->cts[n];
+  case COLUMN_SIZE: return columns->size[n];
+  case COLUMN_FRAME_TYPE: return columns->frame_type[n];
+  case COLUMN_NALUS: return columns->nalus[n];
+  default:
+    // gap to the end of the previous tag
+    return n == 0 ? (int64_t) columns->offset[0] : (int64_t) (columns->offset[n] - columns->offset[n - 1] - FLV_TAG_HEADER_SIZE - columns->size[n - 1] - FLV_PREV_TAG_SIZE);
+  }
+}
+
+static inline void set_column_value(columns_t *columns, int id, size_t n, int64_t v) {
+  switch (id) {
+  case COLUMN_TYPE: columns->type[n] = v; break;
+  case COLUMN_DTS: columns->dts[n] = v; break;
+  case COLUMN_CTS: columns->cts[n] = v; break;
+  case COLUMN_SIZE: columns->size[n] = v; break;
+  case COLUMN_FRAME_TYPE: columns->frame_type[n] = v; break;
+  case COLUMN_NALUS: columns->nalus[n] = v; break;
+  default: columns->offset[n] = v; break; // the gap, resolved once all columns are in
+  }
+}
+
+static bool encode(column_buf_t *buf, const columns_t *columns, int id, int encoding) {
+  int64_t previous = 0;
+  for (size_t n = 0; n < columns->count; ++n) {
+    int64_t v = column_value(columns, id, n);
+    bool ok = true;
+    switch (encoding) {
+    case ENCODING_RLE: {
+      size_t run = 1;
+      while (n + run < columns->count && column_value(columns, id, n + run) == v) ++run;
+      ok = put_varint(buf, (uint64_t) v) && put_varint(buf, run);
+      n += run - 1;
+      break;
+    }
+    case ENCODING_VARINT:
+      ok = put_varint(buf, (uint64_t) v);
+      break;
+    case ENCODING_ZIGZAG:
+      ok = put_varint(buf, zigzag(v));
+      break;
+    case ENCODING_DELTA_ZIGZAG:
+      ok = put_varint(buf, zigzag(v - previous));
+      previous = v;
+      break;
+    }
+    if (!ok) return false;
+  }
+  return true;
+}
+
+static int decode(columns_t *columns, int id, int encoding, const byte *p, size_t size) {
+  const byte *end = p + size;
+  int64_t previous = 0;
+  uint64_t v, run;
+  for (size_t n = 0; n < columns->count;) {
+    if (!(p = get_varint(p, end, &v))) return -1;
+    switch (encoding) {
+    case ENCODING_RLE:
+      if (!(p = get_varint(p, end, &run)) || run > columns->count - n) return -1;
+      while (run--) set_column_value(columns, id, n++, (int64_t) v);
+      continue;
+    case ENCODING_VARINT:
+      set_column_value(columns, id, n, (int64_t) v);
+      break;
+    case ENCODING_ZIGZAG:
+      set_column_value(columns, id, n, unzigzag(v));
+      break;
+    case ENCODING_DELTA_ZIGZAG:
+      previous += unzigzag(v);
+      set_column_value(columns, id, n, previous);
+      break;
+    default:
+      return -1;
+    }
+    ++n;
+  }
+  return 0;
+}
+
+static uint64_t nalu_types(const flv_video_t *video, uint8_t length_size) {
+  bool hevc = FLV_CODEC_ID_HEVC == video->codec_id;
+  flv_nalu_iter_t iter;
+  const byte *nalu;
+  uint32_t size;
+  uint64_t types = 0;
+  flv_nalu_iter_init(&iter, video->data, video->size, length_size);
+  while (flv_nalu_next(&iter, &nalu, &size)) {
+    if (size > 0) types |= 1ull << (hevc ? flv_hevc_nalu_type(nalu) : nalu[0] & 0x1f);
+  }
+  return types;
+}
@@ -1,86 +1,180 @@
+#include "bus.h"
+#include "flv.h"
+#include "metrics.h"
 #include <librtmp/rtmp.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #define APP_SUCCESS 0
 #define APP_FAILED 1
 
+// first retry right away, then after 100 ms, doubled up to max_backoff_ms
+#define BACKOFF_MIN_MS (100)
+
+enum sequence_headers { HEADER_VIDEO, HEADER_AAC, HEADER_METADATA, HEADER_COUNT };
+
+typedef struct {
+  RTMP rtmp;
+  char *url; // RTMP_SetupURL keeps pointers into it
+  bool connected;
+} connection_t;
+
+// RTMP_Read output cut into tags, a tag may straddle two reads
+typedef struct {
+  byte *data;
+  size_t size;
+  size_t capacity;
+  bool header; // FLV header of the current connection skipped
+} assembler_t;
+
 // rtmpdump -r rtmp://media3.scctv.net/live/scctv_800 -o test.flv
 static void usage();
-static void parse_args(int, char **, char **, char **);
+static void parse_args(int, char **, char **, char **, char **);
 static void sigIntHandler(int);
+static bool open_connection(connection_t *, const char *, bool);
+static void close_connection(connection_t *);
+static bool reconnect(connection_t **, connection_t **, const char *);
+static int feed(assembler_t *, const byte *, size_t);
+static int write_tag(const flv_tag_t *);
+static int header_slot(const flv_tag_t *);
+
+static uint32_t max_backoff_ms = 5000; // 0: no reconnect, the recording ends with the stream
+static bool hot_standby = false;
+static int timeout = 0; // s, 0: librtmp default
+static char *bus_path = NULL;
+
+static flv_writer_t *writer = NULL;
+static bus_t *bus = NULL;
+// last written sequence headers / metadata, a reconnect only writes them again when they changed
+static byte *headers[HEADER_COUNT];
+static uint32_t header_sizes[HEADER_COUNT];
+// output timestamp = input timestamp + offset, rebased on the first tag after a reconnect
+static int64_t ts_offset = 0;
+static uint32_t ts_floor = 0;
+static uint32_t last_ts = 0;
+static bool rebase = false;
+static double last_tag_time = 0; // of the last media tag, 0: none written yet
+// gaps: last tag before the drop to first tag after the reconnect
+static uint32_t reconnects = 0;
+static uint32_t standby_used = 0;
+static double gap_total = 0;
+static double gap_max = 0;
 
 int main(int argc, char *argv[]) {
   // data
-  FILE *file = 0;
   char *output = "out.flv";
   char *url;
-  RTMP rtmp = {0};
+  char *metrics = NULL;
+  connection_t connections[2] = {0};
+  connection_t *primary = &connections[0];
+  connection_t *standby = NULL;
 
   // parse options and arguments
-  parse_args(argc, argv, &url, &output);
-  printf("rtmp url: %s\n", url);
-  printf("output: %s\n", output);
-  if (!(file = fopen(output, "wb"))) {
+  parse_args(argc, argv, &url, &output, &metrics);
+  if (hot_standby) standby = &connections[1];
+  // -o -: flv to stdout for a pipe (packager), progress goes to stderr
+  FILE *info = 0 == strcmp(output, "-") ? stderr : stdout;
+  fprintf(info, "rtmp url: %s\n", url);
+  fprintf(info, "output: %s\n", output);
+  if (!(writer = flv_writer_open(output, 0x05))) {
     fprintf(stderr, "Open file FAILED\n");
-    fclose(file);
     exit(APP_FAILED);
   }
 
-  signal(SIGINT, sigIntHandler);
-
-  RTMP_Init(&rtmp);
-
-  if (!RTMP_SetupURL(&rtmp, url)) {
-    fprintf(stderr, "RTMP SetupURL FAILED\n");
-    return APP_FAILED;
-  }
+  // downstream jobs attach to the bus instead of re-reading the file
+  if (bus_path && !(bus = bus_create(bus_path, BUS_DEFAULT_CAPACITY))) exit(APP_FAILED);
 
-  if (!RTMP_Connect(&rtmp, NULL)) {
-    fprintf(stderr, "RTMP Connect FAILED\n");
-    RTMP_Close(&rtmp);
-    return APP_FAILED;
-  }
+  signal(SIGINT, sigIntHandler);
+  metrics_init("dump", metrics, 1000);
 
-  if (!RTMP_ConnectStream(&rtmp, 0)) {
-    fprintf(stderr, "RTMP ConnectStream FAILED\n");
-    RTMP_Close(&rtmp);
-    return APP_FAILED;
-  }
+  if (!open_connection(primary, url, true)) return APP_FAILED;
+  if (standby) open_connection(standby, url, false);
 
   int size = 2 * 1024 * 1024; // 2M bytes
   char buffer[size];
+  assembler_t assembler = {0};
   int count;
-  int total;
+  uint64_t total = 0;
+  time_t last_report = 0;
+
+  while (!RTMP_ctrlC) {
+    METRIC_BEGIN(read);
+    count = RTMP_Read(&primary->rtmp, buffer, size);
+    if (count <= 0) {
+      // upstream dropped (or the stream ended): same file, rebased timestamps
+      close_connection(primary);
+      if (max_backoff_ms == 0 || RTMP_ctrlC) break;
+      fprintf(info, "upstream lost after %.2f MB, reconnecting\n", total / 1024.0 / 1024);
+      if (!reconnect(&primary, &standby, url)) break;
+      assembler.size = 0;
+      assembler.header = false;
+      rebase = true;
+      continue;
+    }
+    METRIC_END(read, METRIC_READ, count);
 
-  while (!RTMP_ctrlC && (count = RTMP_Read(&rtmp, buffer, size)) > 0) {
-    if (fwrite(buffer, sizeof(char), count, file) != count) {
-      fprintf(stderr, "RTMP read FAILED\n");
+    METRIC_BEGIN(write);
+    if (0 != feed(&assembler, (const byte *) buffer, count)) {
+      fprintf(stderr, "Write file FAILED\n");
       break;
     }
+    METRIC_END(write, METRIC_WRITE, count);
+
+    if (bus) bus_serve(bus);
     total += count;
-    printf("Receive: %5d Byte, Total: %5.2f kB\n", count, total * 1.0 / 1024);
+    // progress once per second, not per read
+    if (time(NULL) != last_report) {
+      last_report = time(NULL);
+      fprintf(info, "Receive: %5d Byte, Total: %5.2f kB\n", count, total * 1.0 / 1024);
+    }
   }
 
-  printf("# EOF");
-  fclose(file);
-  RTMP_Close(&rtmp);
+  if (reconnects) fprintf(info, "reconnects: %u (%u hot standby), gaps: %.3f s total, %.3f s max\n", reconnects, standby_used, gap_total, gap_max);
+  if (bus) fprintf(info, "bus: %llu tags, %.2f MB, %llu wakeups, %llu readers evicted\n", (unsigned long long) bus->tags, bus->bytes / 1024.0 / 1024, (unsigned long long) bus->wakeups, (unsigned long long) bus->evicted);
+  fprintf(info, "# EOF");
+  flv_writer_close(writer);
+  bus_close(bus);
+  close_connection(primary);
+  if (standby) close_connection(standby);
+  free(assembler.data);
+  for (int i = 0; i < HEADER_COUNT; ++i) free(headers[i]);
+  metrics_stop();
 
   return APP_SUCCESS;
 }
 
 static void usage() {
-  printf("Usage: dump -o out.flv rtmp://media3.scctv.net/live/scctv_800\n");
+  printf("Usage: dump [-m metrics] [-r max_backoff_ms] [-s] [-t timeout_s] [-b bus.sock] -o out.flv rtmp://media3.scctv.net/live/scctv_800\n");
+  printf("  -r 0: no reconnect, -s: keep a connected standby to play from on a drop\n");
+  printf("  -b: publish the tags on a shared-memory bus, readers attach with subscribe bus.sock (linux)\n");
 }
 
-static void parse_args(int argc, char *argv[], char **url, char **output) {
+static void parse_args(int argc, char *argv[], char **url, char **output, char **metrics) {
   int c;
-  while ((c = getopt(argc, argv, "o:")) != -1) {
+  while ((c = getopt(argc, argv, "o:m:r:st:b:")) != -1) {
     switch (c) {
     case 'o':
       *output = optarg;
       break;
+    case 'm':
+      *metrics = optarg;
+      break;
+    case 'r':
+      max_backoff_ms = atoi(optarg);
+      break;
+    case 's':
+      hot_standby = true;
+      break;
+    case 't':
+      timeout = atoi(optarg);
+      break;
+    case 'b':
+      bus_path = optarg;
+      break;
     default:
       usage();
       break;
@@ -96,6 +190,178 @@ static void parse_args(int argc, char *argv[], char **url, char **output) {
 
 static void sigIntHandler(int sig) {
   RTMP_ctrlC = TRUE;
-  printf("  Caught signal: %d, cleaning up, just a second...\n", sig);
+  fprintf(stderr, "  Caught signal: %d, cleaning up, just a second...\n", sig);
   signal(SIGINT, SIG_IGN);
-}
\ No newline at end of file
+}
+
+/*
+ * @param[in] play: createStream + play, otherwise only handshake and connect (a standby)
+ */
+static bool open_connection(connection_t *connection, const char *url, bool play) {
+  close_connection(connection);
+  RTMP_Init(&connection->rtmp);
+  connection->url = strdup(url);
+
+  if (!RTMP_SetupURL(&connection->rtmp, connection->url)) {
+    fprintf(stderr, "RTMP SetupURL FAILED\n");
+    return false;
+  }
+  // a silent upstream is detected after timeout instead of librtmp's 30 s
+  if (timeout > 0) connection->rtmp.Link.timeout = timeout;
+
+  if (!RTMP_Connect(&connection->rtmp, NULL)) {
+    fprintf(stderr, "RTMP Connect FAILED\n");
+    return false;
+  }
+  connection->connected = true;
+
+  if (play && !RTMP_ConnectStream(&connection->rtmp, 0)) {
+    fprintf(stderr, "RTMP ConnectStream FAILED\n");
+    return false;
+  }
+  return true;
+}
+
+static void close_connection(connection_t *connection) {
+  if (connection->connected) RTMP_Close(&connection->rtmp);
+  free(connection->url);
+  connection->url = NULL;
+  connection->connected = false;
+}
+
+/*
+ * play from the standby if there is one, otherwise (or if it went stale) connect with backoff.
+ * @return false on ctrl-c
+ */
+static bool reconnect(connection_t **primary, connection_t **standby, const char *url) {
+  METRIC_BEGIN(gap);
+  ++reconnects;
+  bool done = false;
+
+  // only play is left, the handshake and connect round trips are already paid
+  if (*standby && (*standby)->connected) {
+    if (RTMP_ConnectStream(&(*standby)->rtmp, 0)) {
+      connection_t *swap = *primary;
+      *primary = *standby;
+      *standby = swap;
+      ++standby_used;
+      done = true;
+    } else {
+      close_connection(*standby);
+    }
+  }
+
+  uint32_t backoff = BACKOFF_MIN_MS;
+  while (!done && !RTMP_ctrlC) {
+    if (open_connection(*primary, url, true)) break;
+    usleep(backoff * 1000);
+    backoff = backoff * 2 > max_backoff_ms ? max_backoff_ms : backoff * 2;
+  }
+  if (RTMP_ctrlC) return false;
+  METRIC_END(gap, METRIC_GAP, 0);
+
+  // the next drop gets a fresh standby
+  if (*standby) open_connection(*standby, url, false);
+  return true;
+}
+
+/*
+ * append a read, write every complete tag, keep the rest for the next read
+ */
+static int feed(assembler_t *assembler, const byte *data, size_t size) {
+  if (assembler->size + size > assembler->capacity) {
+    size_t capacity = assembler->size + size;
+    byte *p = realloc(assembler->data, capacity);
+    if (p == NULL) return -1;
+    assembler->data = p;
+    assembler->capacity = capacity;
+  }
+  memcpy(assembler->data + assembler->size, data, size);
+  assembler->size += size;
+
+  const byte *p = assembler->data;
+  size_t remaining = assembler->size;
+  // every connection starts with its own FLV header
+  if (!assembler->header) {
+    if (remaining < FLV_HEADER_SIZE + FLV_PREV_TAG_SIZE) return 0;
+    if (0 == memcmp(p, "FLV", 3)) {
+      size_t skip = flv_ui32(p + 5) + FLV_PREV_TAG_SIZE;
+      if (remaining < skip) return 0;
+      p += skip;
+      remaining -= skip;
+    }
+    assembler->header = true;
+  }
+
+  while (remaining >= FLV_TAG_HEADER_SIZE) {
+    flv_tag_t tag = {0};
+    tag.tag_type = p[0] & 0x1f;
+    tag.data_size = flv_ui24(p + 1);
+    if (remaining < FLV_TAG_HEADER_SIZE + tag.data_size + FLV_PREV_TAG_SIZE) break;
+    tag.timestamp = flv_ui24(p + 4) | ((uint32_t) p[7] << 24);
+    tag.head = p;
+    tag.data = p + FLV_TAG_HEADER_SIZE;
+    if (0 != write_tag(&tag)) return -1;
+
+    p += FLV_TAG_HEADER_SIZE + tag.data_size + FLV_PREV_TAG_SIZE;
+    remaining -= FLV_TAG_HEADER_SIZE + tag.data_size + FLV_PREV_TAG_SIZE;
+  }
+
+  memmove(assembler->data, p, remaining);
+  assembler->size = remaining;
+  return 0;
+}
+
+static int write_tag(const flv_tag_t *tag) {
+  int slot = header_slot(tag);
+  if (slot >= 0) {
+    if (header_sizes[slot] == tag->data_size && 0 == memcmp(headers[slot], tag->data, tag->data_size)) return 0;
+    byte *copy = realloc(headers[slot], tag->data_size);
+    if (copy == NULL) return -1;
+    memcpy(copy, tag->data, tag->data_size);
+    headers[slot] = copy;
+    header_sizes[slot] = tag->data_size;
+  }
+
+  double t = flv_now();
+  // continue where the last connection stopped, plus the time the stream was gone
+  if (rebase && TAGTYPE_SCRIPTDATAOBJECT != tag->tag_type && last_tag_time == 0) {
+    // no media written yet: nothing to continue from, start like a first connection
+    rebase = false;
+  } else if (rebase && TAGTYPE_SCRIPTDATAOBJECT != tag->tag_type) {
+    double gap = t - last_tag_time;
+    ts_offset = (int64_t) last_ts + (int64_t) (gap * 1000) - tag->timestamp;
+    ts_floor = last_ts;
+    rebase = false;
+    gap_total += gap;
+    if (gap > gap_max) gap_max = gap;
+    fprintf(stderr, "gap: %.3f s, timestamps continue at %u ms\n", gap, last_ts + (uint32_t) (gap * 1000));
+  }
+
+  int64_t timestamp = tag->timestamp + ts_offset;
+  // audio / video of the new connection may start a little apart
+  if (timestamp < ts_floor) timestamp = ts_floor;
+  if (TAGTYPE_SCRIPTDATAOBJECT == tag->tag_type) {
+    // script data doesn't move the clock, before the rebase its offset is still the last connection's
+    uint32_t at = rebase || timestamp < last_ts ? last_ts : (uint32_t) timestamp;
+    if (bus && 0 != bus_publish(bus, tag->tag_type, at, tag->data, tag->data_size)) fprintf(stderr, "bus: %s\n", bus->error);
+    return flv_write_tag(writer, tag->tag_type, at, tag->data, tag->data_size);
+  }
+  last_ts = (uint32_t) timestamp;
+  last_tag_time = t;
+  if (bus && 0 != bus_publish(bus, tag->tag_type, last_ts, tag->data, tag->data_size)) fprintf(stderr, "bus: %s\n", bus->error);
+  return flv_write_tag(writer, tag->tag_type, last_ts, tag->data, tag->data_size);
+}
+
+// @return enum sequence_headers, -1 for media
+static int header_slot(const flv_tag_t *tag) {
+  if (TAGTYPE_SCRIPTDATAOBJECT == tag->tag_type) return HEADER_METADATA;
+
+  flv_video_t video;
+  if (0 == flv_parse_video(tag, &video)) return flv_video_is_config(&video) ? HEADER_VIDEO : -1;
+
+  flv_audio_t audio;
+  if (0 == flv_parse_audio(tag, &audio)) return FLV_SOUND_FORMAT_AAC == audio.sound_format && AAC_SEQUENCE_HEADER == audio.aac_packet_type ? HEADER_AAC : -1;
+  return -1;
+}
+
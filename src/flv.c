@@ -0,0 +1,830 @@
+#include "flv.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+const char *flv_tag_types[] = {"", "", "", "", "", "", "", "", "audio", "video", "", "", "", "", "", "", "", "", "script data"};
+const char *frame_types[] = {"not defined by standard",
+                             "keyframe (for AVC, a seekable frame)",
+                             "inter frame (for AVC, a non-seekable frame)",
+                             "disposable inter frame (H.263 only)",
+                             "generated keyframe (reserved for server use only)",
+                             "video info/command frame"};
+
+const char *codec_ids[] = {"not defined by standard", "JPEG (currently unused)", "Sorenson H.263", "Screen video", "On2 VP6", "On2 VP6 with alpha channel", "Screen video version 2", "AVC", "", "", "", "", "HEVC", "AV1"};
+
+const char *avc_packet_types[] = {"AVC sequence header", "AVC NALU", "AVC end of sequence (lower level NALU sequence ender is not required or supported)"};
+
+const char *sound_formats[] = {"Linear PCM, platform endian", "ADPCM", "MP3", "Linear PCM, little endian", "Nellymoser 16 kHz mono", "Nellymoser 8 kHz mono", "Nellymoser", "G.711 A-law logarithmic PCM",
+                               "G.711 mu-law logarithmic PCM", "reserved", "AAC", "Speex", "", "", "MP3 8 kHz", "Device-specific sound"};
+
+const char *aac_packet_types[] = {"AAC sequence header", "AAC raw"};
+
+static const uint32_t aac_sample_rates[] = {96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350};
+
+static int read_header(flv_reader_t *);
+static int read_stream_tag(flv_reader_t *, flv_tag_t *);
+static int parse_ex_video(const flv_tag_t *, flv_video_t *);
+static bool reserve(flv_reader_t *, size_t);
+static bool valid_tag_type(uint8_t);
+static size_t find_candidate(const byte *, size_t, size_t);
+static void *index_range(void *);
+static int index_append(flv_index_t *, const flv_index_entry_t *, size_t);
+
+// one byte range of flv_index_build_parallel()
+typedef struct {
+  const flv_reader_t *reader;
+  uint64_t begin; // tags starting in [begin, end)
+  uint64_t end;
+  uint64_t start; // first tag, found by resync
+  uint64_t stop; // after the last tag: first tag at or past end, or the damaged tag
+  int ret; // 1: reached end, 0: end of file, -1: damaged tag at stop
+  char error[128];
+  flv_index_t index;
+} index_range_t;
+
+/*
+ * reader
+ */
+flv_reader_t *flv_open(const char *path) {
+  flv_reader_t *reader = calloc(1, sizeof(flv_reader_t));
+  reader->fd = 0 == strcmp(path, "-") ? STDIN_FILENO : open(path, O_RDONLY);
+  if (reader->fd < 0) {
+    free(reader);
+    return NULL;
+  }
+
+  struct stat st;
+  if (0 == fstat(reader->fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+    reader->size = (uint64_t) st.st_size;
+    reader->map = mmap(NULL, reader->size, PROT_READ, MAP_PRIVATE, reader->fd, 0);
+    if (MAP_FAILED == reader->map) reader->map = NULL;
+  }
+  if (reader->map) {
+    madvise((void *) reader->map, reader->size, MADV_SEQUENTIAL);
+  } else {
+    reader->stream = fdopen(reader->fd, "rb");
+  }
+
+  if (0 != read_header(reader)) {
+    flv_close(reader);
+    return NULL;
+  }
+  return reader;
+}
+
+void flv_close(flv_reader_t *reader) {
+  if (reader == NULL) return;
+  if (reader->map) munmap((void *) reader->map, reader->size);
+  if (reader->stream) {
+    fclose(reader->stream);
+  } else if (reader->fd > STDIN_FILENO) {
+    close(reader->fd);
+  }
+  free(reader->buffer);
+  free(reader);
+}
+
+static int read_header(flv_reader_t *reader) {
+  byte header[FLV_HEADER_SIZE];
+  if (reader->map) {
+    if (reader->size < FLV_HEADER_SIZE) return -1;
+    memcpy(header, reader->map, FLV_HEADER_SIZE);
+  } else if (1 != fread(header, FLV_HEADER_SIZE, 1, reader->stream)) {
+    return -1;
+  }
+  if (0 != memcmp(header, "FLV", 3)) return -1;
+
+  reader->header.version = header[3];
+  reader->header.type_flags = header[4];
+  reader->header.data_offset = flv_ui32(header + 5);
+  if (reader->header.data_offset < FLV_HEADER_SIZE) return -1;
+
+  // skip to the first tag, past PreviousTagSize0
+  reader->pos = reader->header.data_offset + FLV_PREV_TAG_SIZE;
+  if (reader->stream) {
+    for (uint64_t skip = reader->pos - FLV_HEADER_SIZE; skip > 0; --skip) {
+      if (EOF == fgetc(reader->stream)) return -1;
+    }
+  }
+  return 0;
+}
+
+int flv_read_tag(flv_reader_t *reader, flv_tag_t *tag) {
+  if (reader->stream) return read_stream_tag(reader, tag);
+  if (reader->pos >= reader->size) return 0;
+
+  const byte *p = reader->map + reader->pos;
+  size_t left = reader->size - reader->pos;
+  if (left < FLV_TAG_HEADER_SIZE) {
+    snprintf(reader->error, sizeof(reader->error), "truncated tag header at 0x%08llx", (unsigned long long) reader->pos);
+    return -1;
+  }
+
+  tag->offset = reader->pos;
+  tag->tag_type = p[0];
+  tag->data_size = flv_ui24(p + 1);
+  tag->timestamp = flv_ui24(p + 4) | ((uint32_t) p[7] << 24);
+  tag->stream_id = flv_ui24(p + 8);
+  tag->head = p;
+  tag->data = p + FLV_TAG_HEADER_SIZE;
+
+  if (!valid_tag_type(tag->tag_type)) {
+    snprintf(reader->error, sizeof(reader->error), "unknown tag type %u at 0x%08llx", tag->tag_type, (unsigned long long) reader->pos);
+    return -1;
+  }
+  if (left - FLV_TAG_HEADER_SIZE < tag->data_size) {
+    snprintf(reader->error, sizeof(reader->error), "truncated tag data at 0x%08llx", (unsigned long long) reader->pos);
+    return -1;
+  }
+
+  // the last PreviousTagSize may be missing, the next read reports end of file
+  reader->pos += FLV_TAG_HEADER_SIZE + tag->data_size + FLV_PREV_TAG_SIZE;
+  return 1;
+}
+
+int flv_read_tag_at(flv_reader_t *reader, uint64_t offset, flv_tag_t *tag) {
+  if (reader->stream) {
+    if (0 != fseeko(reader->stream, (off_t) offset, SEEK_SET)) {
+      snprintf(reader->error, sizeof(reader->error), "stream is not seekable");
+      return -1;
+    }
+  }
+  reader->pos = offset;
+  return flv_read_tag(reader, tag);
+}
+
+double flv_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int read_stream_tag(flv_reader_t *reader, flv_tag_t *tag) {
+  if (!reserve(reader, FLV_TAG_HEADER_SIZE)) return -1;
+
+  size_t count = fread(reader->buffer, 1, FLV_TAG_HEADER_SIZE, reader->stream);
+  if (count == 0) return 0;
+  if (count != FLV_TAG_HEADER_SIZE) {
+    snprintf(reader->error, sizeof(reader->error), "truncated tag header at 0x%08llx", (unsigned long long) reader->pos);
+    return -1;
+  }
+
+  const byte *p = reader->buffer;
+  tag->offset = reader->pos;
+  tag->tag_type = p[0];
+  tag->data_size = flv_ui24(p + 1);
+  tag->timestamp = flv_ui24(p + 4) | ((uint32_t) p[7] << 24);
+  tag->stream_id = flv_ui24(p + 8);
+
+  if (!valid_tag_type(tag->tag_type)) {
+    snprintf(reader->error, sizeof(reader->error), "unknown tag type %u at 0x%08llx", tag->tag_type, (unsigned long long) reader->pos);
+    return -1;
+  }
+
+  if (!reserve(reader, FLV_TAG_HEADER_SIZE + tag->data_size + FLV_PREV_TAG_SIZE)) return -1;
+  if (tag->data_size != fread(reader->buffer + FLV_TAG_HEADER_SIZE, 1, tag->data_size, reader->stream)) {
+    snprintf(reader->error, sizeof(reader->error), "truncated tag data at 0x%08llx", (unsigned long long) reader->pos);
+    return -1;
+  }
+  byte trailer[FLV_PREV_TAG_SIZE];
+  fread(trailer, 1, FLV_PREV_TAG_SIZE, reader->stream);
+
+  tag->head = reader->buffer;
+  tag->data = reader->buffer + FLV_TAG_HEADER_SIZE;
+  reader->pos += FLV_TAG_HEADER_SIZE + tag->data_size + FLV_PREV_TAG_SIZE;
+  return 1;
+}
+
+static bool reserve(flv_reader_t *reader, size_t size) {
+  if (size <= reader->capacity) return true;
+
+  size_t capacity = reader->capacity ? reader->capacity : 64 * 1024;
+  while (capacity < size) capacity *= 2;
+  byte *buffer = realloc(reader->buffer, capacity);
+  if (buffer == NULL) {
+    snprintf(reader->error, sizeof(reader->error), "out of memory");
+    return false;
+  }
+  reader->buffer = buffer;
+  reader->capacity = capacity;
+  return true;
+}
+
+static bool valid_tag_type(uint8_t type) { return type == TAGTYPE_AUDIODATA || type == TAGTYPE_VIDEODATA || type == TAGTYPE_SCRIPTDATAOBJECT; }
+
+/*
+ * tag payloads
+ */
+int flv_parse_video(const flv_tag_t *tag, flv_video_t *video) {
+  if (TAGTYPE_VIDEODATA != tag->tag_type || tag->data_size < 1) return -1;
+
+  const byte *p = tag->data;
+  video->avc_packet_type = 0;
+  video->composition_time = 0;
+  video->enhanced = p[0] & 0x80;
+  video->packet_type = 0;
+  video->fourcc = 0;
+  if (video->enhanced) return parse_ex_video(tag, video);
+
+  video->frame_type = flv_get_bits(p[0], 4, 4);
+  video->codec_id = flv_get_bits(p[0], 0, 4);
+  if (video->codec_id != FLV_CODEC_ID_AVC && video->codec_id != FLV_CODEC_ID_HEVC) {
+    video->data = p + 1;
+    video->size = tag->data_size - 1;
+    return 0;
+  }
+
+  // AVC, legacy HEVC: packet type + SI24 composition time
+  if (tag->data_size < 5) return -1;
+  video->avc_packet_type = p[1];
+  video->composition_time = (int32_t) (flv_ui24(p + 2) << 8) >> 8;
+  video->data = p + 5;
+  video->size = tag->data_size - 5;
+  return 0;
+}
+
+/*
+ * Enhanced RTMP: UB[1] IsExHeader, UB[3] FrameType, UB[4] PacketType, FOURCC, then for hvc1 CodedFrames SI24 composition time
+ */
+static int parse_ex_video(const flv_tag_t *tag, flv_video_t *video) {
+  const byte *p = tag->data;
+  video->frame_type = flv_get_bits(p[0], 4, 3);
+  video->packet_type = flv_get_bits(p[0], 0, 4);
+  video->codec_id = 0;
+  video->avc_packet_type = VIDEO_PACKET_OTHER;
+
+  // a command frame has a VideoCommand byte instead of the FourCC
+  if (FLV_FRAME_INFO == video->frame_type && FLV_EX_METADATA != video->packet_type) {
+    video->data = p + 1;
+    video->size = tag->data_size - 1;
+    return 0;
+  }
+  // multitrack and ModEx (v2) aren't supported
+  if (video->packet_type > FLV_EX_MPEG2TS_SEQUENCE_START || tag->data_size < 5) return -1;
+
+  video->fourcc = flv_ui32(p + 1);
+  video->codec_id = FLV_FOURCC_HEVC == video->fourcc ? FLV_CODEC_ID_HEVC : FLV_FOURCC_AV1 == video->fourcc ? FLV_CODEC_ID_AV1 : 0;
+  uint32_t header = 5;
+  switch (video->packet_type) {
+  case FLV_EX_SEQUENCE_START:
+    video->avc_packet_type = AVC_SEQUENCE_HEADER;
+    break;
+  case FLV_EX_CODED_FRAMES:
+    video->avc_packet_type = AVC_NALU;
+    if (FLV_CODEC_ID_HEVC != video->codec_id) break;
+    if (tag->data_size < 8) return -1;
+    video->composition_time = (int32_t) (flv_ui24(p + 5) << 8) >> 8;
+    header = 8;
+    break;
+  case FLV_EX_CODED_FRAMES_X: // composition time 0
+    video->avc_packet_type = AVC_NALU;
+    break;
+  case FLV_EX_SEQUENCE_END:
+    video->avc_packet_type = AVC_END_OF_SEQUENCE;
+    break;
+  }
+
+  video->data = p + header;
+  video->size = tag->data_size - header;
+  return 0;
+}
+
+int flv_parse_audio(const flv_tag_t *tag, flv_audio_t *audio) {
+  if (TAGTYPE_AUDIODATA != tag->tag_type || tag->data_size < 1) return -1;
+
+  const byte *p = tag->data;
+  audio->sound_format = flv_get_bits(p[0], 4, 4);
+  audio->sound_rate = flv_get_bits(p[0], 2, 2);
+  audio->sound_size = flv_get_bits(p[0], 1, 1);
+  audio->sound_type = flv_get_bits(p[0], 0, 1);
+  audio->aac_packet_type = 0;
+
+  if (audio->sound_format != FLV_SOUND_FORMAT_AAC) {
+    audio->data = p + 1;
+    audio->size = tag->data_size - 1;
+    return 0;
+  }
+
+  // AAC: packet type, then AudioSpecificConfig or a raw frame
+  if (tag->data_size < 2) return -1;
+  audio->aac_packet_type = p[1];
+  audio->data = p + 2;
+  audio->size = tag->data_size - 2;
+  return 0;
+}
+
+/*
+ * ISO_14496_3 AudioSpecificConfig, the part ADTS needs
+ */
+int flv_parse_aac_config(const byte *data, uint32_t size, flv_aac_config_t *config) {
+  if (size < 2) return -1;
+
+  // the fields used here fit in the first 8 bytes, left aligned
+  uint64_t bits = 0;
+  for (uint32_t i = 0; i < 8; ++i) bits = (bits << 8) | (i < size ? data[i] : 0);
+  uint32_t used = 0, available = (size < 8 ? size : 8) * 8;
+#define TAKE(n) ((used += (n)), (uint32_t) ((bits >> (64 - used)) & ((1ull << (n)) - 1)))
+
+  // 5 bits, escape 31: 32 + 6 more bits
+  config->object_type = TAKE(5);
+  if (config->object_type == 31) config->object_type = 32 + TAKE(6);
+
+  config->sample_rate_index = TAKE(4);
+  if (config->sample_rate_index == 15) {
+    config->sample_rate = TAKE(24);
+  } else if (config->sample_rate_index < sizeof(aac_sample_rates) / sizeof(aac_sample_rates[0])) {
+    config->sample_rate = aac_sample_rates[config->sample_rate_index];
+  } else {
+    return -1;
+  }
+  config->channels = TAKE(4);
+#undef TAKE
+
+  return used <= available ? 0 : -1;
+}
+
+/*
+ * ISO_13818_7 adts_fixed_header + adts_variable_header without CRC:
+ * syncword, MPEG-4, layer 0, protection_absent, profile, sampling_frequency_index, channel_configuration,
+ * aac_frame_length (per frame, see flv_adts_header()), buffer fullness 0x7ff (VBR), one raw data block
+ */
+int flv_adts_init(flv_adts_t *adts, const flv_aac_config_t *config) {
+  // profile is 2 bits (object type - 1) and there is no escape for the sample rate
+  if (config->object_type < 1 || config->object_type > 4 || config->sample_rate_index >= 13 || config->channels > 7) return -1;
+
+  adts->header[0] = 0xff;
+  adts->header[1] = 0xf1;
+  adts->header[2] = ((config->object_type - 1) << 6) | (config->sample_rate_index << 2) | ((config->channels >> 2) & 0x01);
+  adts->header[3] = (config->channels & 0x03) << 6;
+  adts->header[4] = 0x00;
+  adts->header[5] = 0x1f;
+  adts->header[6] = 0xfc;
+  return 0;
+}
+
+/*
+ * ISO_14496_15 AVCDecoderConfigurationRecord, parameter sets point into data
+ */
+int flv_parse_avc_config(const byte *data, uint32_t size, flv_avc_config_t *config) {
+  if (size < 6) return -1;
+
+  config->configuration_version = data[0];
+  config->profile = data[1];
+  config->profile_compatibility = data[2];
+  config->level = data[3];
+  config->length_size = (data[4] & 0x03) + 1; // & 0000 0011
+  config->sps_count = 0;
+  config->pps_count = 0;
+
+  uint32_t offset = 5;
+  uint8_t count = data[offset++] & 0x1f; // & 0001 1111
+  for (uint8_t i = 0; i < count; ++i) {
+    if (offset + 2 > size) return -1;
+    uint16_t length = flv_ui16(data + offset);
+    if (offset + 2 + length > size) return -1;
+    if (config->sps_count < FLV_MAX_PARAMETER_SETS) {
+      config->sps[config->sps_count] = data + offset + 2;
+      config->sps_size[config->sps_count++] = length;
+    }
+    offset += 2 + length;
+  }
+
+  if (offset + 1 > size) return -1;
+  count = data[offset++];
+  for (uint8_t i = 0; i < count; ++i) {
+    if (offset + 2 > size) return -1;
+    uint16_t length = flv_ui16(data + offset);
+    if (offset + 2 + length > size) return -1;
+    if (config->pps_count < FLV_MAX_PARAMETER_SETS) {
+      config->pps[config->pps_count] = data + offset + 2;
+      config->pps_size[config->pps_count++] = length;
+    }
+    offset += 2 + length;
+  }
+
+  return 0;
+}
+
+void flv_nalu_iter_init(flv_nalu_iter_t *iter, const byte *data, uint32_t size, uint8_t length_size) {
+  iter->data = data;
+  iter->size = size;
+  iter->offset = 0;
+  iter->length_size = length_size >= 1 && length_size <= 4 ? length_size : 4;
+}
+
+/*
+ * @brief next length prefixed NALU (AVCC), stops at the end or at a length running past the payload
+ */
+bool flv_nalu_next(flv_nalu_iter_t *iter, const byte **nalu, uint32_t *size) {
+  if (iter->size - iter->offset < iter->length_size || iter->offset >= iter->size) return false;
+
+  const byte *p = iter->data + iter->offset;
+  uint32_t length = 0;
+  for (uint8_t i = 0; i < iter->length_size; ++i) length = (length << 8) | p[i];
+  if (length > iter->size - iter->offset - iter->length_size) return false;
+
+  *nalu = p + iter->length_size;
+  *size = length;
+  iter->offset += iter->length_size + length;
+  return true;
+}
+
+int flv_parse_hevc_config(const byte *data, uint32_t size, flv_hevc_config_t *config) {
+  if (size < 23) return -1;
+
+  config->configuration_version = data[0];
+  config->profile_space = data[1] >> 6;
+  config->tier = (data[1] >> 5) & 0x01;
+  config->profile_idc = data[1] & 0x1f;
+  config->level_idc = data[12];
+  config->chroma_format = data[16] & 0x03;
+  config->bit_depth_luma = (data[17] & 0x07) + 8;
+  config->bit_depth_chroma = (data[18] & 0x07) + 8;
+  config->length_size = (data[21] & 0x03) + 1;
+  config->nalu_count = 0;
+
+  // arrays of NALUs of one type: completeness | type, count, (length, NALU)*
+  uint32_t offset = 23;
+  uint8_t arrays = data[22];
+  for (uint8_t i = 0; i < arrays; ++i) {
+    if (offset + 3 > size) return -1;
+    uint8_t type = data[offset] & 0x3f;
+    uint16_t count = flv_ui16(data + offset + 1);
+    offset += 3;
+    for (uint16_t j = 0; j < count; ++j) {
+      if (offset + 2 > size) return -1;
+      uint16_t length = flv_ui16(data + offset);
+      if (offset + 2 + length > size) return -1;
+      if (config->nalu_count < FLV_MAX_HEVC_NALUS) {
+        config->nalus[config->nalu_count] = data + offset + 2;
+        config->nalu_sizes[config->nalu_count] = length;
+        config->nalu_types[config->nalu_count++] = type;
+      }
+      offset += 2 + length;
+    }
+  }
+
+  return 0;
+}
+
+int flv_parse_av1_config(const byte *data, uint32_t size, flv_av1_config_t *config) {
+  // marker bit, version 1
+  if (size < 4 || !(data[0] & 0x80)) return -1;
+
+  config->version = data[0] & 0x7f;
+  config->profile = data[1] >> 5;
+  config->level = data[1] & 0x1f;
+  config->tier = data[2] >> 7;
+  config->bit_depth = data[2] & 0x20 ? 12 : data[2] & 0x40 ? 10 : 8; // twelve_bit, high_bitdepth
+  config->monochrome = data[2] & 0x10;
+  config->chroma_subsampling_x = (data[2] >> 3) & 0x01;
+  config->chroma_subsampling_y = (data[2] >> 2) & 0x01;
+  config->config_obus = data + 4;
+  config->config_obus_size = size - 4;
+  return 0;
+}
+
+void flv_obu_iter_init(flv_obu_iter_t *iter, const byte *data, uint32_t size) {
+  iter->data = data;
+  iter->size = size;
+  iter->offset = 0;
+}
+
+/*
+ * obu_header: forbidden bit, obu_type(4), extension flag, has_size_field, reserved, [extension byte], [leb128 obu_size]
+ * without a size field the OBU runs to the end of the data
+ */
+bool flv_obu_next(flv_obu_iter_t *iter, const byte **obu, uint32_t *size, uint8_t *type) {
+  if (iter->offset >= iter->size) return false;
+
+  const byte *p = iter->data + iter->offset;
+  uint32_t left = iter->size - iter->offset;
+  uint32_t header = p[0] & 0x04 ? 2 : 1;
+  if ((p[0] & 0x80) || header > left) return false;
+
+  uint64_t payload = left - header;
+  if (p[0] & 0x02) {
+    payload = 0;
+    for (int i = 0;; ++i) {
+      if (i == 8 || header >= left) return false;
+      byte b = p[header++];
+      payload |= (uint64_t) (b & 0x7f) << (7 * i);
+      if (!(b & 0x80)) break;
+    }
+    if (payload > left - header) return false;
+  }
+
+  *obu = p;
+  *size = header + payload;
+  *type = (p[0] >> 3) & 0x0f;
+  iter->offset += *size;
+  return true;
+}
+
+/*
+ * writer
+ */
+flv_writer_t *flv_writer_open(const char *path, uint8_t type_flags) {
+  FILE *file = 0 == strcmp(path, "-") ? stdout : fopen(path, "wb");
+  if (file == NULL) return NULL;
+
+  flv_writer_t *writer = calloc(1, sizeof(flv_writer_t));
+  writer->file = file;
+
+  byte header[FLV_HEADER_SIZE + FLV_PREV_TAG_SIZE] = {'F', 'L', 'V', 0x01, type_flags, 0x00, 0x00, 0x00, FLV_HEADER_SIZE, 0x00, 0x00, 0x00, 0x00};
+  writer->written = fwrite(header, 1, sizeof(header), file);
+  return writer;
+}
+
+int flv_write_tag(flv_writer_t *writer, uint8_t type, uint32_t timestamp, const byte *data, uint32_t size) {
+  struct iovec iov = {(void *) data, size};
+  return flv_write_tagv(writer, type, timestamp, &iov, 1);
+}
+
+/*
+ * @brief write one tag whose data is the concatenation of iov, followed by its PreviousTagSize
+ */
+int flv_write_tagv(flv_writer_t *writer, uint8_t type, uint32_t timestamp, const struct iovec *iov, int iovcnt) {
+  uint32_t data_size = 0;
+  for (int i = 0; i < iovcnt; ++i) data_size += iov[i].iov_len;
+
+  byte header[FLV_TAG_HEADER_SIZE] = {type, data_size >> 16, data_size >> 8, data_size, timestamp >> 16, timestamp >> 8, timestamp, timestamp >> 24, 0x00, 0x00, 0x00};
+  uint32_t tag_size = FLV_TAG_HEADER_SIZE + data_size;
+  byte trailer[FLV_PREV_TAG_SIZE] = {tag_size >> 24, tag_size >> 16, tag_size >> 8, tag_size};
+
+  size_t count = fwrite(header, 1, sizeof(header), writer->file);
+  for (int i = 0; i < iovcnt; ++i) {
+    if (iov[i].iov_len) count += fwrite(iov[i].iov_base, 1, iov[i].iov_len, writer->file);
+  }
+  count += fwrite(trailer, 1, sizeof(trailer), writer->file);
+
+  writer->written += count;
+  writer->prev_tag_size = tag_size;
+  return count == tag_size + FLV_PREV_TAG_SIZE ? 0 : -1;
+}
+
+void flv_writer_close(flv_writer_t *writer) {
+  if (writer == NULL) return;
+  if (writer->file == stdout) {
+    fflush(stdout);
+  } else {
+    fclose(writer->file);
+  }
+  free(writer);
+}
+
+/*
+ * index
+ */
+int flv_index_add(flv_index_t *index, const flv_tag_t *tag) {
+  if (index->count == index->capacity) {
+    size_t capacity = index->capacity ? index->capacity * 2 : 4096;
+    flv_index_entry_t *entries = realloc(index->entries, capacity * sizeof(flv_index_entry_t));
+    if (entries == NULL) return -1;
+    index->entries = entries;
+    index->capacity = capacity;
+  }
+
+  flv_index_entry_t *entry = &index->entries[index->count++];
+  entry->offset = tag->offset;
+  entry->timestamp = tag->timestamp;
+  entry->data_size = tag->data_size;
+  entry->tag_type = tag->tag_type;
+  entry->frame_type = TAGTYPE_VIDEODATA == tag->tag_type && tag->data_size > 0 ? flv_get_bits(tag->data[0], 4, 3) : 0; // without the enhanced IsExHeader bit
+  return 0;
+}
+
+/*
+ * @return number of tags, -1 on a damaged tag (the index keeps the tags before it)
+ */
+int flv_index_build(flv_reader_t *reader, flv_index_t *index) {
+  flv_tag_t tag;
+  int ret;
+  while ((ret = flv_read_tag(reader, &tag)) > 0) {
+    if (0 != flv_index_add(index, &tag)) return -1;
+  }
+  return ret < 0 ? -1 : (int) index->count;
+}
+
+void flv_index_free(flv_index_t *index) {
+  free(index->entries);
+  index->entries = NULL;
+  index->count = index->capacity = 0;
+}
+
+/*
+ * @brief flv_index_build() on all cores: the file is cut into byte ranges, each range resyncs at its first
+ * tag chain (flv_resync) and indexes up to the next range. the merge follows the sequential walk: a range
+ * whose resync point the walk doesn't land on (a tag header lookalike inside a payload) is walked again
+ * from where the walk entered it until it meets one of the range's tags, so the index and reader->pos
+ * always end up exactly as flv_index_build() leaves them.
+ * @param[in] threads: 0 for one per online cpu
+ * @return number of tags, -1 on a damaged tag (the index keeps the tags before it)
+ */
+int flv_index_build_parallel(flv_reader_t *reader, flv_index_t *index, int threads) {
+  if (threads <= 0) threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  uint64_t begin = reader->pos;
+  uint64_t length = reader->map && reader->size > begin ? reader->size - begin : 0;
+  int count = length / FLV_INDEX_MIN_RANGE < (uint64_t) threads ? (int) (length / FLV_INDEX_MIN_RANGE) : threads;
+  if (count <= 1) return flv_index_build(reader, index);
+
+  index_range_t *ranges = calloc(count, sizeof(index_range_t));
+  pthread_t *workers = calloc(count, sizeof(pthread_t));
+  bool *started = calloc(count, sizeof(bool));
+  if (!ranges || !workers || !started) {
+    free(ranges);
+    free(workers);
+    free(started);
+    return flv_index_build(reader, index);
+  }
+
+  for (int i = 0; i < count; ++i) {
+    ranges[i].reader = reader;
+    ranges[i].begin = begin + length * i / count;
+    ranges[i].end = i == count - 1 ? reader->size : begin + length * (i + 1) / count;
+  }
+  for (int i = 1; i < count; ++i) started[i] = 0 == pthread_create(&workers[i], NULL, index_range, &ranges[i]);
+  index_range(&ranges[0]);
+  for (int i = 1; i < count; ++i) {
+    if (started[i]) {
+      pthread_join(workers[i], NULL);
+    } else {
+      index_range(&ranges[i]);
+    }
+  }
+
+  flv_reader_t walker = *reader;
+  flv_tag_t tag;
+  uint64_t pos = begin;
+  int ret = 1;
+  for (int i = 0; i < count && ret > 0; ++i) {
+    index_range_t *range = &ranges[i];
+    // a tag covering the whole range
+    if (pos >= range->end) continue;
+
+    size_t first = 0;
+    if (pos != range->start) {
+      // the walk didn't land on the resync point: go on until it meets one of the range's tags
+      bool met = false;
+      walker.pos = pos;
+      while (walker.pos < range->end) {
+        while (first < range->index.count && range->index.entries[first].offset < walker.pos) ++first;
+        if ((met = first < range->index.count && range->index.entries[first].offset == walker.pos)) break;
+        if ((ret = flv_read_tag(&walker, &tag)) <= 0) break;
+        if (0 != flv_index_add(index, &tag)) {
+          ret = -1;
+          break;
+        }
+      }
+      pos = walker.pos;
+      if (ret < 0) memcpy(reader->error, walker.error, sizeof(reader->error));
+      if (!met) continue;
+    }
+
+    if (0 != index_append(index, range->index.entries + first, range->index.count - first)) {
+      ret = -1;
+      break;
+    }
+    pos = range->stop;
+    ret = range->ret;
+    if (ret < 0) memcpy(reader->error, range->error, sizeof(reader->error));
+  }
+
+  reader->pos = pos;
+  for (int i = 0; i < count; ++i) flv_index_free(&ranges[i].index);
+  free(ranges);
+  free(workers);
+  free(started);
+  return ret < 0 ? -1 : (int) index->count;
+}
+
+/*
+ * @return total size of the tag at pos (header + data + PreviousTagSize), 0 if it isn't a valid tag
+ */
+size_t flv_tag_size_at(const byte *buf, size_t len, size_t pos) {
+  if (pos > len || len - pos < FLV_TAG_HEADER_SIZE + FLV_PREV_TAG_SIZE) return 0;
+
+  const byte *p = buf + pos;
+  if (!valid_tag_type(p[0])) return 0;
+  // StreamID: always 0
+  if (p[8] | p[9] | p[10]) return 0;
+
+  uint32_t data_size = flv_ui24(p + 1);
+  size_t size = FLV_TAG_HEADER_SIZE + (size_t) data_size + FLV_PREV_TAG_SIZE;
+  if (size > len - pos) return 0;
+  if (flv_ui32(p + size - FLV_PREV_TAG_SIZE) != FLV_TAG_HEADER_SIZE + data_size) return 0;
+
+  return size;
+}
+
+/*
+ * @brief find the next offset a valid tag chain starts at
+ * a candidate is only accepted if the tag after it is valid too (or it ends the file),
+ * a single tag header inside random payload passes the PreviousTagSize check too rarely to matter twice.
+ * @return offset of the next tag, len if there isn't any
+ */
+size_t flv_resync(const byte *buf, size_t len, size_t from) {
+  size_t pos = from;
+  while ((pos = find_candidate(buf, len, pos)) < len) {
+    size_t size = flv_tag_size_at(buf, len, pos);
+    if (size > 0 && (pos + size == len || flv_tag_size_at(buf, len, pos + size) > 0)) return pos;
+    ++pos;
+  }
+  return len;
+}
+
+/*
+ * @brief scan for a byte which looks like TagType followed by a zero StreamID, 16 bytes at a time
+ */
+static size_t find_candidate(const byte *buf, size_t len, size_t pos) {
+  if (len < FLV_TAG_HEADER_SIZE + FLV_PREV_TAG_SIZE) return len;
+  size_t last = len - FLV_TAG_HEADER_SIZE - FLV_PREV_TAG_SIZE;
+
+#ifdef __SSE2__
+  const __m128i audio = _mm_set1_epi8(TAGTYPE_AUDIODATA);
+  const __m128i video = _mm_set1_epi8(TAGTYPE_VIDEODATA);
+  const __m128i script = _mm_set1_epi8(TAGTYPE_SCRIPTDATAOBJECT);
+  const __m128i zero = _mm_setzero_si128();
+
+  // the loads at +8..+10 must stay inside the buffer
+  while (pos + 16 + 10 <= len && pos <= last) {
+    __m128i type = _mm_loadu_si128((const __m128i *) (buf + pos));
+    __m128i id0 = _mm_loadu_si128((const __m128i *) (buf + pos + 8));
+    __m128i id1 = _mm_loadu_si128((const __m128i *) (buf + pos + 9));
+    __m128i id2 = _mm_loadu_si128((const __m128i *) (buf + pos + 10));
+
+    __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(type, audio), _mm_cmpeq_epi8(type, video)), _mm_cmpeq_epi8(type, script));
+    m = _mm_and_si128(m, _mm_cmpeq_epi8(_mm_or_si128(_mm_or_si128(id0, id1), id2), zero));
+
+    int mask = _mm_movemask_epi8(m);
+    if (mask) {
+      size_t found = pos + __builtin_ctz(mask);
+      return found <= last ? found : len;
+    }
+    pos += 16;
+  }
+#endif
+
+  for (; pos <= last; ++pos) {
+    const byte *p = buf + pos;
+    if (valid_tag_type(p[0]) && 0 == (p[8] | p[9] | p[10])) return pos;
+  }
+  return len;
+}
+
+/*
+ * @brief read bits from 1 byte
+ * @param[in] value: 1 byte to analysize
+ * @param[in] start_bit: start from the low bit side
+ * @param[in] count: number of bits
+ */
+uint8_t flv_get_bits(uint8_t value, uint8_t start_bit, uint8_t count) {
+  uint8_t mask = 0;
+
+  mask = (uint8_t) (((1 << count) - 1) << start_bit);
+  return (mask & value) >> start_bit;
+}
+
+/*
+ * a worker of flv_index_build_parallel(), with its own copy of the reader (same mapping)
+ */
+static void *index_range(void *arg) {
+  index_range_t *range = arg;
+  flv_reader_t reader = *range->reader;
+  flv_tag_t tag;
+
+  range->start = range->begin == range->reader->pos ? range->begin : flv_resync(reader.map, reader.size, range->begin);
+  range->ret = 1;
+  reader.pos = range->start;
+  while (reader.pos < range->end && (range->ret = flv_read_tag(&reader, &tag)) > 0) {
+    if (0 != flv_index_add(&range->index, &tag)) {
+      range->ret = -1;
+      break;
+    }
+  }
+  range->stop = reader.pos;
+  memcpy(range->error, reader.error, sizeof(range->error));
+  return NULL;
+}
+
+static int index_append(flv_index_t *index, const flv_index_entry_t *entries, size_t count) {
+  if (index->count + count > index->capacity) {
+    size_t capacity = index->count + count;
+    flv_index_entry_t *p = realloc(index->entries, capacity * sizeof(flv_index_entry_t));
+    if (p == NULL) return -1;
+    index->entries = p;
+    index->capacity = capacity;
+  }
+  memcpy(index->entries + index->count, entries, count * sizeof(flv_index_entry_t));
+  index->count += count;
+  return 0;
+}
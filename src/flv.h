@@ -0,0 +1,292 @@
+#ifndef FLV_H
+#define FLV_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/uio.h>
+
+/*
+ * libflv: reader, writer, tag index and NALU iteration shared by all tools.
+ *
+ * tags are zero-copy: a regular file is mmap'ed and flv_tag_t points into the mapping,
+ * a pipe ("-" or a fifo) is read into one reusable buffer which is only valid until the next read.
+ */
+
+typedef unsigned char byte;
+
+#define FLV_HEADER_SIZE (9)
+#define FLV_TAG_HEADER_SIZE (11)
+#define FLV_PREV_TAG_SIZE (4)
+
+#define FLV_CODEC_ID_AVC (7)
+#define FLV_CODEC_ID_HEVC (12) // legacy extension (codec id 12, AVC style packets), or enhanced hvc1
+#define FLV_CODEC_ID_AV1 (13) // enhanced av01 only, no legacy codec id
+#define AVC_SEQUENCE_HEADER (0)
+#define AVC_NALU (1)
+#define AVC_END_OF_SEQUENCE (2)
+#define VIDEO_PACKET_OTHER (0xff) // enhanced metadata / MPEG2TSSequenceStart
+
+// Enhanced RTMP (veovera enhanced-rtmp v1): IsExHeader bit, 3 bit frame type, 4 bit packet type, FourCC
+#define FLV_FOURCC(a, b, c, d) ((uint32_t) (a) << 24 | (uint32_t) (b) << 16 | (uint32_t) (c) << 8 | (uint32_t) (d))
+#define FLV_FOURCC_HEVC FLV_FOURCC('h', 'v', 'c', '1')
+#define FLV_FOURCC_AV1 FLV_FOURCC('a', 'v', '0', '1')
+enum flv_ex_packet_types { FLV_EX_SEQUENCE_START, FLV_EX_CODED_FRAMES, FLV_EX_SEQUENCE_END, FLV_EX_CODED_FRAMES_X, FLV_EX_METADATA, FLV_EX_MPEG2TS_SEQUENCE_START };
+
+#define HEVC_NALU_VPS (32)
+#define HEVC_NALU_SPS (33)
+#define HEVC_NALU_PPS (34)
+#define AV1_OBU_SEQUENCE_HEADER (1)
+#define AV1_OBU_TEMPORAL_DELIMITER (2)
+
+#define FLV_SOUND_FORMAT_AAC (10)
+#define AAC_SEQUENCE_HEADER (0)
+#define AAC_RAW (1)
+
+#define FLV_FRAME_KEYFRAME (1)
+#define FLV_FRAME_INTER (2)
+#define FLV_FRAME_DISPOSABLE (3)
+#define FLV_FRAME_GENERATED_KEYFRAME (4)
+#define FLV_FRAME_INFO (5)
+
+// flv_index_build_parallel: smaller files (or ranges) aren't worth a thread
+#define FLV_INDEX_MIN_RANGE (1024 * 1024)
+
+// AVCDecoderConfigurationRecord allows up to 31 SPS / 255 PPS, more than that is never seen in practice
+#define FLV_MAX_PARAMETER_SETS (8)
+// HEVCDecoderConfigurationRecord: VPS, SPS, PPS and SEI arrays, all NALUs in one list
+#define FLV_MAX_HEVC_NALUS (16)
+
+enum tag_types { TAGTYPE_AUDIODATA = 8, TAGTYPE_VIDEODATA = 9, TAGTYPE_SCRIPTDATAOBJECT = 18 };
+
+extern const char *flv_tag_types[];
+extern const char *frame_types[];
+extern const char *codec_ids[];
+extern const char *avc_packet_types[];
+extern const char *sound_formats[];
+extern const char *aac_packet_types[];
+
+typedef struct {
+  uint8_t version;
+  uint8_t type_flags;
+  uint32_t data_offset;
+} flv_header_t;
+
+typedef struct {
+  uint64_t offset; // 文件偏移量: tag header
+  uint8_t tag_type;
+  uint32_t data_size;
+  uint32_t timestamp; // including TimestampExtended
+  uint32_t stream_id;
+  const byte *head; // FLV_TAG_HEADER_SIZE + data_size bytes
+  const byte *data; // data_size bytes
+} flv_tag_t;
+
+typedef struct {
+  uint8_t frame_type;
+  uint8_t codec_id; // enhanced: from the FourCC, 0 if unknown
+  uint8_t avc_packet_type; // AVC, HEVC, AV1: sequence header, NALUs (AV1: OBUs), end of sequence, enhanced packet types mapped onto them
+  int32_t composition_time; // AVC, HEVC
+  bool enhanced;
+  uint8_t packet_type; // enhanced: VideoPacketType
+  uint32_t fourcc; // enhanced
+  const byte *data; // payload after the video tag header
+  uint32_t size;
+} flv_video_t;
+
+typedef struct {
+  uint8_t sound_format;
+  uint8_t sound_rate; // 0: 5.5 kHz, 1: 11 kHz, 2: 22 kHz, 3: 44 kHz, always 3 for AAC
+  uint8_t sound_size; // 0: 8 bit, 1: 16 bit
+  uint8_t sound_type; // 0: mono, 1: stereo
+  uint8_t aac_packet_type; // AAC only
+  const byte *data; // payload after the audio tag header
+  uint32_t size;
+} flv_audio_t;
+
+typedef struct {
+  uint8_t object_type; // 2: AAC LC
+  uint8_t sample_rate_index; // 15: explicit sample_rate
+  uint32_t sample_rate;
+  uint8_t channels; // channelConfiguration
+} flv_aac_config_t;
+
+// ADTS header with everything but aac_frame_length filled in once per stream
+typedef struct {
+  byte header[7];
+} flv_adts_t;
+
+typedef struct {
+  uint8_t configuration_version;
+  uint8_t profile;
+  uint8_t profile_compatibility;
+  uint8_t level;
+  uint8_t length_size; // lengthSizeMinusOne + 1
+  uint8_t sps_count;
+  uint8_t pps_count;
+  const byte *sps[FLV_MAX_PARAMETER_SETS];
+  uint16_t sps_size[FLV_MAX_PARAMETER_SETS];
+  const byte *pps[FLV_MAX_PARAMETER_SETS];
+  uint16_t pps_size[FLV_MAX_PARAMETER_SETS];
+} flv_avc_config_t;
+
+// ISO/IEC 14496-15 8.3.3
+typedef struct {
+  uint8_t configuration_version;
+  uint8_t profile_space;
+  uint8_t tier;
+  uint8_t profile_idc;
+  uint8_t level_idc;
+  uint8_t chroma_format;
+  uint8_t bit_depth_luma;
+  uint8_t bit_depth_chroma;
+  uint8_t length_size; // lengthSizeMinusOne + 1
+  uint8_t nalu_count;
+  const byte *nalus[FLV_MAX_HEVC_NALUS]; // in record order: VPS, SPS, PPS, SEI
+  uint16_t nalu_sizes[FLV_MAX_HEVC_NALUS];
+  uint8_t nalu_types[FLV_MAX_HEVC_NALUS];
+} flv_hevc_config_t;
+
+// AV1 codec ISO-BMFF binding 2.3
+typedef struct {
+  uint8_t version;
+  uint8_t profile;
+  uint8_t level;
+  uint8_t tier;
+  uint8_t bit_depth; // 8, 10, 12
+  bool monochrome;
+  uint8_t chroma_subsampling_x;
+  uint8_t chroma_subsampling_y;
+  const byte *config_obus; // usually the sequence header OBU
+  uint32_t config_obus_size;
+} flv_av1_config_t;
+
+typedef struct {
+  const byte *data;
+  uint32_t size;
+  uint32_t offset;
+  uint8_t length_size;
+} flv_nalu_iter_t;
+
+typedef struct {
+  const byte *data;
+  uint32_t size;
+  uint32_t offset;
+} flv_obu_iter_t;
+
+typedef struct {
+  int fd;
+  const byte *map; // whole file, NULL when streaming
+  uint64_t size;
+  uint64_t pos;
+  FILE *stream;
+  byte *buffer;
+  size_t capacity;
+  flv_header_t header;
+  char error[128];
+} flv_reader_t;
+
+typedef struct {
+  FILE *file;
+  uint64_t written;
+  uint32_t prev_tag_size;
+} flv_writer_t;
+
+typedef struct {
+  uint64_t offset;
+  uint32_t timestamp;
+  uint32_t data_size;
+  uint8_t tag_type;
+  uint8_t frame_type; // video tags only
+} flv_index_entry_t;
+
+typedef struct {
+  flv_index_entry_t *entries;
+  size_t count;
+  size_t capacity;
+} flv_index_t;
+
+/*
+ * reader
+ */
+flv_reader_t *flv_open(const char *);
+void flv_close(flv_reader_t *);
+// @return 1: tag read, 0: end of file, -1: error, see reader->error
+int flv_read_tag(flv_reader_t *, flv_tag_t *);
+int flv_read_tag_at(flv_reader_t *, uint64_t, flv_tag_t *);
+// @return seconds on the monotonic clock, for the rates and schedules of the tools
+double flv_now();
+
+/*
+ * tag payloads
+ */
+int flv_parse_video(const flv_tag_t *, flv_video_t *);
+int flv_parse_audio(const flv_tag_t *, flv_audio_t *);
+int flv_parse_aac_config(const byte *, uint32_t, flv_aac_config_t *);
+int flv_adts_init(flv_adts_t *, const flv_aac_config_t *);
+int flv_parse_avc_config(const byte *, uint32_t, flv_avc_config_t *);
+void flv_nalu_iter_init(flv_nalu_iter_t *, const byte *, uint32_t, uint8_t);
+bool flv_nalu_next(flv_nalu_iter_t *, const byte **, uint32_t *);
+int flv_parse_hevc_config(const byte *, uint32_t, flv_hevc_config_t *);
+int flv_parse_av1_config(const byte *, uint32_t, flv_av1_config_t *);
+// low overhead bitstream format OBUs, each with its header (and size field)
+void flv_obu_iter_init(flv_obu_iter_t *, const byte *, uint32_t);
+bool flv_obu_next(flv_obu_iter_t *, const byte **, uint32_t *, uint8_t *);
+
+static inline uint8_t flv_hevc_nalu_type(const byte *nalu) { return (nalu[0] >> 1) & 0x3f; }
+static inline size_t flv_put_fourcc(byte *p, uint32_t fourcc) {
+  p[0] = fourcc >> 24;
+  p[1] = fourcc >> 16;
+  p[2] = fourcc >> 8;
+  p[3] = fourcc;
+  return 4;
+}
+
+// AVC, HEVC or AV1 decoder configuration, kept aside by dump / bus / trickplay
+static inline bool flv_video_is_config(const flv_video_t *video) {
+  return (FLV_CODEC_ID_AVC == video->codec_id || FLV_CODEC_ID_HEVC == video->codec_id || FLV_CODEC_ID_AV1 == video->codec_id) && AVC_SEQUENCE_HEADER == video->avc_packet_type;
+}
+
+// @brief set aac_frame_length (header included, 13 bits) for a raw frame of size bytes
+static inline const byte *flv_adts_header(flv_adts_t *adts, uint32_t size) {
+  uint32_t length = size + sizeof(adts->header);
+  adts->header[3] = (adts->header[3] & 0xfc) | ((length >> 11) & 0x03);
+  adts->header[4] = (length >> 3) & 0xff;
+  adts->header[5] = ((length & 0x07) << 5) | 0x1f;
+  return adts->header;
+}
+
+/*
+ * writer
+ */
+flv_writer_t *flv_writer_open(const char *, uint8_t);
+int flv_write_tag(flv_writer_t *, uint8_t, uint32_t, const byte *, uint32_t);
+int flv_write_tagv(flv_writer_t *, uint8_t, uint32_t, const struct iovec *, int);
+void flv_writer_close(flv_writer_t *);
+
+/*
+ * index
+ */
+int flv_index_add(flv_index_t *, const flv_tag_t *);
+int flv_index_build(flv_reader_t *, flv_index_t *);
+// same index from byte ranges parsed on threads, mmap'ed files only
+int flv_index_build_parallel(flv_reader_t *, flv_index_t *, int);
+void flv_index_free(flv_index_t *);
+
+/*
+ * resync on damaged files
+ */
+size_t flv_tag_size_at(const byte *, size_t, size_t);
+size_t flv_resync(const byte *, size_t, size_t);
+
+uint8_t flv_get_bits(uint8_t, uint8_t, uint8_t);
+
+/*
+ * BE (FLV) to host
+ */
+static inline uint16_t flv_ui16(const byte *p) { return (p[0] << 8) | p[1]; }
+static inline uint32_t flv_ui24(const byte *p) { return (p[0] << 16) | (p[1] << 8) | p[2]; }
+static inline uint32_t flv_ui32(const byte *p) { return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]; }
+
+#endif
@@ -0,0 +1,338 @@
+#include "flv.h"
+#include <assert.h>
+#include <librtmp/amf.h>
+#include <librtmp/log.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define AAC_SAMPLE_RATE (44100)
+#define AAC_FRAME_SAMPLES (1024)
+// random payload is sliced out of this pool instead of generated per frame
+#define POOL_SIZE (16 * 1024 * 1024)
+// an I frame is this many times the size of a P frame
+#define KEYFRAME_WEIGHT (8)
+
+enum flvgen_codecs { CODEC_AVC, CODEC_HEVC, CODEC_HEVC_LEGACY, CODEC_AV1 };
+static const char *flvgen_codecs[] = {"avc", "hevc", "hevc-legacy", "av1"};
+
+typedef struct {
+  char *output;
+  int codec;
+  uint32_t video_kbps;
+  uint32_t audio_kbps;
+  uint32_t fps;
+  uint32_t gop;
+  uint32_t width;
+  uint32_t height;
+  uint64_t max_tags;
+  uint64_t max_bytes;
+  uint64_t max_ms;
+  uint64_t seed;
+} flvgen_options_t;
+
+static flvgen_options_t options = {NULL, CODEC_AVC, 2000, 128, 25, 50, 1280, 720, 0, 0, 0, 1};
+static flv_writer_t *writer;
+static byte *pool;
+static uint64_t rng;
+static uint64_t tag_count;
+
+void write_metadata();
+void write_video_sequence_header();
+void write_audio_sequence_header();
+void write_video_frame(uint32_t, bool, bool);
+void write_audio_frame(uint32_t);
+void write_tag(byte, uint32_t, const byte *, size_t, const byte *, size_t);
+uint64_t parse_size(const char *);
+uint64_t next_random();
+const byte *random_payload(size_t);
+uint32_t jitter(uint32_t);
+
+void usage(char *program_name) {
+  printf("Usage: %s -o outfile [-c avc|hevc|hevc-legacy|av1] [-b video kbps] [-a audio kbps] [-f fps] [-g gop] [-n tags | -s size[K|M|G] | -d seconds] [-r seed]\n", program_name);
+  printf("  -c: hevc / av1 as Enhanced RTMP (FourCC hvc1 / av01), hevc-legacy with codec id 12\n");
+  exit(-1);
+}
+
+int main(int argc, char *argv[]) {
+  RTMP_LogSetLevel(RTMP_LOGINFO);
+
+  char *prog = argv[0];
+  int c;
+  while ((c = getopt(argc, argv, "o:c:b:a:f:g:n:s:d:r:")) != -1) {
+    switch (c) {
+    case 'o':
+      options.output = optarg;
+      break;
+    case 'c':
+      options.codec = -1;
+      for (int i = 0; i < (int) (sizeof(flvgen_codecs) / sizeof(flvgen_codecs[0])); ++i) {
+        if (0 == strcmp(optarg, flvgen_codecs[i])) options.codec = i;
+      }
+      if (options.codec < 0) usage(prog);
+      break;
+    case 'b':
+      options.video_kbps = atoi(optarg);
+      break;
+    case 'a':
+      options.audio_kbps = atoi(optarg);
+      break;
+    case 'f':
+      options.fps = atoi(optarg);
+      break;
+    case 'g':
+      options.gop = atoi(optarg);
+      break;
+    case 'n':
+      options.max_tags = strtoull(optarg, NULL, 10);
+      break;
+    case 's':
+      options.max_bytes = parse_size(optarg);
+      break;
+    case 'd':
+      options.max_ms = strtoull(optarg, NULL, 10) * 1000;
+      break;
+    case 'r':
+      options.seed = strtoull(optarg, NULL, 10);
+      break;
+    default:
+      usage(prog);
+      break;
+    }
+  }
+
+  if (options.output == NULL || options.fps == 0 || options.gop == 0) usage(prog);
+  if (!options.max_tags && !options.max_bytes && !options.max_ms) options.max_ms = 60 * 1000;
+
+  if (NULL == (writer = flv_writer_open(options.output, 0x01 | (options.audio_kbps ? 0x04 : 0)))) {
+    RTMP_Log(RTMP_LOGERROR, "open %s FAILED", options.output);
+    return -1;
+  }
+  setvbuf(writer->file, NULL, _IOFBF, 4 * 1024 * 1024);
+
+  rng = options.seed ? options.seed : 1;
+  pool = malloc(POOL_SIZE);
+  for (size_t i = 0; i < POOL_SIZE; i += sizeof(uint64_t)) {
+    uint64_t value = next_random();
+    memcpy(pool + i, &value, sizeof(value));
+  }
+
+  write_metadata();
+  write_video_sequence_header();
+  if (options.audio_kbps) write_audio_sequence_header();
+
+  // interleave audio and video in timestamp order
+  uint64_t video_frame = 0, audio_frame = 0;
+  while (true) {
+    uint64_t video_ms = video_frame * 1000 / options.fps;
+    uint64_t audio_ms = audio_frame * AAC_FRAME_SAMPLES * 1000 / AAC_SAMPLE_RATE;
+    uint64_t ms = options.audio_kbps && audio_ms < video_ms ? audio_ms : video_ms;
+
+    if (options.max_ms && ms >= options.max_ms) break;
+    if (options.max_tags && tag_count >= options.max_tags) break;
+    if (options.max_bytes && writer->written >= options.max_bytes) break;
+
+    if (options.audio_kbps && audio_ms < video_ms) {
+      write_audio_frame((uint32_t) audio_ms);
+      ++audio_frame;
+    } else {
+      uint32_t gop_index = video_frame % options.gop;
+      // every other P frame is a non-reference frame
+      write_video_frame((uint32_t) video_ms, 0 == gop_index, gop_index % 2 == 0);
+      ++video_frame;
+    }
+  }
+
+  RTMP_Log(RTMP_LOGINFO, "%s: %lu tags, %lu bytes, %lu video frames, %lu audio frames", options.output, tag_count, writer->written, video_frame, audio_frame);
+  flv_writer_close(writer);
+  return 0;
+}
+
+void write_metadata() {
+  char buffer[512], *end = buffer + sizeof(buffer);
+  char *enc = buffer;
+
+  AVal name = AVC("onMetaData");
+  AVal width = AVC("width");
+  AVal height = AVC("height");
+  AVal framerate = AVC("framerate");
+  AVal videodatarate = AVC("videodatarate");
+  AVal videocodecid = AVC("videocodecid");
+  AVal audiodatarate = AVC("audiodatarate");
+  AVal audiocodecid = AVC("audiocodecid");
+  AVal encoder = AVC("encoder");
+  AVal flvgen = AVC("flvgen");
+
+  enc = AMF_EncodeString(enc, end, &name);
+  *enc++ = AMF_OBJECT;
+  enc = AMF_EncodeNamedNumber(enc, end, &width, options.width);
+  enc = AMF_EncodeNamedNumber(enc, end, &height, options.height);
+  enc = AMF_EncodeNamedNumber(enc, end, &framerate, options.fps);
+  enc = AMF_EncodeNamedNumber(enc, end, &videodatarate, options.video_kbps);
+  // enhanced: the FourCC as a number
+  static const double codec_ids[] = {FLV_CODEC_ID_AVC, FLV_FOURCC_HEVC, FLV_CODEC_ID_HEVC, FLV_FOURCC_AV1};
+  enc = AMF_EncodeNamedNumber(enc, end, &videocodecid, codec_ids[options.codec]);
+  if (options.audio_kbps) {
+    enc = AMF_EncodeNamedNumber(enc, end, &audiodatarate, options.audio_kbps);
+    enc = AMF_EncodeNamedNumber(enc, end, &audiocodecid, 10);
+  }
+  enc = AMF_EncodeNamedString(enc, end, &encoder, &flvgen);
+  *enc++ = 0;
+  *enc++ = 0;
+  *enc++ = AMF_OBJECT_END;
+
+  write_tag(TAGTYPE_SCRIPTDATAOBJECT, 0, (byte *) buffer, enc - buffer, NULL, 0);
+}
+
+void write_video_sequence_header() {
+  // keyframe | AVC, AVC sequence header, composition time 0, AVCDecoderConfigurationRecord with 1 SPS / 1 PPS
+  static const byte record[] = {0x17, 0x00, 0x00, 0x00, 0x00, 0x01, 0x64, 0x00, 0x1f, 0xff, 0xe1, 0x00, 0x0c, 0x67, 0x64, 0x00, 0x1f,
+                                0xac, 0xd9, 0x40, 0x50, 0x05, 0xbb, 0x01, 0x10, 0x01, 0x00, 0x04, 0x68, 0xeb, 0xe3, 0xcb};
+  // HEVCDecoderConfigurationRecord, Main 3.1, 4 byte lengths, VPS / SPS / PPS arrays
+  static const byte hevc_record[] = {0x01, 0x01, 0x60, 0x00, 0x00, 0x00, 0x90, 0x00, 0x00, 0x00, 0x00, 0x00, 0x5d, 0xf0, 0x00, 0xfc, 0xfd, 0xf8, 0xf8, 0x00, 0x00, 0x0f, 0x03,
+                                     0xa0, 0x00, 0x01, 0x00, 0x18, 0x40, 0x01, 0x0c, 0x01, 0xff, 0xff, 0x01, 0x60, 0x00, 0x00, 0x03, 0x00, 0x90, 0x00, 0x00, 0x03, 0x00, 0x00, 0x03, 0x00, 0x5d, 0x95, 0x98, 0x09,
+                                     0xa1, 0x00, 0x01, 0x00, 0x1f, 0x42, 0x01, 0x01, 0x01, 0x60, 0x00, 0x00, 0x03, 0x00, 0x90, 0x00, 0x00, 0x03, 0x00, 0x00, 0x03, 0x00, 0x5d, 0xa0, 0x02, 0x80, 0x80, 0x2d, 0x16, 0x59, 0x59, 0xa4, 0x93, 0x2b, 0xc0, 0x40,
+                                     0xa2, 0x00, 0x01, 0x00, 0x07, 0x44, 0x01, 0xc1, 0x72, 0xb4, 0x62, 0x40};
+  // AV1CodecConfigurationRecord, main profile, level 4.0, 8 bit 4:2:0, with a sequence header OBU
+  static const byte av1_record[] = {0x81, 0x08, 0x0c, 0x00, 0x0a, 0x0b, 0x00, 0x00, 0x00, 0x42, 0xab, 0xbf, 0xc3, 0x70, 0x0b, 0xe0, 0x08};
+
+  byte head[5] = {0x80 | FLV_FRAME_KEYFRAME << 4 | FLV_EX_SEQUENCE_START};
+  switch (options.codec) {
+  case CODEC_AVC:
+    write_tag(TAGTYPE_VIDEODATA, 0, record, sizeof(record), NULL, 0);
+    break;
+  case CODEC_HEVC:
+    flv_put_fourcc(head + 1, FLV_FOURCC_HEVC);
+    write_tag(TAGTYPE_VIDEODATA, 0, head, 5, hevc_record, sizeof(hevc_record));
+    break;
+  case CODEC_HEVC_LEGACY:
+    // same layout as AVC: keyframe | 12, sequence header, composition time 0
+    head[0] = FLV_FRAME_KEYFRAME << 4 | FLV_CODEC_ID_HEVC;
+    head[1] = AVC_SEQUENCE_HEADER;
+    head[2] = head[3] = head[4] = 0;
+    write_tag(TAGTYPE_VIDEODATA, 0, head, 5, hevc_record, sizeof(hevc_record));
+    break;
+  case CODEC_AV1:
+    flv_put_fourcc(head + 1, FLV_FOURCC_AV1);
+    write_tag(TAGTYPE_VIDEODATA, 0, head, 5, av1_record, sizeof(av1_record));
+    break;
+  }
+}
+
+void write_audio_sequence_header() {
+  // AAC, 44 kHz, 16 bit, stereo | AAC sequence header | AudioSpecificConfig: AAC-LC, 44100, 2 channels
+  static const byte config[] = {0xaf, 0x00, 0x12, 0x10};
+  write_tag(TAGTYPE_AUDIODATA, 0, config, sizeof(config), NULL, 0);
+}
+
+void write_video_frame(uint32_t timestamp, bool keyframe, bool reference) {
+  uint64_t gop_bytes = (uint64_t) options.video_kbps * 1000 / 8 * options.gop / options.fps;
+  uint32_t p_size = gop_bytes / (KEYFRAME_WEIGHT + options.gop - 1);
+  uint32_t size = jitter(keyframe ? p_size * KEYFRAME_WEIGHT : p_size);
+  if (size < 16) size = 16;
+  if (size > POOL_SIZE / 4) size = POOL_SIZE / 4;
+
+  uint8_t frame_type = keyframe ? FLV_FRAME_KEYFRAME : FLV_FRAME_INTER;
+  byte head[16];
+  size_t n = 0;
+  if (options.codec == CODEC_AV1) {
+    // enhanced coded frames, no composition time: temporal delimiter OBU, then a frame OBU with a 4 byte leb128 size
+    head[n++] = 0x80 | frame_type << 4 | FLV_EX_CODED_FRAMES;
+    n += flv_put_fourcc(head + n, FLV_FOURCC_AV1);
+    head[n++] = AV1_OBU_TEMPORAL_DELIMITER << 3 | 0x02;
+    head[n++] = 0x00;
+    head[n++] = 6 << 3 | 0x02; // OBU_FRAME
+    head[n++] = 0x80 | (size & 0x7f);
+    head[n++] = 0x80 | ((size >> 7) & 0x7f);
+    head[n++] = 0x80 | ((size >> 14) & 0x7f);
+    head[n++] = (size >> 21) & 0x7f;
+    write_tag(TAGTYPE_VIDEODATA, timestamp, head, n, random_payload(size), size);
+    return;
+  }
+
+  // video tag header, composition time 0, then one length prefixed NALU
+  if (options.codec == CODEC_HEVC) {
+    head[n++] = 0x80 | frame_type << 4 | FLV_EX_CODED_FRAMES;
+    n += flv_put_fourcc(head + n, FLV_FOURCC_HEVC);
+  } else {
+    head[n++] = frame_type << 4 | (options.codec == CODEC_AVC ? FLV_CODEC_ID_AVC : FLV_CODEC_ID_HEVC);
+    head[n++] = AVC_NALU;
+  }
+  head[n++] = 0x00;
+  head[n++] = 0x00;
+  head[n++] = 0x00;
+
+  bool hevc = options.codec != CODEC_AVC;
+  uint32_t nalu_len = size + (hevc ? 2 : 1);
+  head[n++] = nalu_len >> 24;
+  head[n++] = nalu_len >> 16;
+  head[n++] = nalu_len >> 8;
+  head[n++] = nalu_len;
+  if (hevc) {
+    // IDR_W_RADL, TRAIL_R, TRAIL_N; layer 0, temporal id 1
+    head[n++] = (keyframe ? 19 : reference ? 1 : 0) << 1;
+    head[n++] = 0x01;
+  } else {
+    head[n++] = keyframe ? 0x65 : reference ? 0x41 : 0x01;
+  }
+
+  write_tag(TAGTYPE_VIDEODATA, timestamp, head, n, random_payload(size), size);
+}
+
+void write_audio_frame(uint32_t timestamp) {
+  uint32_t size = jitter((uint64_t) options.audio_kbps * 1000 / 8 * AAC_FRAME_SAMPLES / AAC_SAMPLE_RATE);
+  if (size < 8) size = 8;
+
+  byte head[2] = {0xaf, 0x01};
+  write_tag(TAGTYPE_AUDIODATA, timestamp, head, sizeof(head), random_payload(size), size);
+}
+
+/*
+ * @brief write one tag, the tag data is head followed by body
+ */
+void write_tag(byte type, uint32_t timestamp, const byte *head, size_t head_size, const byte *body, size_t body_size) {
+  struct iovec iov[2] = {{(void *) head, head_size}, {(void *) body, body_size}};
+  flv_write_tagv(writer, type, timestamp, iov, 2);
+  ++tag_count;
+}
+
+uint64_t parse_size(const char *value) {
+  char *unit;
+  uint64_t size = strtoull(value, &unit, 10);
+  switch (*unit) {
+  case 'G':
+  case 'g':
+    size *= 1024 * 1024 * 1024;
+    break;
+  case 'M':
+  case 'm':
+    size *= 1024 * 1024;
+    break;
+  case 'K':
+  case 'k':
+    size *= 1024;
+    break;
+  }
+  return size;
+}
+
+// xorshift64
+uint64_t next_random() {
+  rng ^= rng << 13;
+  rng ^= rng >> 7;
+  rng ^= rng << 17;
+  return rng;
+}
+
+const byte *random_payload(size_t size) {
+  assert(size < POOL_SIZE);
+  return pool + next_random() % (POOL_SIZE - size);
+}
+
+// +/- 25%
+uint32_t jitter(uint32_t size) {
+  if (size < 4) return size;
+  return size - size / 4 + next_random() % (size / 2);
+}
@@ -0,0 +1,730 @@
+#include "fmp4.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX (1024)
+#endif
+
+#define VIDEO_TIMESCALE (90000)
+#define AAC_FRAME_SAMPLES (1024)
+
+// trun flags
+#define TRUN_DATA_OFFSET (0x000001)
+#define TRUN_SAMPLE_DURATION (0x000100)
+#define TRUN_SAMPLE_SIZE (0x000200)
+#define TRUN_SAMPLE_FLAGS (0x000400)
+#define TRUN_SAMPLE_CTO (0x000800)
+
+// sample flags: depends_on (2: no other sample, 1: others), is_non_sync_sample
+#define SAMPLE_SYNC (0x02000000)
+#define SAMPLE_NON_SYNC (0x01010000)
+
+static const byte matrix[36] = {0x00, 0x01, 0x00, 0x00, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x00, 0x01, 0x00, 0x00, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x40, 0x00, 0x00, 0x00};
+
+static bool put(fmp4_buf_t *, const void *, size_t);
+static void put8(fmp4_buf_t *, uint8_t);
+static void put16(fmp4_buf_t *, uint16_t);
+static void put32(fmp4_buf_t *, uint32_t);
+static void put64(fmp4_buf_t *, uint64_t);
+static void put_zero(fmp4_buf_t *, size_t);
+static size_t box_begin(fmp4_buf_t *, const char *);
+static size_t full_box_begin(fmp4_buf_t *, const char *, uint8_t, uint32_t);
+static void box_end(fmp4_buf_t *, size_t);
+static void set32(fmp4_buf_t *, size_t, uint32_t);
+
+static int write_init(fmp4_t *);
+static void write_trak(fmp4_t *, int);
+static void write_avc1(fmp4_buf_t *, fmp4_track_t *);
+static void write_mp4a(fmp4_buf_t *, fmp4_track_t *);
+static void put_descriptor(fmp4_buf_t *, uint8_t, uint32_t);
+static bool ready_to_start(fmp4_t *, uint8_t, uint32_t, bool);
+static int open_segment(fmp4_t *);
+static int flush_part(fmp4_t *);
+static int writev_all(int, struct iovec *, int);
+static uint64_t decode_time(fmp4_t *, fmp4_track_t *, uint32_t);
+static bool parse_sps_size(const byte *, uint32_t, uint16_t *, uint16_t *);
+
+fmp4_t *fmp4_open(const char *dir, uint32_t part_ms, uint32_t segment_ms, bool copy) {
+  if (0 != mkdir(dir, 0755) && errno != EEXIST) return NULL;
+
+  fmp4_t *fmp4 = calloc(1, sizeof(fmp4_t));
+  snprintf(fmp4->dir, sizeof(fmp4->dir), "%s", dir);
+  fmp4->part_ms = part_ms ? part_ms : 200;
+  fmp4->segment_ms = segment_ms > fmp4->part_ms ? segment_ms : fmp4->part_ms;
+  fmp4->copy = copy;
+  fmp4->fd = -1;
+  return fmp4;
+}
+
+// write the pending part, e.g. at the end of the input
+int fmp4_flush(fmp4_t *fmp4) { return flush_part(fmp4); }
+
+void fmp4_close(fmp4_t *fmp4) {
+  if (fmp4 == NULL) return;
+
+  if (fmp4->fd >= 0) close(fmp4->fd);
+  for (int i = 0; i < FMP4_MAX_TRACKS; ++i) free(fmp4->tracks[i].config.data);
+  free(fmp4->samples);
+  free(fmp4->arena.data);
+  free(fmp4->head.data);
+  free(fmp4);
+}
+
+// a track the input announces (or no longer does, e.g. a codec that can't be packaged)
+void fmp4_expect(fmp4_t *fmp4, uint8_t track, bool expected) {
+  if (track >= FMP4_MAX_TRACKS) return;
+  if (expected) fmp4->expected |= 1 << track;
+  else fmp4->expected &= ~(1 << track);
+}
+
+/*
+ * sequence headers: the config records are copied, they go into the init segment as is.
+ * a change after the init segment is written would need a new one, it's ignored.
+ */
+int fmp4_set_avc_config(fmp4_t *fmp4, const byte *data, uint32_t size) {
+  flv_avc_config_t config;
+  if (0 != flv_parse_avc_config(data, size, &config) || config.sps_count == 0 || config.pps_count == 0) {
+    snprintf(fmp4->error, sizeof(fmp4->error), "bad AVCDecoderConfigurationRecord");
+    return -1;
+  }
+  if (fmp4->started) return 0;
+
+  fmp4_track_t *track = &fmp4->tracks[FMP4_TRACK_VIDEO];
+  track->config.size = 0;
+  put(&track->config, data, size);
+  if (!parse_sps_size(config.sps[0], config.sps_size[0], &track->width, &track->height)) track->width = track->height = 0;
+  track->timescale = VIDEO_TIMESCALE;
+  track->last_duration = VIDEO_TIMESCALE / 25;
+  track->enabled = true;
+  return 0;
+}
+
+int fmp4_set_aac_config(fmp4_t *fmp4, const byte *data, uint32_t size) {
+  flv_aac_config_t config;
+  if (0 != flv_parse_aac_config(data, size, &config) || config.sample_rate == 0) {
+    snprintf(fmp4->error, sizeof(fmp4->error), "unsupported AudioSpecificConfig");
+    return -1;
+  }
+  if (fmp4->started) return 0;
+
+  fmp4_track_t *track = &fmp4->tracks[FMP4_TRACK_AUDIO];
+  track->config.size = 0;
+  put(&track->config, data, size);
+  track->sample_rate = config.sample_rate;
+  track->channels = config.channels;
+  track->timescale = track->sample_rate;
+  track->last_duration = AAC_FRAME_SAMPLES;
+  track->enabled = true;
+  return 0;
+}
+
+/*
+ * queue one sample, cutting the current part every part_ms and the segment on the first keyframe after segment_ms.
+ * parts are cut on video samples only, so audio doesn't split a video frame's part, unless there is no video.
+ */
+int fmp4_write_sample(fmp4_t *fmp4, uint8_t track, uint32_t dts, int32_t cto, bool keyframe, const byte *data, uint32_t size) {
+  if (track >= FMP4_MAX_TRACKS || !fmp4->tracks[track].enabled) {
+    ++fmp4->dropped;
+    return 0;
+  }
+
+  if (!fmp4->started) {
+    if (!ready_to_start(fmp4, track, dts, keyframe)) {
+      ++fmp4->dropped;
+      return 0;
+    }
+    if (0 != write_init(fmp4)) return -1;
+    fmp4->started = true;
+    fmp4->origin = dts;
+    fmp4->segment_start = fmp4->part_start = dts;
+    if (0 != open_segment(fmp4)) return -1;
+  }
+
+  bool leading = track == FMP4_TRACK_VIDEO || !fmp4->tracks[FMP4_TRACK_VIDEO].enabled;
+  if (leading && dts >= fmp4->part_start) {
+    bool cut_segment = keyframe && dts - fmp4->segment_start >= fmp4->segment_ms;
+    if (cut_segment || dts - fmp4->part_start >= fmp4->part_ms) {
+      if (0 != flush_part(fmp4)) return -1;
+      fmp4->part_start = dts;
+    }
+    if (cut_segment) {
+      fmp4->segment_start = dts;
+      if (0 != open_segment(fmp4)) return -1;
+    }
+  }
+
+  if (fmp4->count == fmp4->capacity) {
+    size_t capacity = fmp4->capacity ? fmp4->capacity * 2 : 256;
+    fmp4_sample_t *samples = realloc(fmp4->samples, capacity * sizeof(fmp4_sample_t));
+    if (samples == NULL) {
+      snprintf(fmp4->error, sizeof(fmp4->error), "out of memory");
+      return -1;
+    }
+    fmp4->samples = samples;
+    fmp4->capacity = capacity;
+  }
+
+  fmp4_sample_t *sample = &fmp4->samples[fmp4->count++];
+  sample->track = track;
+  sample->keyframe = keyframe;
+  sample->dts = dts;
+  sample->cto = cto;
+  sample->size = size;
+  sample->data = data;
+  if (fmp4->copy) {
+    // the arena may move while the part grows, keep the offset
+    sample->data = NULL;
+    sample->offset = fmp4->arena.size;
+    if (!put(&fmp4->arena, data, size)) {
+      snprintf(fmp4->error, sizeof(fmp4->error), "out of memory");
+      return -1;
+    }
+  }
+  ++fmp4->samples_total;
+  return 0;
+}
+
+/*
+ * the init segment can't take a track later, so it waits for the configs of all announced tracks,
+ * and segment 1 starts on a video keyframe: samples before that are dropped.
+ * a track announced but never configured holds the others back for one segment_ms at most.
+ */
+static bool ready_to_start(fmp4_t *fmp4, uint8_t track, uint32_t dts, bool keyframe) {
+  if (!fmp4->waiting) {
+    fmp4->waiting = true;
+    fmp4->wait_start = dts;
+  }
+  for (int i = 0; i < FMP4_MAX_TRACKS; ++i) {
+    if ((fmp4->expected & (1 << i)) && !fmp4->tracks[i].enabled && dts - fmp4->wait_start < fmp4->segment_ms) return false;
+  }
+  if (fmp4->tracks[FMP4_TRACK_VIDEO].enabled) return track == FMP4_TRACK_VIDEO && keyframe;
+  return true;
+}
+
+/*
+ * ftyp + moov, no samples in the sample tables, mvex announces the fragments
+ */
+static int write_init(fmp4_t *fmp4) {
+  fmp4_buf_t *b = &fmp4->head;
+  b->size = 0;
+
+  size_t ftyp = box_begin(b, "ftyp");
+  put(b, "iso6", 4);
+  put32(b, 0);
+  put(b, "iso6cmfcisomavc1mp41", 20);
+  box_end(b, ftyp);
+
+  size_t moov = box_begin(b, "moov");
+  size_t mvhd = full_box_begin(b, "mvhd", 0, 0);
+  put32(b, 0); // creation_time
+  put32(b, 0); // modification_time
+  put32(b, 1000);
+  put32(b, 0); // duration
+  put32(b, 0x00010000); // rate 1.0
+  put16(b, 0x0100); // volume 1.0
+  put_zero(b, 10);
+  put(b, matrix, sizeof(matrix));
+  put_zero(b, 24); // pre_defined
+  put32(b, FMP4_MAX_TRACKS + 1); // next_track_ID
+  box_end(b, mvhd);
+
+  for (int i = 0; i < FMP4_MAX_TRACKS; ++i) {
+    if (fmp4->tracks[i].enabled) write_trak(fmp4, i);
+  }
+
+  size_t mvex = box_begin(b, "mvex");
+  for (int i = 0; i < FMP4_MAX_TRACKS; ++i) {
+    if (!fmp4->tracks[i].enabled) continue;
+    size_t trex = full_box_begin(b, "trex", 0, 0);
+    put32(b, i + 1);
+    put32(b, 1); // default_sample_description_index
+    put32(b, 0);
+    put32(b, 0);
+    put32(b, 0);
+    box_end(b, trex);
+  }
+  box_end(b, mvex);
+  box_end(b, moov);
+
+  char path[FMP4_PATH_SIZE];
+  snprintf(path, sizeof(path), "%s/init.mp4", fmp4->dir);
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    snprintf(fmp4->error, sizeof(fmp4->error), "open %s FAILED", path);
+    return -1;
+  }
+  struct iovec iov = {b->data, b->size};
+  int ret = writev_all(fd, &iov, 1);
+  close(fd);
+  if (ret != 0) snprintf(fmp4->error, sizeof(fmp4->error), "write %s FAILED", path);
+  fmp4->bytes += b->size;
+  return ret;
+}
+
+static void write_trak(fmp4_t *fmp4, int i) {
+  fmp4_buf_t *b = &fmp4->head;
+  fmp4_track_t *track = &fmp4->tracks[i];
+  bool video = i == FMP4_TRACK_VIDEO;
+
+  size_t trak = box_begin(b, "trak");
+  size_t tkhd = full_box_begin(b, "tkhd", 0, 0x000003); // enabled, in movie
+  put32(b, 0);
+  put32(b, 0);
+  put32(b, i + 1); // track_ID
+  put32(b, 0);
+  put32(b, 0); // duration
+  put_zero(b, 8);
+  put16(b, 0); // layer
+  put16(b, 0); // alternate_group
+  put16(b, video ? 0 : 0x0100); // volume
+  put16(b, 0);
+  put(b, matrix, sizeof(matrix));
+  put32(b, (uint32_t) track->width << 16);
+  put32(b, (uint32_t) track->height << 16);
+  box_end(b, tkhd);
+
+  size_t mdia = box_begin(b, "mdia");
+  size_t mdhd = full_box_begin(b, "mdhd", 0, 0);
+  put32(b, 0);
+  put32(b, 0);
+  put32(b, track->timescale);
+  put32(b, 0);
+  put16(b, 0x55c4); // und
+  put16(b, 0);
+  box_end(b, mdhd);
+
+  size_t hdlr = full_box_begin(b, "hdlr", 0, 0);
+  put32(b, 0);
+  put(b, video ? "vide" : "soun", 4);
+  put_zero(b, 12);
+  put(b, video ? "VideoHandler" : "SoundHandler", 13);
+  box_end(b, hdlr);
+
+  size_t minf = box_begin(b, "minf");
+  if (video) {
+    size_t vmhd = full_box_begin(b, "vmhd", 0, 0x000001);
+    put_zero(b, 8); // graphicsmode, opcolor
+    box_end(b, vmhd);
+  } else {
+    size_t smhd = full_box_begin(b, "smhd", 0, 0);
+    put_zero(b, 4); // balance
+    box_end(b, smhd);
+  }
+
+  size_t dinf = box_begin(b, "dinf");
+  size_t dref = full_box_begin(b, "dref", 0, 0);
+  put32(b, 1);
+  size_t url = full_box_begin(b, "url ", 0, 0x000001); // self contained
+  box_end(b, url);
+  box_end(b, dref);
+  box_end(b, dinf);
+
+  size_t stbl = box_begin(b, "stbl");
+  size_t stsd = full_box_begin(b, "stsd", 0, 0);
+  put32(b, 1);
+  if (video) {
+    write_avc1(b, track);
+  } else {
+    write_mp4a(b, track);
+  }
+  box_end(b, stsd);
+  const char *empty[] = {"stts", "stsc", "stco"};
+  for (int n = 0; n < 3; ++n) {
+    size_t box = full_box_begin(b, empty[n], 0, 0);
+    put32(b, 0);
+    box_end(b, box);
+  }
+  size_t stsz = full_box_begin(b, "stsz", 0, 0);
+  put32(b, 0);
+  put32(b, 0);
+  box_end(b, stsz);
+  box_end(b, stbl);
+
+  box_end(b, minf);
+  box_end(b, mdia);
+  box_end(b, trak);
+}
+
+static void write_avc1(fmp4_buf_t *b, fmp4_track_t *track) {
+  size_t avc1 = box_begin(b, "avc1");
+  put_zero(b, 6);
+  put16(b, 1); // data_reference_index
+  put_zero(b, 16);
+  put16(b, track->width);
+  put16(b, track->height);
+  put32(b, 0x00480000); // 72 dpi
+  put32(b, 0x00480000);
+  put32(b, 0);
+  put16(b, 1); // frame_count
+  put_zero(b, 32); // compressorname
+  put16(b, 0x0018); // depth
+  put16(b, 0xffff);
+
+  size_t avcc = box_begin(b, "avcC");
+  put(b, track->config.data, track->config.size);
+  box_end(b, avcc);
+  box_end(b, avc1);
+}
+
+static void write_mp4a(fmp4_buf_t *b, fmp4_track_t *track) {
+  size_t mp4a = box_begin(b, "mp4a");
+  put_zero(b, 6);
+  put16(b, 1);
+  put_zero(b, 8);
+  put16(b, track->channels ? track->channels : 2);
+  put16(b, 16); // samplesize
+  put32(b, 0);
+  put32(b, (track->sample_rate > 0xffff ? 0 : track->sample_rate) << 16);
+
+  // ISO_14496_1 ES_Descriptor > DecoderConfigDescriptor > DecoderSpecificInfo, SLConfigDescriptor
+  uint32_t config_size = track->config.size;
+  size_t esds = full_box_begin(b, "esds", 0, 0);
+  put_descriptor(b, 0x03, 3 + (5 + 13 + 5 + config_size) + (5 + 1));
+  put16(b, 0); // ES_ID
+  put8(b, 0);
+  put_descriptor(b, 0x04, 13 + 5 + config_size);
+  put8(b, 0x40); // objectTypeIndication: MPEG-4 audio
+  put8(b, 0x15); // streamType audio << 2 | 1
+  put_zero(b, 3); // bufferSizeDB
+  put32(b, 0); // maxBitrate
+  put32(b, 0); // avgBitrate
+  put_descriptor(b, 0x05, config_size);
+  put(b, track->config.data, config_size);
+  put_descriptor(b, 0x06, 1);
+  put8(b, 0x02);
+  box_end(b, esds);
+  box_end(b, mp4a);
+}
+
+// tag + 4 byte expandable size, fixed width so the sizes above can be computed up front
+static void put_descriptor(fmp4_buf_t *b, uint8_t tag, uint32_t size) {
+  put8(b, tag);
+  put8(b, 0x80 | ((size >> 21) & 0x7f));
+  put8(b, 0x80 | ((size >> 14) & 0x7f));
+  put8(b, 0x80 | ((size >> 7) & 0x7f));
+  put8(b, size & 0x7f);
+}
+
+static int open_segment(fmp4_t *fmp4) {
+  if (fmp4->fd >= 0) close(fmp4->fd);
+
+  char path[FMP4_PATH_SIZE];
+  snprintf(path, sizeof(path), "%s/seg-%05u.m4s", fmp4->dir, fmp4->segment++);
+  if ((fmp4->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+    snprintf(fmp4->error, sizeof(fmp4->error), "open %s FAILED", path);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * moof (one traf per track) + mdat: the boxes are built in head, the sample payloads are
+ * handed to writev() where they are, video samples first.
+ */
+static int flush_part(fmp4_t *fmp4) {
+  if (fmp4->count == 0 || fmp4->fd < 0) return 0;
+
+  fmp4_buf_t *b = &fmp4->head;
+  b->size = 0;
+
+  size_t moof = box_begin(b, "moof");
+  size_t mfhd = full_box_begin(b, "mfhd", 0, 0);
+  put32(b, ++fmp4->sequence);
+  box_end(b, mfhd);
+
+  size_t data_offset[FMP4_MAX_TRACKS] = {0};
+  uint32_t payload[FMP4_MAX_TRACKS] = {0};
+  for (int t = 0; t < FMP4_MAX_TRACKS; ++t) {
+    fmp4_track_t *track = &fmp4->tracks[t];
+    uint32_t count = 0;
+    size_t first = 0;
+    for (size_t n = 0; n < fmp4->count; ++n) {
+      if (fmp4->samples[n].track != t) continue;
+      if (count++ == 0) first = n;
+    }
+    if (count == 0) continue;
+
+    bool video = t == FMP4_TRACK_VIDEO;
+    uint32_t flags = TRUN_DATA_OFFSET | TRUN_SAMPLE_DURATION | TRUN_SAMPLE_SIZE | (video ? TRUN_SAMPLE_FLAGS | TRUN_SAMPLE_CTO : 0);
+
+    size_t traf = box_begin(b, "traf");
+    size_t tfhd = full_box_begin(b, "tfhd", 0, 0x020000); // default-base-is-moof
+    put32(b, t + 1);
+    box_end(b, tfhd);
+
+    size_t tfdt = full_box_begin(b, "tfdt", 1, 0);
+    put64(b, decode_time(fmp4, track, fmp4->samples[first].dts));
+    box_end(b, tfdt);
+
+    size_t trun = full_box_begin(b, "trun", 1, flags); // version 1: signed composition offsets
+    put32(b, count);
+    data_offset[t] = b->size;
+    put32(b, 0);
+
+    // a sample's duration is only known with the next one, patch it then
+    size_t duration_at = 0;
+    uint64_t previous = 0;
+    for (size_t n = first; n < fmp4->count; ++n) {
+      fmp4_sample_t *sample = &fmp4->samples[n];
+      if (sample->track != t) continue;
+
+      uint64_t time = decode_time(fmp4, track, sample->dts);
+      if (duration_at) {
+        track->last_duration = time > previous ? (uint32_t) (time - previous) : 0;
+        set32(b, duration_at, track->last_duration);
+      }
+      duration_at = b->size;
+      previous = time;
+
+      put32(b, track->last_duration);
+      put32(b, sample->size);
+      if (video) {
+        put32(b, sample->keyframe ? SAMPLE_SYNC : SAMPLE_NON_SYNC);
+        put32(b, (uint32_t) ((int64_t) sample->cto * track->timescale / 1000));
+      }
+      payload[t] += sample->size;
+    }
+    box_end(b, trun);
+    box_end(b, traf);
+  }
+  box_end(b, moof);
+
+  // data offsets are relative to the moof, the payloads follow the mdat header
+  uint32_t mdat_size = 8;
+  for (int t = 0; t < FMP4_MAX_TRACKS; ++t) {
+    if (data_offset[t]) set32(b, data_offset[t], b->size + mdat_size);
+    mdat_size += payload[t];
+  }
+  put32(b, mdat_size);
+  put(b, "mdat", 4);
+  if (b->data == NULL) {
+    snprintf(fmp4->error, sizeof(fmp4->error), "out of memory");
+    return -1;
+  }
+
+  struct iovec iov[IOV_MAX];
+  int iovcnt = 0;
+  iov[iovcnt].iov_base = b->data;
+  iov[iovcnt++].iov_len = b->size;
+  for (int t = 0; t < FMP4_MAX_TRACKS; ++t) {
+    for (size_t n = 0; n < fmp4->count; ++n) {
+      fmp4_sample_t *sample = &fmp4->samples[n];
+      if (sample->track != t || sample->size == 0) continue;
+      if (iovcnt == IOV_MAX) {
+        if (0 != writev_all(fmp4->fd, iov, iovcnt)) goto failed;
+        ++fmp4->writev_calls;
+        iovcnt = 0;
+      }
+      iov[iovcnt].iov_base = (void *) (sample->data ? sample->data : fmp4->arena.data + sample->offset);
+      iov[iovcnt++].iov_len = sample->size;
+    }
+  }
+  if (0 != writev_all(fmp4->fd, iov, iovcnt)) goto failed;
+  ++fmp4->writev_calls;
+
+  fmp4->bytes += b->size + mdat_size - 8;
+  ++fmp4->parts;
+  fmp4->count = 0;
+  fmp4->arena.size = 0;
+  return 0;
+
+failed:
+  snprintf(fmp4->error, sizeof(fmp4->error), "write segment %u FAILED", fmp4->segment - 1);
+  return -1;
+}
+
+// writev() may stop short (signals, pipes): advance through iov and retry
+static int writev_all(int fd, struct iovec *iov, int iovcnt) {
+  while (iovcnt > 0) {
+    ssize_t n = writev(fd, iov, iovcnt);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    while (iovcnt > 0 && (size_t) n >= iov->iov_len) {
+      n -= iov->iov_len;
+      ++iov;
+      --iovcnt;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (byte *) iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return 0;
+}
+
+// flv timestamps are ms, samples before the first one are clamped to 0
+static uint64_t decode_time(fmp4_t *fmp4, fmp4_track_t *track, uint32_t dts) { return dts > fmp4->origin ? (uint64_t) (dts - fmp4->origin) * track->timescale / 1000 : 0; }
+
+/*
+ * box writing
+ */
+static bool put(fmp4_buf_t *b, const void *data, size_t size) {
+  if (b->size + size > b->capacity) {
+    size_t capacity = b->capacity ? b->capacity : 4096;
+    while (capacity < b->size + size) capacity *= 2;
+    byte *p = realloc(b->data, capacity);
+    if (p == NULL) return false;
+    b->data = p;
+    b->capacity = capacity;
+  }
+  if (size) memcpy(b->data + b->size, data, size);
+  b->size += size;
+  return true;
+}
+
+static void put8(fmp4_buf_t *b, uint8_t v) { put(b, &v, 1); }
+
+static void put16(fmp4_buf_t *b, uint16_t v) {
+  byte p[2] = {v >> 8, v};
+  put(b, p, sizeof(p));
+}
+
+static void put32(fmp4_buf_t *b, uint32_t v) {
+  byte p[4] = {v >> 24, v >> 16, v >> 8, v};
+  put(b, p, sizeof(p));
+}
+
+static void put64(fmp4_buf_t *b, uint64_t v) {
+  put32(b, v >> 32);
+  put32(b, (uint32_t) v);
+}
+
+static void put_zero(fmp4_buf_t *b, size_t size) {
+  static const byte zero[64] = {0};
+  put(b, zero, size);
+}
+
+static size_t box_begin(fmp4_buf_t *b, const char *type) {
+  size_t at = b->size;
+  put32(b, 0);
+  put(b, type, 4);
+  return at;
+}
+
+static size_t full_box_begin(fmp4_buf_t *b, const char *type, uint8_t version, uint32_t flags) {
+  size_t at = box_begin(b, type);
+  put32(b, (uint32_t) version << 24 | (flags & 0xffffff));
+  return at;
+}
+
+static void box_end(fmp4_buf_t *b, size_t at) { set32(b, at, b->size - at); }
+
+static void set32(fmp4_buf_t *b, size_t at, uint32_t v) {
+  if (b->data == NULL || at + 4 > b->size) return;
+  byte *p = b->data + at;
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+/*
+ * picture size from the SPS (H.264 7.3.2.1.1), for tkhd and avc1
+ */
+typedef struct {
+  byte data[256];
+  uint32_t size;
+  uint32_t bit;
+} bit_reader_t;
+
+static uint32_t read_bits(bit_reader_t *r, int count) {
+  uint32_t v = 0;
+  // past the end reads zeros, the caller checks r->bit afterwards
+  for (int i = 0; i < count; ++i, ++r->bit) {
+    v = (v << 1) | (r->bit < r->size * 8 ? (r->data[r->bit >> 3] >> (7 - (r->bit & 7))) & 1 : 0);
+  }
+  return v;
+}
+
+static uint32_t read_ue(bit_reader_t *r) {
+  int zeros = 0;
+  while (read_bits(r, 1) == 0 && zeros < 31) ++zeros;
+  return zeros ? ((1u << zeros) - 1) + read_bits(r, zeros) : 0;
+}
+
+static int32_t read_se(bit_reader_t *r) {
+  uint32_t v = read_ue(r);
+  return v & 1 ? (int32_t) ((v + 1) / 2) : -(int32_t) (v / 2);
+}
+
+static bool parse_sps_size(const byte *sps, uint32_t size, uint16_t *width, uint16_t *height) {
+  // drop the emulation prevention bytes (00 00 03)
+  bit_reader_t r = {{0}, 0, 0};
+  for (uint32_t i = 1, zeros = 0; i < size && r.size < sizeof(r.data); ++i) {
+    if (zeros >= 2 && sps[i] == 0x03) {
+      zeros = 0;
+      continue;
+    }
+    zeros = sps[i] == 0 ? zeros + 1 : 0;
+    r.data[r.size++] = sps[i];
+  }
+  if (r.size < 4) return false;
+
+  uint8_t profile = read_bits(&r, 8);
+  read_bits(&r, 16); // constraint flags, level
+  read_ue(&r); // seq_parameter_set_id
+
+  uint32_t chroma_format = 1;
+  if (profile == 100 || profile == 110 || profile == 122 || profile == 244 || profile == 44 || profile == 83 || profile == 86 || profile == 118 || profile == 128 || profile == 138 ||
+      profile == 139 || profile == 134 || profile == 135) {
+    chroma_format = read_ue(&r);
+    if (chroma_format == 3) read_bits(&r, 1); // separate_colour_plane_flag
+    read_ue(&r); // bit_depth_luma_minus8
+    read_ue(&r); // bit_depth_chroma_minus8
+    read_bits(&r, 1); // qpprime_y_zero_transform_bypass_flag
+    if (read_bits(&r, 1)) {
+      for (int i = 0; i < (chroma_format != 3 ? 8 : 12); ++i) {
+        if (!read_bits(&r, 1)) continue;
+        int last = 8, next = 8;
+        for (int j = 0; j < (i < 6 ? 16 : 64) && next != 0; ++j) {
+          next = (last + read_se(&r) + 256) % 256;
+          if (next != 0) last = next;
+        }
+      }
+    }
+  }
+
+  read_ue(&r); // log2_max_frame_num_minus4
+  uint32_t poc_type = read_ue(&r);
+  if (poc_type == 0) {
+    read_ue(&r);
+  } else if (poc_type == 1) {
+    read_bits(&r, 1);
+    read_se(&r);
+    read_se(&r);
+    uint32_t cycle = read_ue(&r);
+    for (uint32_t i = 0; i < cycle && i < 256; ++i) read_se(&r);
+  }
+  read_ue(&r); // max_num_ref_frames
+  read_bits(&r, 1); // gaps_in_frame_num_value_allowed_flag
+
+  uint32_t width_mbs = read_ue(&r) + 1;
+  uint32_t height_units = read_ue(&r) + 1;
+  uint32_t frame_mbs_only = read_bits(&r, 1);
+  if (!frame_mbs_only) read_bits(&r, 1); // mb_adaptive_frame_field_flag
+  read_bits(&r, 1); // direct_8x8_inference_flag
+
+  uint32_t crop[4] = {0};
+  if (read_bits(&r, 1)) {
+    for (int i = 0; i < 4; ++i) crop[i] = read_ue(&r);
+  }
+  if (r.bit > r.size * 8) return false;
+
+  uint32_t crop_x = chroma_format == 1 || chroma_format == 2 ? 2 : 1;
+  uint32_t crop_y = (chroma_format == 1 ? 2 : 1) * (2 - frame_mbs_only);
+  int32_t w = (int32_t) (width_mbs * 16) - (int32_t) ((crop[0] + crop[1]) * crop_x);
+  int32_t h = (int32_t) ((2 - frame_mbs_only) * height_units * 16) - (int32_t) ((crop[2] + crop[3]) * crop_y);
+  if (w <= 0 || h <= 0 || w > 0xffff || h > 0xffff) return false;
+
+  *width = (uint16_t) w;
+  *height = (uint16_t) h;
+  return true;
+}
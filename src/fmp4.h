@@ -0,0 +1,85 @@
+#ifndef FMP4_H
+#define FMP4_H
+
+#include "flv.h"
+
+/*
+ * fragmented mp4 (CMAF) muxer fed with flv tag payloads: init.mp4, then seg-%05d.m4s segments
+ * starting on a keyframe, each one a sequence of moof+mdat parts of about part_ms.
+ *
+ * samples are kept by reference and written with writev() when their part is cut, so the payloads
+ * have to stay valid until then: true for the mmap reader, set copy for a pipe whose buffer is reused.
+ */
+
+#define FMP4_TRACK_VIDEO (0)
+#define FMP4_TRACK_AUDIO (1)
+#define FMP4_MAX_TRACKS (2)
+#define FMP4_PATH_SIZE (512) // dir + segment name
+
+typedef struct {
+  byte *data;
+  size_t size;
+  size_t capacity;
+} fmp4_buf_t;
+
+typedef struct {
+  uint8_t track;
+  bool keyframe;
+  uint32_t dts; // ms, flv timestamp
+  int32_t cto; // ms, composition time
+  uint32_t size;
+  const byte *data; // NULL: copied to the arena at offset
+  size_t offset;
+} fmp4_sample_t;
+
+typedef struct {
+  bool enabled;
+  uint32_t timescale;
+  fmp4_buf_t config; // AVCDecoderConfigurationRecord / AudioSpecificConfig
+  uint16_t width; // video
+  uint16_t height;
+  uint8_t channels; // audio
+  uint32_t sample_rate;
+  uint32_t last_duration; // of the last sample of a part, whose successor isn't known yet
+} fmp4_track_t;
+
+typedef struct {
+  char dir[256];
+  uint32_t part_ms;
+  uint32_t segment_ms;
+  bool copy;
+  bool started; // init segment written
+  uint8_t expected; // bit per track announced by the input, the init segment waits for their configs
+  bool waiting; // samples seen before the start, since wait_start
+  uint32_t wait_start;
+  int fd; // current segment
+  uint32_t segment;
+  uint32_t sequence;
+  uint32_t origin; // dts of the first sample, decode time 0
+  uint32_t segment_start;
+  uint32_t part_start;
+  fmp4_track_t tracks[FMP4_MAX_TRACKS];
+  fmp4_sample_t *samples; // of the current part
+  size_t count;
+  size_t capacity;
+  fmp4_buf_t arena;
+  fmp4_buf_t head; // boxes, moof + mdat header
+  // stats
+  uint64_t samples_total;
+  uint64_t dropped;
+  uint64_t bytes;
+  uint64_t parts;
+  uint64_t writev_calls;
+  char error[FMP4_PATH_SIZE + 32]; // room for a path
+} fmp4_t;
+
+fmp4_t *fmp4_open(const char *, uint32_t, uint32_t, bool);
+void fmp4_close(fmp4_t *);
+// @return 0, -1 on error, see fmp4->error
+int fmp4_flush(fmp4_t *);
+void fmp4_expect(fmp4_t *, uint8_t, bool);
+int fmp4_set_avc_config(fmp4_t *, const byte *, uint32_t);
+int fmp4_set_aac_config(fmp4_t *, const byte *, uint32_t);
+int fmp4_write_sample(fmp4_t *, uint8_t, uint32_t, int32_t, bool, const byte *, uint32_t);
+
+#endif
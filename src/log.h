@@ -0,0 +1,33 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <librtmp/log.h>
+
+/*
+ * RTMP_Log wrappers for the per tag paths.
+ * levels above LOG_LEVEL_MIN are constant folded away, the others check RTMP_debuglevel
+ * before any argument is evaluated, so a filtered call costs one compare and no varargs call.
+ * release builds use -DLOG_LEVEL_MIN=RTMP_LOGINFO (make RELEASE=1).
+ */
+#ifndef LOG_LEVEL_MIN
+#define LOG_LEVEL_MIN RTMP_LOGALL
+#endif
+
+#define LOG_ENABLED(level) ((level) <= LOG_LEVEL_MIN && (level) <= RTMP_debuglevel)
+
+#define LOG(level, ...) \
+  do { \
+    if (LOG_ENABLED(level)) RTMP_Log((level), __VA_ARGS__); \
+  } while (0)
+
+#define LOG_HEX(level, data, len) \
+  do { \
+    if (LOG_ENABLED(level)) RTMP_LogHex((level), (const uint8_t *) (data), (len)); \
+  } while (0)
+
+#define LOG_HEX_STRING(level, data, len) \
+  do { \
+    if (LOG_ENABLED(level)) RTMP_LogHexString((level), (const uint8_t *) (data), (len)); \
+  } while (0)
+
+#endif
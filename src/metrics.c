@@ -0,0 +1,221 @@
+#ifdef FLV_METRICS
+
+#include "metrics.h"
+#include <librtmp/log.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+// latency histogram: bucket i counts samples of [2^i, 2^(i+1)) ticks
+#define METRIC_BUCKETS (40)
+
+static const char *metric_stage_names[] = {"read", "parse", "send", "write", "gap"};
+
+typedef struct {
+  uint64_t count;
+  uint64_t bytes;
+  uint64_t ticks;
+  uint64_t buckets[METRIC_BUCKETS];
+} metric_stage_t;
+
+// one block per thread, only its owner writes it, the snapshot thread reads it
+typedef struct metric_block {
+  struct metric_block *next;
+  metric_stage_t stages[METRIC_STAGE_COUNT];
+} metric_block_t;
+
+int metrics_enabled = 0;
+
+static __thread metric_block_t *local_block;
+static metric_block_t *blocks;
+static pthread_mutex_t blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *metrics_tool;
+static const char *metrics_target;
+static unsigned metrics_interval_ms;
+static double ns_per_tick = 1;
+static pthread_t snapshot_thread;
+static volatile int snapshot_running;
+
+static uint64_t now_ns();
+static void calibrate();
+static metric_block_t *attach_block();
+static size_t format_snapshot(char *, size_t);
+static void write_textfile();
+static void *snapshot_main(void *);
+static void *serve_main(void *);
+
+#if !defined(__x86_64__) && !defined(__i386__)
+uint64_t metrics_ticks() { return now_ns(); }
+#endif
+
+void metrics_init(const char *tool, const char *target, unsigned interval_ms) {
+  if (target == NULL) return;
+
+  metrics_tool = tool;
+  metrics_target = target;
+  metrics_interval_ms = interval_ms ? interval_ms : 1000;
+  calibrate();
+
+  snapshot_running = 1;
+  void *(*entry)(void *) = 0 == strncmp(target, "unix:", 5) ? serve_main : snapshot_main;
+  if (0 != pthread_create(&snapshot_thread, NULL, entry, NULL)) {
+    RTMP_Log(RTMP_LOGERROR, "metrics: create snapshot thread FAILED");
+    snapshot_running = 0;
+    return;
+  }
+
+  metrics_enabled = 1;
+}
+
+void metrics_stop() {
+  if (!snapshot_running) return;
+  snapshot_running = 0;
+  pthread_join(snapshot_thread, NULL);
+  if (0 != strncmp(metrics_target, "unix:", 5)) write_textfile();
+}
+
+void metrics_record(int stage, uint64_t ticks, size_t bytes) {
+  metric_block_t *block = local_block ? local_block : attach_block();
+  metric_stage_t *s = &block->stages[stage];
+
+  int bucket = ticks ? 63 - __builtin_clzll(ticks) : 0;
+  if (bucket >= METRIC_BUCKETS) bucket = METRIC_BUCKETS - 1;
+
+  // single writer: plain relaxed stores, no locked instructions on the hot path
+  __atomic_store_n(&s->count, s->count + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&s->bytes, s->bytes + bytes, __ATOMIC_RELAXED);
+  __atomic_store_n(&s->ticks, s->ticks + ticks, __ATOMIC_RELAXED);
+  __atomic_store_n(&s->buckets[bucket], s->buckets[bucket] + 1, __ATOMIC_RELAXED);
+}
+
+static metric_block_t *attach_block() {
+  local_block = calloc(1, sizeof(metric_block_t));
+  pthread_mutex_lock(&blocks_lock);
+  local_block->next = blocks;
+  blocks = local_block;
+  pthread_mutex_unlock(&blocks_lock);
+  return local_block;
+}
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void calibrate() {
+  uint64_t ns = now_ns();
+  uint64_t ticks = metrics_ticks();
+  usleep(10 * 1000);
+  ns = now_ns() - ns;
+  ticks = metrics_ticks() - ticks;
+  if (ticks > 0) ns_per_tick = (double) ns / ticks;
+}
+
+/*
+ * prometheus text exposition format, summed over all threads
+ */
+static size_t format_snapshot(char *buffer, size_t size) {
+  metric_stage_t total[METRIC_STAGE_COUNT];
+  memset(total, 0, sizeof(total));
+
+  pthread_mutex_lock(&blocks_lock);
+  for (metric_block_t *block = blocks; block != NULL; block = block->next) {
+    for (int i = 0; i < METRIC_STAGE_COUNT; ++i) {
+      metric_stage_t *s = &block->stages[i];
+      total[i].count += __atomic_load_n(&s->count, __ATOMIC_RELAXED);
+      total[i].bytes += __atomic_load_n(&s->bytes, __ATOMIC_RELAXED);
+      total[i].ticks += __atomic_load_n(&s->ticks, __ATOMIC_RELAXED);
+      for (int j = 0; j < METRIC_BUCKETS; ++j) total[i].buckets[j] += __atomic_load_n(&s->buckets[j], __ATOMIC_RELAXED);
+    }
+  }
+  pthread_mutex_unlock(&blocks_lock);
+
+  size_t len = 0;
+#define EMIT(...) len += snprintf(buffer + len, len < size ? size - len : 0, __VA_ARGS__)
+  EMIT("# TYPE flv_stage_bytes_total counter\n");
+  for (int i = 0; i < METRIC_STAGE_COUNT; ++i) {
+    if (total[i].count) EMIT("flv_stage_bytes_total{tool=\"%s\",stage=\"%s\"} %llu\n", metrics_tool, metric_stage_names[i], (unsigned long long) total[i].bytes);
+  }
+
+  EMIT("# TYPE flv_stage_seconds histogram\n");
+  for (int i = 0; i < METRIC_STAGE_COUNT; ++i) {
+    if (!total[i].count) continue;
+    uint64_t cumulative = 0;
+    for (int j = 0; j < METRIC_BUCKETS; ++j) {
+      cumulative += total[i].buckets[j];
+      EMIT("flv_stage_seconds_bucket{tool=\"%s\",stage=\"%s\",le=\"%g\"} %llu\n", metrics_tool, metric_stage_names[i], (double) (2ULL << j) * ns_per_tick / 1e9, (unsigned long long) cumulative);
+    }
+    EMIT("flv_stage_seconds_bucket{tool=\"%s\",stage=\"%s\",le=\"+Inf\"} %llu\n", metrics_tool, metric_stage_names[i], (unsigned long long) total[i].count);
+    EMIT("flv_stage_seconds_sum{tool=\"%s\",stage=\"%s\"} %g\n", metrics_tool, metric_stage_names[i], total[i].ticks * ns_per_tick / 1e9);
+    EMIT("flv_stage_seconds_count{tool=\"%s\",stage=\"%s\"} %llu\n", metrics_tool, metric_stage_names[i], (unsigned long long) total[i].count);
+  }
+#undef EMIT
+
+  return len < size ? len : size - 1;
+}
+
+// write to a temp file and rename, so a scraper never sees half a snapshot
+static void write_textfile() {
+  static char buffer[64 * 1024];
+  char tmp[1024];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", metrics_target);
+
+  FILE *file = fopen(tmp, "w");
+  if (!file) return;
+  fwrite(buffer, 1, format_snapshot(buffer, sizeof(buffer)), file);
+  fclose(file);
+  rename(tmp, metrics_target);
+}
+
+static void *snapshot_main(void *arg) {
+  while (snapshot_running) {
+    for (unsigned slept = 0; snapshot_running && slept < metrics_interval_ms; slept += 100) usleep(100 * 1000);
+    write_textfile();
+  }
+  return NULL;
+}
+
+// every client connecting to the socket gets one snapshot, e.g. `nc -U /tmp/parser.sock`
+static void *serve_main(void *arg) {
+  static char buffer[64 * 1024];
+  const char *path = metrics_target + 5;
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un addr = {0};
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  unlink(path);
+  if (fd < 0 || 0 != bind(fd, (struct sockaddr *) &addr, sizeof(addr)) || 0 != listen(fd, 8)) {
+    RTMP_Log(RTMP_LOGERROR, "metrics: listen on %s FAILED", path);
+    if (fd >= 0) close(fd);
+    return NULL;
+  }
+
+  struct pollfd pfd = {fd, POLLIN, 0};
+  while (snapshot_running) {
+    if (poll(&pfd, 1, 100) <= 0) continue;
+    int client = accept(fd, NULL, NULL);
+    if (client < 0) continue;
+    size_t len = format_snapshot(buffer, sizeof(buffer));
+    for (size_t sent = 0; sent < len;) {
+      ssize_t n = write(client, buffer + sent, len - sent);
+      if (n <= 0) break;
+      sent += n;
+    }
+    close(client);
+  }
+
+  close(fd);
+  unlink(path);
+  return NULL;
+}
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * hot path metrics shared by parser, dump and replay.
+ * build with `make METRICS=1` to compile them in, otherwise every macro below is a no-op.
+ *
+ *   METRIC_BEGIN(read);
+ *   count = RTMP_Read(...);
+ *   METRIC_END(read, METRIC_READ, count);
+ */
+
+// METRIC_GAP: dump's reconnects, upstream lost to playing again
+enum metric_stages { METRIC_READ, METRIC_PARSE, METRIC_SEND, METRIC_WRITE, METRIC_GAP, METRIC_STAGE_COUNT };
+
+#ifdef FLV_METRICS
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define metrics_ticks() __rdtsc()
+#else
+uint64_t metrics_ticks();
+#endif
+
+extern int metrics_enabled;
+
+/*
+ * @param[in] tool: value of the `tool` label
+ * @param[in] target: prometheus text file, or "unix:/path" to serve snapshots on a unix socket
+ * @param[in] interval_ms: snapshot period of the text file
+ */
+void metrics_init(const char *tool, const char *target, unsigned interval_ms);
+void metrics_stop();
+void metrics_record(int stage, uint64_t ticks, size_t bytes);
+
+#define METRIC_BEGIN(name) uint64_t metric_begin_##name = metrics_enabled ? metrics_ticks() : 0
+#define METRIC_END(name, stage, bytes) \
+  do { \
+    if (metrics_enabled) metrics_record((stage), metrics_ticks() - metric_begin_##name, (bytes)); \
+  } while (0)
+
+#else
+
+#define metrics_init(tool, target, interval_ms) ((void) 0)
+#define metrics_stop() ((void) 0)
+#define METRIC_BEGIN(name) ((void) 0)
+#define METRIC_END(name, stage, bytes) ((void) 0)
+
+#endif
+
+#endif
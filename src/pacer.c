@@ -0,0 +1,121 @@
+#include "pacer.h"
+#include <time.h>
+
+static bool non_reference(const flv_video_t *, uint8_t);
+
+void pacer_init(pacer_t *pacer, uint64_t rate, uint32_t burst, uint32_t threshold) {
+  *pacer = (pacer_t){0};
+  pacer->rate = rate / 8.0;
+  pacer->burst = burst ? burst : pacer->rate / 10;
+  // a full chunk has to fit, otherwise it waits forever
+  if (pacer->burst < 65536 + 16) pacer->burst = 65536 + 16;
+  pacer->tokens = pacer->burst;
+  pacer->last = flv_now();
+  pacer->threshold = threshold;
+  pacer->critical = threshold * 2;
+  pacer->length_size = 4;
+}
+
+int pacer_admit(pacer_t *pacer, const flv_tag_t *tag, int64_t queued) {
+  if (queued > (int64_t) pacer->max_queued) pacer->max_queued = queued;
+
+  flv_video_t video;
+  if (0 != flv_parse_video(tag, &video) || (FLV_CODEC_ID_AVC != video.codec_id && FLV_CODEC_ID_HEVC != video.codec_id && FLV_CODEC_ID_AV1 != video.codec_id)) goto send;
+  if (AVC_SEQUENCE_HEADER == video.avc_packet_type) {
+    flv_avc_config_t avc;
+    flv_hevc_config_t hevc;
+    if (FLV_CODEC_ID_AVC == video.codec_id && 0 == flv_parse_avc_config(video.data, video.size, &avc)) pacer->length_size = avc.length_size;
+    if (FLV_CODEC_ID_HEVC == video.codec_id && 0 == flv_parse_hevc_config(video.data, video.size, &hevc)) pacer->length_size = hevc.length_size;
+    goto send;
+  }
+  if (AVC_NALU != video.avc_packet_type || pacer->threshold == 0 || queued < 0) goto send;
+
+  bool keyframe = FLV_FRAME_KEYFRAME == video.frame_type;
+  if (pacer->skipping) {
+    if (!keyframe || queued >= pacer->threshold) goto skip;
+    pacer->skipping = false;
+    goto send;
+  }
+
+  // the receiver can't decode anything up to the next keyframe once a reference frame is gone
+  if (queued >= pacer->critical) {
+    pacer->skipping = true;
+    ++pacer->skips;
+    goto skip;
+  }
+
+  if (queued >= pacer->threshold && !keyframe && (FLV_FRAME_DISPOSABLE == video.frame_type || non_reference(&video, pacer->length_size))) {
+    ++pacer->dropped_disposable;
+    return PACER_DROP;
+  }
+
+send:
+  ++pacer->sent;
+  if (tag->data_size > pacer->max_message) pacer->max_message = tag->data_size;
+  return PACER_SEND;
+
+skip:
+  ++pacer->dropped_skip;
+  return PACER_DROP;
+}
+
+/*
+ * take bytes from the bucket, sleeping until it has refilled enough.
+ * the bucket may go into debt by one message, later sends pay it back.
+ */
+void pacer_wait(pacer_t *pacer, uint32_t bytes) {
+  if (pacer->rate <= 0) return;
+
+  double t = flv_now();
+  pacer->tokens += (t - pacer->last) * pacer->rate;
+  if (pacer->tokens > pacer->burst) pacer->tokens = pacer->burst;
+  pacer->last = t;
+
+  if (pacer->tokens < 0) {
+    double wait = -pacer->tokens / pacer->rate;
+    struct timespec ts = {(time_t) wait, (long) ((wait - (time_t) wait) * 1e9)};
+    nanosleep(&ts, NULL);
+    pacer->waited += wait;
+
+    t = flv_now();
+    pacer->tokens += (t - pacer->last) * pacer->rate;
+    pacer->last = t;
+  }
+  pacer->tokens -= bytes;
+}
+
+/*
+ * a frame is only admitted below critical, so the queue never holds more than critical + the largest frame
+ */
+double pacer_latency_bound(pacer_t *pacer, double rate) {
+  if (pacer->threshold == 0 || rate <= 0) return 0;
+  return (pacer->critical + pacer->max_message) / rate * 1000;
+}
+
+// AVC: nal_ref_idc is 0 on every slice of the frame, HEVC: every slice is a sub-layer non-reference picture (even VCL types below 16).
+// AV1 OBUs don't tell, only the disposable frame type drops those
+static bool non_reference(const flv_video_t *video, uint8_t length_size) {
+  if (FLV_CODEC_ID_AV1 == video->codec_id) return false;
+  bool hevc = FLV_CODEC_ID_HEVC == video->codec_id;
+  flv_nalu_iter_t iter;
+  const byte *nalu;
+  uint32_t size;
+  bool slice = false;
+
+  flv_nalu_iter_init(&iter, video->data, video->size, length_size);
+  while (flv_nalu_next(&iter, &nalu, &size)) {
+    if (size == 0) continue;
+    if (hevc) {
+      uint8_t type = flv_hevc_nalu_type(nalu);
+      if (type > 31) continue;
+      if (type > 14 || type % 2) return false;
+    } else {
+      uint8_t type = nalu[0] & 0x1f;
+      if (type < 1 || type > 5) continue;
+      if (nalu[0] & 0x60) return false;
+    }
+    slice = true;
+  }
+  return slice;
+}
+
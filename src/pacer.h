@@ -0,0 +1,43 @@
+#ifndef PACER_H
+#define PACER_H
+
+#include "flv.h"
+
+/*
+ * send side pacing for replay: a token bucket smooths keyframe bursts (per 64 KB chunk with
+ * sendfile/zerocopy), and a drop policy keeps the socket send queue, and with it the latency, bounded:
+ *
+ *   queued >= threshold:     drop disposable and non-reference frames (AVC nal_ref_idc 0, HEVC sub-layer non-reference)
+ *   queued >= 2 * threshold: drop everything up to the next keyframe sent below threshold
+ */
+
+enum pacer_verdicts { PACER_SEND, PACER_DROP };
+
+typedef struct {
+  double rate; // bytes/s, 0: no pacing
+  double burst; // bucket size, bytes
+  double tokens;
+  double last;
+  uint32_t threshold; // queued bytes, 0: never drop
+  uint32_t critical;
+  uint8_t length_size;
+  bool skipping; // waiting for a keyframe
+  // stats
+  uint64_t sent;
+  uint64_t dropped_disposable;
+  uint64_t dropped_skip;
+  uint64_t skips;
+  uint64_t max_queued;
+  uint32_t max_message;
+  double waited; // seconds spent waiting for tokens
+} pacer_t;
+
+// @param[in] rate: bits/s, burst: bytes (0: 100 ms of rate), threshold: queued bytes
+void pacer_init(pacer_t *, uint64_t, uint32_t, uint32_t);
+// @param[in] queued: bytes in the socket send queue, -1 if unknown
+int pacer_admit(pacer_t *, const flv_tag_t *, int64_t);
+void pacer_wait(pacer_t *, uint32_t);
+// @return ms the queue can hold at rate (bytes/s) under the drop policy, 0 without one
+double pacer_latency_bound(pacer_t *, double);
+
+#endif
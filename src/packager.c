@@ -0,0 +1,133 @@
+#include "flv.h"
+#include "fmp4.h"
+#include "log.h"
+#include "metrics.h"
+#include <librtmp/log.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static flv_reader_t *reader = NULL;
+static fmp4_t *fmp4 = NULL;
+static uint64_t skipped_video = 0; // tags of a codec without a sample entry here
+
+int package_tag(flv_tag_t *);
+void die(char *);
+
+void usage(char *program_name) {
+  printf("Usage: %s [-v] [-m metrics] [-p part_ms] [-s segment_ms] [-o outdir] infile\n", program_name);
+  printf("  live: dump -o - rtmp://host/live/1 | %s -o live -\n", program_name);
+  exit(-1);
+}
+
+int main(int argc, char *argv[]) {
+  RTMP_LogSetLevel(RTMP_LOGINFO);
+
+  char *prog = argv[0];
+  char *outdir = "cmaf";
+  uint32_t part_ms = 200;
+  uint32_t segment_ms = 2000;
+  int c;
+  while ((c = getopt(argc, argv, "vm:p:s:o:")) != -1) {
+    switch (c) {
+    case 'v':
+      RTMP_LogSetLevel(RTMP_LOGDEBUG);
+      break;
+    case 'm':
+      metrics_init("packager", optarg, 1000);
+      break;
+    case 'p':
+      part_ms = atoi(optarg);
+      break;
+    case 's':
+      segment_ms = atoi(optarg);
+      break;
+    case 'o':
+      outdir = optarg;
+      break;
+    default:
+      usage(prog);
+      break;
+    }
+  }
+  if (optind >= argc || part_ms == 0) usage(prog);
+
+  if (!(reader = flv_open(argv[optind]))) {
+    RTMP_Log(RTMP_LOGERROR, "open %s FAILED", argv[optind]);
+    usage(prog);
+  }
+  // a pipe reuses its buffer for every tag, the payloads have to be copied until their part is written
+  if (!(fmp4 = fmp4_open(outdir, part_ms, segment_ms, reader->map == NULL))) die("create output directory FAILED");
+  fmp4_expect(fmp4, FMP4_TRACK_VIDEO, reader->header.type_flags & (1 << 0));
+  fmp4_expect(fmp4, FMP4_TRACK_AUDIO, reader->header.type_flags & (1 << 2));
+
+  double begin = flv_now();
+  flv_tag_t tag;
+  int ret;
+  while (true) {
+    METRIC_BEGIN(parse);
+    if ((ret = flv_read_tag(reader, &tag)) <= 0) break;
+    METRIC_END(parse, METRIC_PARSE, FLV_TAG_HEADER_SIZE + tag.data_size + FLV_PREV_TAG_SIZE);
+
+    METRIC_BEGIN(write);
+    if (0 != package_tag(&tag)) die(fmp4->error);
+    METRIC_END(write, METRIC_WRITE, tag.data_size);
+  }
+  if (ret < 0) LOG(RTMP_LOGWARNING, "stop at damaged tag: %s", reader->error);
+  if (skipped_video) RTMP_Log(RTMP_LOGWARNING, "%lu video tags skipped, only AVC video is packaged", (unsigned long) skipped_video);
+
+  if (0 != fmp4_flush(fmp4)) die(fmp4->error);
+  double elapsed = flv_now() - begin;
+
+  RTMP_Log(RTMP_LOGINFO, "packager: %lu samples (%lu dropped), %lu parts in %u segments, %.2f MB in %.3f ms, %.1f MB/s, %lu writev", (unsigned long) fmp4->samples_total, (unsigned long) fmp4->dropped,
+           (unsigned long) fmp4->parts, fmp4->segment, fmp4->bytes / 1024.0 / 1024, elapsed * 1000, elapsed > 0 ? fmp4->bytes / elapsed / 1024 / 1024 : 0, (unsigned long) fmp4->writev_calls);
+
+  fmp4_close(fmp4);
+  flv_close(reader);
+  metrics_stop();
+  return 0;
+}
+
+/*
+ * AVC and AAC only, sequence headers go into the init segment
+ */
+int package_tag(flv_tag_t *tag) {
+  if (TAGTYPE_VIDEODATA == tag->tag_type) {
+    flv_video_t video;
+    if (0 != flv_parse_video(tag, &video)) return 0;
+    // no hvc1 / av01 sample entry yet, the output would silently be audio only
+    if (FLV_CODEC_ID_AVC != video.codec_id) {
+      fmp4_expect(fmp4, FMP4_TRACK_VIDEO, false);
+      if (skipped_video++ == 0) RTMP_Log(RTMP_LOGWARNING, "%s video can't be packaged, skipped", video.codec_id <= FLV_CODEC_ID_AV1 && codec_ids[video.codec_id][0] ? codec_ids[video.codec_id] : "unknown");
+      return 0;
+    }
+    if (AVC_SEQUENCE_HEADER == video.avc_packet_type) return fmp4_set_avc_config(fmp4, video.data, video.size);
+    if (AVC_NALU != video.avc_packet_type) return 0;
+
+    LOG(RTMP_LOGDEBUG, "video, t: %u, cto: %d, %u bytes%s", tag->timestamp, video.composition_time, video.size, FLV_FRAME_KEYFRAME == video.frame_type ? ", keyframe" : "");
+    // AVCC length prefixed NALUs are the mp4 sample format already
+    return fmp4_write_sample(fmp4, FMP4_TRACK_VIDEO, tag->timestamp, video.composition_time, FLV_FRAME_KEYFRAME == video.frame_type, video.data, video.size);
+  }
+
+  if (TAGTYPE_AUDIODATA == tag->tag_type) {
+    flv_audio_t audio;
+    if (0 != flv_parse_audio(tag, &audio)) return 0;
+    if (FLV_SOUND_FORMAT_AAC != audio.sound_format) {
+      fmp4_expect(fmp4, FMP4_TRACK_AUDIO, false);
+      return 0;
+    }
+    if (AAC_SEQUENCE_HEADER == audio.aac_packet_type) return fmp4_set_aac_config(fmp4, audio.data, audio.size);
+
+    LOG(RTMP_LOGDEBUG, "audio, t: %u, %u bytes", tag->timestamp, audio.size);
+    return fmp4_write_sample(fmp4, FMP4_TRACK_AUDIO, tag->timestamp, 0, true, audio.data, audio.size);
+  }
+
+  return 0;
+}
+
+void die(char *message) {
+  RTMP_Log(RTMP_LOGERROR, "error: %s", message);
+  exit(-1);
+}
+
@@ -1,115 +1,49 @@
+#include "columns.h"
+#include "flv.h"
+#include "log.h"
+#include "metrics.h"
 #include <assert.h>
 #include <librtmp/log.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
-typedef unsigned char byte;
-
-#define FLV_CODEC_ID_AVC (7)
-#define AVC_SEQUENCE_HEADER (0)
-#define AVC_NALU (1)
-
-enum tag_types { TAGTYPE_AUDIODATA = 8, TAGTYPE_VIDEODATA = 9, TAGTYPE_SCRIPTDATAOBJECT = 18 };
-const char *flv_tag_types[] = {"", "", "", "", "", "", "", "", "audio", "video", "", "", "", "", "", "", "", "", "script data"};
-const char *frame_types[] = {"not defined by standard",
-                             "keyframe (for AVC, a seekable frame)",
-                             "inter frame (for AVC, a non-seekable frame)",
-                             "disposable inter frame (H.263 only)",
-                             "generated keyframe (reserved for server use only)",
-                             "video info/command frame"};
-
-const char *codec_ids[] = {"not defined by standard", "JPEG (currently unused)", "Sorenson H.263", "Screen video", "On2 VP6", "On2 VP6 with alpha channel", "Screen video version 2", "AVC"};
-
-const char *avc_packet_types[] = {"AVC sequence header", "AVC NALU", "AVC end of sequence (lower level NALU sequence ender is not required or supported)"};
-
-typedef struct flv_header {
-  uint8_t signature[3];
-  uint8_t version;
-  uint8_t type_flags;
-  uint32_t data_offset;
-} __attribute__((__packed__)) __;
-
-typedef struct flv_header flv_header_t;
-
-typedef struct {
-  struct flv_tag *next;
-  size_t offset; // 文件偏移量
-
-  uint8_t tag_type;
-  uint32_t data_size;
-  uint32_t timestamp;
-  uint8_t timestamp_ext;
-  uint32_t stream_id;
-  void *data;
-} flv_tag_t;
-
-typedef struct {
-  void *data;
-} data_tag_t;
-
-typedef struct {
-  uint8_t frame_type;
-  uint8_t codec_id;
-  void *data;
-} video_tag_t;
-
-typedef struct {
-  uint8_t avc_packet_type; // 0x00 - AVC sequence header, 0x01 - AVC NALU
-  uint32_t composition_time;
-  void *data;
-} avc_video_packet_t;
-
-typedef struct {
-  uint8_t configurationVersion;
-  uint8_t AVCProfileIndication;
-  uint8_t profile_compatibility;
-  uint8_t AVCLevelIndication;
-  uint8_t lengthSizeMinusOne;
-  uint8_t numOfSequenceParameterSets;
-  uint16_t sequenceParameterSetLength;
-  uint8_t numOfPictureParameterSets;
-  uint16_t pictureParameterSetLength;
-  void *pps;
-  void *sps;
-} avc_decoder_configuration_record_t;
-
-typedef struct {
-  uint32_t size; // tag->data_size - 9
-  void *data; // nalu(s): nalu1-len nalu1 data nalu2-len nalu2 ... naluN-len naluN
-} avc_nalus_t;
-
-static FILE *infile = NULL;
-static flv_header_t flv_header;
-static flv_tag_t *flv_tag_list_head;
-static flv_tag_t *flv_tag_list_current;
-static uint32_t flv_tag_list_size;
+static flv_reader_t *reader = NULL;
+static flv_index_t flv_index;
+static FILE *h264_file = NULL;
+static uint8_t length_size = 4; // of the last AVC / HEVC sequence header
+static FILE *aac_file = NULL;
+static flv_adts_t adts;
+static bool adts_ready = false;
+static size_t aac_frames = 0;
+static const char *video_packet_types[] = {"sequence header", "coded frames", "end of sequence"};
+static columns_t columns;
+static char *columns_file = NULL;
 
 void die(char *);
-void generate_h264_file();
+void write_annexb_frame(flv_tag_t *);
+void write_adts_frame(flv_tag_t *);
 
-void flv_read_header();
-flv_tag_t *flv_read_tag();
-video_tag_t *read_video_tag(flv_tag_t *flv_tag);
-data_tag_t *read_data_tag(flv_tag_t *);
+void print_header();
+void print_tag(flv_tag_t *);
+void print_video_tag(flv_tag_t *);
+void print_hevc_packet(const flv_video_t *);
+void print_av1_packet(const flv_video_t *);
+void print_audio_tag(flv_tag_t *);
 
-void push_tag(flv_tag_t *);
 size_t get_tag_count();
 size_t get_video_tag_count();
 
-size_t fread_UI8(uint8_t *, FILE *file);
-size_t fread_UI16(uint16_t *, FILE *file);
-size_t fread_UI24(uint32_t *, FILE *file);
-size_t fread_UI32(uint32_t *, FILE *file);
-uint8_t flv_get_bits(uint8_t, uint8_t, uint8_t);
-
-void print_tag(flv_tag_t *);
 void release();
 
 void usage(char *program_name) {
-  printf("Usage: %s [-v] infile\n", program_name);
+  printf("Usage: %s [-v] [-m metrics] [-j threads] [-o out.h264|out.h265] [-a out.aac] [-c out.flvc] infile\n", program_name);
+  printf("  -j: build the tag index on threads (0: all cores), regular files only\n");
+  printf("  -o: the AVC or HEVC stream as Annex-B\n");
+  printf("  -c: per tag metadata as columns, see query\n");
   exit(-1);
 }
 
@@ -117,9 +51,25 @@ int main(int argc, char *argv[]) {
   RTMP_LogSetLevel(RTMP_LOGINFO);
 
   char *prog = argv[0];
+  int jobs = -1;
   int c;
-  while ((c = getopt(argc, argv, "vV")) != -1) {
+  while ((c = getopt(argc, argv, "vVm:j:o:a:c:")) != -1) {
     switch (c) {
+    case 'a':
+      if (!(aac_file = 0 == strcmp(optarg, "-") ? stdout : fopen(optarg, "wb"))) die("open aac file FAILED");
+      break;
+    case 'c':
+      columns_file = optarg;
+      break;
+    case 'm':
+      metrics_init("parser", optarg, 1000);
+      break;
+    case 'j':
+      jobs = atoi(optarg);
+      break;
+    case 'o':
+      if (!(h264_file = fopen(optarg, "wb"))) die("open h264 file FAILED");
+      break;
     case 'v':
       RTMP_LogSetLevel(RTMP_LOGDEBUG);
       break;
@@ -132,369 +82,342 @@ int main(int argc, char *argv[]) {
     }
   }
 
-  infile = fopen(argv[optind], "r");
-  if (!infile) {
+  if (optind >= argc) usage(prog);
+  reader = flv_open(argv[optind]);
+  if (!reader) {
     usage(argv[0]);
   }
 
-  flv_read_header();
-  flv_tag_t *tag;
-
-  while ((tag = flv_read_tag()) != NULL) {
-    push_tag(tag);
-    print_tag(tag);
-    if (feof(infile)) break;
+  columns_init(&columns);
+  print_header();
+  flv_tag_t tag;
+  int ret;
+
+  struct timespec begin, end;
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+  if (jobs >= 0 && reader->map) {
+    // index first, the per tag logs and ADTS go over it afterwards
+    ret = flv_index_build_parallel(reader, &flv_index, jobs);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    for (size_t n = 0; n < flv_index.count && (h264_file || aac_file || columns_file || LOG_ENABLED(RTMP_LOGDEBUG)); ++n) {
+      if (flv_read_tag_at(reader, flv_index.entries[n].offset, &tag) <= 0) die(reader->error);
+      if (columns_file && 0 != columns_add(&columns, &tag)) die(columns.error);
+      print_tag(&tag);
+      if (h264_file && TAGTYPE_VIDEODATA == tag.tag_type) write_annexb_frame(&tag);
+      if (aac_file && TAGTYPE_AUDIODATA == tag.tag_type) write_adts_frame(&tag);
+    }
+  } else {
+    while (true) {
+      METRIC_BEGIN(parse);
+      if ((ret = flv_read_tag(reader, &tag)) <= 0) break;
+      if (0 != flv_index_add(&flv_index, &tag)) die("out of memory building the tag index");
+      METRIC_END(parse, METRIC_PARSE, FLV_TAG_HEADER_SIZE + tag.data_size + FLV_PREV_TAG_SIZE);
+      if (columns_file && 0 != columns_add(&columns, &tag)) die(columns.error);
+      print_tag(&tag);
+      // Annex-B and ADTS while reading: works on a pipe, no index needed
+      if (h264_file && TAGTYPE_VIDEODATA == tag.tag_type) write_annexb_frame(&tag);
+      if (aac_file && TAGTYPE_AUDIODATA == tag.tag_type) write_adts_frame(&tag);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
   }
+  if (ret < 0) LOG(RTMP_LOGWARNING, "stop at damaged tag: %s", reader->error);
+
+  double elapsed = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+  LOG(RTMP_LOGINFO, "parse: %lu tags in %.3f ms, %.0f tags/s", get_tag_count(), elapsed * 1000, elapsed > 0 ? get_tag_count() / elapsed : 0);
 
   printf("flv tag count: %lu\n", get_tag_count());
   printf("flv video tag count: %lu\n", get_video_tag_count());
 
   // video tags
   int i = 0;
-  flv_tag_t *current = flv_tag_list_head;
-  if (current != NULL) {
-    do {
-      if (TAGTYPE_SCRIPTDATAOBJECT == current->tag_type) {
-        byte *amf_buffer = ((data_tag_t *) current->data)->data;
-        size_t amf_len = current->data_size;
-
-        RTMP_Log(RTMP_LOGINFO, "%s, t: %d, offset: 0x%08lx, data size: %d", flv_tag_types[current->tag_type], current->timestamp, current->offset, current->data_size);
-        RTMP_LogHexString(RTMP_LOGINFO, amf_buffer, amf_len);
-
-      } else if (TAGTYPE_VIDEODATA == current->tag_type) {
-        ++i;
-        RTMP_Log(RTMP_LOGDEBUG, "%s, t: %d, offset: 0x%08lx, data size: %d", flv_tag_types[current->tag_type], current->timestamp, current->offset, current->data_size);
-      }
-    } while ((current = (flv_tag_t *) current->next) != NULL && i < 5);
+  for (size_t n = 0; n < flv_index.count && i < 5; ++n) {
+    flv_index_entry_t *current = &flv_index.entries[n];
+    if (TAGTYPE_SCRIPTDATAOBJECT == current->tag_type) {
+      LOG(RTMP_LOGINFO, "%s, t: %d, offset: 0x%08llx, data size: %d", flv_tag_types[current->tag_type], current->timestamp, (unsigned long long) current->offset, current->data_size);
+      // not available when reading from a pipe
+      if (flv_read_tag_at(reader, current->offset, &tag) > 0) LOG_HEX_STRING(RTMP_LOGINFO, tag.data, tag.data_size);
+
+    } else if (TAGTYPE_VIDEODATA == current->tag_type) {
+      ++i;
+      LOG(RTMP_LOGDEBUG, "%s, t: %d, offset: 0x%08llx, data size: %d", flv_tag_types[current->tag_type], current->timestamp, (unsigned long long) current->offset, current->data_size);
+    }
   }
 
-  // mv video tag to h264 file
-  // generate_h264_file();
+  if (h264_file) fclose(h264_file);
+  if (columns_file) {
+    if (0 != columns_write(&columns, columns_file)) die("write columns FAILED");
+    LOG(RTMP_LOGINFO, "columns: %zu tags to %s", columns.count, columns_file);
+  }
+  if (aac_file) {
+    LOG(RTMP_LOGINFO, "aac: %lu ADTS frames", aac_frames);
+    if (aac_file != stdout) fclose(aac_file);
+  }
 
-  RTMP_Log(RTMP_LOGDEBUG, "the end.");
+  LOG(RTMP_LOGDEBUG, "the end.");
   release();
+  metrics_stop();
 
   return 0;
 }
 
-void generate_h264_file() {
-  // open outfile
-  FILE *outfile = fopen("out.h264", "wb");
+/*
+ * AVC / HEVC tag to Annex-B: parameter sets from the sequence header in record order,
+ * then every length prefixed NALU with a start code
+ */
+void write_annexb_frame(flv_tag_t *tag) {
   static const byte startcode[] = {0x00, 0x00, 0x00, 0x01};
-
-  // write pps/sps
-  flv_tag_t *current = flv_tag_list_head;
-  assert(current);
-
-  do {
-    if (TAGTYPE_VIDEODATA == current->tag_type) {
-      video_tag_t *video_tag = (video_tag_t *) current->data;
-      avc_video_packet_t *packet = (avc_video_packet_t *) video_tag->data;
-      if (AVC_SEQUENCE_HEADER == packet->avc_packet_type) {
-        avc_decoder_configuration_record_t *record = (avc_decoder_configuration_record_t *) packet->data;
-
-        RTMP_LogHex(RTMP_LOGINFO, record->sps, record->sequenceParameterSetLength);
-        fwrite(&startcode, sizeof(startcode), 1, outfile);
-        fwrite(record->sps, record->sequenceParameterSetLength, 1, outfile);
-
-        RTMP_LogHex(RTMP_LOGINFO, record->pps, record->pictureParameterSetLength);
-        fwrite(&startcode, sizeof(startcode), 1, outfile);
-        fwrite(record->pps, record->pictureParameterSetLength, 1, outfile);
-      } else if (AVC_NALU == packet->avc_packet_type) {
-        avc_nalus_t *nalus = (avc_nalus_t *) packet->data;
-
-        // AVCC to AnnexB
-        uint32_t offset = 0;
-        uint32_t nalu_len = 0;
-        while (offset < (nalus->size - 4)) {
-          memcpy(&nalu_len, nalus->data + offset, 4);
-          nalu_len = ntohl(nalu_len);
-          printf(".");
-          fwrite(&startcode, sizeof(startcode), 1, outfile);
-          fwrite(nalus->data + offset + 4, nalu_len, 1, outfile);
-
-          offset += nalu_len + 4;
-        }
-      }
+  flv_video_t video;
+  if (0 != flv_parse_video(tag, &video)) return;
+  if (FLV_CODEC_ID_AV1 == video.codec_id && AVC_SEQUENCE_HEADER == video.avc_packet_type) LOG(RTMP_LOGWARNING, "AV1 has no Annex-B, skipped");
+  if (video.codec_id != FLV_CODEC_ID_AVC && video.codec_id != FLV_CODEC_ID_HEVC) return;
+
+  if (AVC_SEQUENCE_HEADER == video.avc_packet_type && FLV_CODEC_ID_HEVC == video.codec_id) {
+    // write vps/sps/pps (and SEI) in record order
+    flv_hevc_config_t hevc;
+    if (0 != flv_parse_hevc_config(video.data, video.size, &hevc)) die("bad HEVCDecoderConfigurationRecord");
+    length_size = hevc.length_size;
+    for (int i = 0; i < hevc.nalu_count; ++i) {
+      LOG_HEX(RTMP_LOGINFO, hevc.nalus[i], hevc.nalu_sizes[i]);
+      fwrite(&startcode, sizeof(startcode), 1, h264_file);
+      fwrite(hevc.nalus[i], hevc.nalu_sizes[i], 1, h264_file);
+    }
+  } else if (AVC_SEQUENCE_HEADER == video.avc_packet_type) {
+    // write sps/pps
+    flv_avc_config_t config;
+    if (0 != flv_parse_avc_config(video.data, video.size, &config)) die("bad AVCDecoderConfigurationRecord");
+    length_size = config.length_size;
+    for (int i = 0; i < config.sps_count; ++i) {
+      LOG_HEX(RTMP_LOGINFO, config.sps[i], config.sps_size[i]);
+      fwrite(&startcode, sizeof(startcode), 1, h264_file);
+      fwrite(config.sps[i], config.sps_size[i], 1, h264_file);
+    }
+    for (int i = 0; i < config.pps_count; ++i) {
+      LOG_HEX(RTMP_LOGINFO, config.pps[i], config.pps_size[i]);
+      fwrite(&startcode, sizeof(startcode), 1, h264_file);
+      fwrite(config.pps[i], config.pps_size[i], 1, h264_file);
     }
-  } while ((current = (flv_tag_t *) current->next) != NULL);
-  printf("\n");
+  } else if (AVC_NALU == video.avc_packet_type) {
+    // AVCC / HVCC to AnnexB
+    flv_nalu_iter_t iter;
+    const byte *nalu;
+    uint32_t nalu_len;
+    flv_nalu_iter_init(&iter, video.data, video.size, length_size);
+    while (flv_nalu_next(&iter, &nalu, &nalu_len)) {
+      METRIC_BEGIN(write);
+      fwrite(&startcode, sizeof(startcode), 1, h264_file);
+      fwrite(nalu, nalu_len, 1, h264_file);
+      METRIC_END(write, METRIC_WRITE, nalu_len + sizeof(startcode));
+    }
+  }
+}
 
-  fclose(outfile);
+/*
+ * raw AAC frame to ADTS: the 7 byte header comes from a template set up at the sequence header,
+ * only aac_frame_length changes per frame
+ */
+void write_adts_frame(flv_tag_t *tag) {
+  flv_audio_t audio;
+  if (0 != flv_parse_audio(tag, &audio) || FLV_SOUND_FORMAT_AAC != audio.sound_format) return;
+
+  if (AAC_SEQUENCE_HEADER == audio.aac_packet_type) {
+    flv_aac_config_t config;
+    if (0 != flv_parse_aac_config(audio.data, audio.size, &config)) die("bad AudioSpecificConfig");
+    if (0 != flv_adts_init(&adts, &config)) die("AudioSpecificConfig can't be expressed in ADTS");
+    adts_ready = true;
+    return;
+  }
+  // frames before the first sequence header can't be decoded
+  if (!adts_ready || AAC_RAW != audio.aac_packet_type || audio.size == 0) return;
+
+  METRIC_BEGIN(write);
+  fwrite(flv_adts_header(&adts, audio.size), sizeof(adts.header), 1, aac_file);
+  fwrite(audio.data, audio.size, 1, aac_file);
+  METRIC_END(write, METRIC_WRITE, audio.size + sizeof(adts.header));
+  ++aac_frames;
 }
 
 void die(char *message) {
-  RTMP_Log(RTMP_LOGERROR, "error: %s", message);
+  LOG(RTMP_LOGERROR, "error: %s", message);
   exit(-1);
 }
 
 void release() {
   // release file
-  fclose(infile);
-  // TODO: release tag list and data
+  flv_close(reader);
+  flv_index_free(&flv_index);
+  columns_free(&columns);
 }
 
-void flv_read_header() {
-  fread(&flv_header, sizeof(flv_header_t), 1, infile);
-  flv_header.data_offset = ntohl(flv_header.data_offset);
-  RTMP_Log(RTMP_LOGDEBUG, "FLV file version: %u", flv_header.version);
-  RTMP_Log(RTMP_LOGDEBUG, "  Contains audio tags: %s", flv_header.type_flags & (1 << 0) ? "Yes" : "No");
-  RTMP_Log(RTMP_LOGDEBUG, "  Contains video tags: %s", flv_header.type_flags & (1 << 2) ? "Yes" : "No");
-  RTMP_Log(RTMP_LOGDEBUG, "  Data offset: %d", flv_header.data_offset);
+void print_header() {
+  LOG(RTMP_LOGDEBUG, "FLV file version: %u", reader->header.version);
+  LOG(RTMP_LOGDEBUG, "  Contains audio tags: %s", reader->header.type_flags & (1 << 2) ? "Yes" : "No");
+  LOG(RTMP_LOGDEBUG, "  Contains video tags: %s", reader->header.type_flags & (1 << 0) ? "Yes" : "No");
+  LOG(RTMP_LOGDEBUG, "  Data offset: %d", reader->header.data_offset);
 }
 
-flv_tag_t *flv_read_tag() {
-  // flv header size
-  static size_t offset = 9;
-
-  static uint32_t i = 0;
-  RTMP_Log(RTMP_LOGDEBUG2, "---------------------- flv_read_tag.begin: %d", ++i);
-
-  size_t count = 0;
-  uint32_t prev_tag_size = 0;
-  flv_tag_t *tag = NULL;
-
-  tag = malloc(sizeof(flv_tag_t));
-
-  if (4 != fread_UI32(&prev_tag_size, infile)) return NULL;
-
-  if (1 != fread_UI8(&(tag->tag_type), infile)) return NULL;
-  if (3 != fread_UI24(&(tag->data_size), infile)) return NULL;
-  if (3 != fread_UI24(&(tag->timestamp), infile)) return NULL;
-  if (1 != fread_UI8(&(tag->timestamp_ext), infile)) return NULL;
-  if (3 != fread_UI24(&(tag->stream_id), infile)) return NULL;
-
-  RTMP_Log(RTMP_LOGDEBUG, "Tag type: %u - %s", tag->tag_type, flv_tag_types[tag->tag_type]);
-  RTMP_Log(RTMP_LOGDEBUG, "  Data size: %d", tag->data_size);
-  RTMP_Log(RTMP_LOGDEBUG, "  Timestamp: %d", tag->timestamp);
-  RTMP_Log(RTMP_LOGDEBUG, "  Timestamp etxended: %d", tag->timestamp_ext);
-  RTMP_Log(RTMP_LOGDEBUG, "  StreamID: %d", tag->stream_id);
-
-  tag->offset = offset + 4;
-  offset += 15 + tag->data_size;
+void print_tag(flv_tag_t *tag) {
+  LOG(RTMP_LOGDEBUG, "Tag type: %u - %s", tag->tag_type, flv_tag_types[tag->tag_type]);
+  LOG(RTMP_LOGDEBUG, "  Data size: %d", tag->data_size);
+  LOG(RTMP_LOGDEBUG, "  Timestamp: %u", tag->timestamp);
+  LOG(RTMP_LOGDEBUG, "  StreamID: %d", tag->stream_id);
 
   switch (tag->tag_type) {
   case TAGTYPE_SCRIPTDATAOBJECT:
-    tag->data = (void *) read_data_tag(tag);
-    break;
-
-  case TAGTYPE_AUDIODATA:
-    tag->data = malloc((size_t) tag->data_size);
-    if (tag->data_size != fread(tag->data, 1, (size_t) tag->data_size, infile)) {
-      return NULL;
-    }
+    // TODO: READ AMF0
+    LOG_HEX_STRING(RTMP_LOGDEBUG2, tag->data, tag->data_size);
     break;
-
   case TAGTYPE_VIDEODATA:
-    tag->data = (void *) read_video_tag(tag);
+    print_video_tag(tag);
     break;
-  default:
-    die("unknown tag type");
+  case TAGTYPE_AUDIODATA:
+    print_audio_tag(tag);
     break;
   }
-
-  return tag;
 }
 
-data_tag_t *read_data_tag(flv_tag_t *flv_tag) {
-  // TODO: READ AMF0
+void print_video_tag(flv_tag_t *tag) {
+  if (!LOG_ENABLED(RTMP_LOGDEBUG)) return;
 
-  data_tag_t *tag = NULL;
-  tag = malloc(sizeof(data_tag_t));
-
-  tag->data = malloc((size_t) flv_tag->data_size);
-  if (flv_tag->data_size != fread(tag->data, 1, (size_t) flv_tag->data_size, infile)) {
-    return NULL;
+  flv_video_t video;
+  if (0 != flv_parse_video(tag, &video)) {
+    LOG(RTMP_LOGWARNING, "bad video tag at 0x%08llx", (unsigned long long) tag->offset);
+    return;
   }
 
-  RTMP_LogHexString(RTMP_LOGDEBUG2, tag->data, flv_tag->data_size);
-
-  return tag;
-}
-
-video_tag_t *read_video_tag(flv_tag_t *flv_tag) {
-  video_tag_t *tag = NULL;
-  uint8_t head = 0;
-
-  tag = malloc(sizeof(video_tag_t));
-
-  if (1 != fread_UI8(&head, infile)) return NULL;
-
-  tag->frame_type = flv_get_bits(head, 4, 4);
-  tag->codec_id = flv_get_bits(head, 0, 4);
-
-  RTMP_Log(RTMP_LOGDEBUG, "  Video tag:");
-  RTMP_Log(RTMP_LOGDEBUG, "    Frame type: %u - %s", tag->frame_type, frame_types[tag->frame_type]);
-  RTMP_Log(RTMP_LOGDEBUG, "    Codec ID: %u - %s", tag->codec_id, codec_ids[tag->codec_id]);
-
-  if (tag->codec_id != FLV_CODEC_ID_AVC) {
-    tag->data = malloc((size_t) flv_tag->data_size - 1);
-    fread(tag->data, 1, (size_t) flv_tag->data_size - 1, infile);
-    return tag;
+  LOG(RTMP_LOGDEBUG, "  Video tag:");
+  LOG(RTMP_LOGDEBUG, "    Frame type: %u - %s", video.frame_type, video.frame_type <= FLV_FRAME_INFO ? frame_types[video.frame_type] : "");
+  LOG(RTMP_LOGDEBUG, "    Codec ID: %u - %s", video.codec_id, video.codec_id <= FLV_CODEC_ID_AV1 ? codec_ids[video.codec_id] : "");
+  if (video.enhanced) {
+    char fourcc[5] = {video.fourcc >> 24, video.fourcc >> 16, video.fourcc >> 8, video.fourcc, 0};
+    LOG(RTMP_LOGDEBUG, "    Enhanced RTMP: packet type %u, FourCC %s", video.packet_type, video.fourcc ? fourcc : "-");
   }
+  if (video.codec_id == FLV_CODEC_ID_HEVC) {
+    print_hevc_packet(&video);
+    return;
+  }
+  if (video.codec_id == FLV_CODEC_ID_AV1) {
+    print_av1_packet(&video);
+    return;
+  }
+  if (video.codec_id != FLV_CODEC_ID_AVC) return;
 
-  // AVC: h.264 nalu
-  avc_video_packet_t *packet = NULL;
-  packet = malloc(sizeof(avc_video_packet_t));
-  if (1 != fread_UI8(&(packet->avc_packet_type), infile)) return NULL;
-  if (3 != fread_UI24(&(packet->composition_time), infile)) return NULL;
-
-  RTMP_Log(RTMP_LOGDEBUG, "    AVC video packet:");
-  RTMP_Log(RTMP_LOGDEBUG, "      AVC packet type: %u - %s", packet->avc_packet_type, avc_packet_types[packet->avc_packet_type]);
-  RTMP_Log(RTMP_LOGDEBUG, "      AVC composition time: %i", packet->composition_time);
-
-  if (AVC_SEQUENCE_HEADER == packet->avc_packet_type) {
-    // AVCDecoderConfigurationRecord支持多组SPS/PPS
-    // 这里只考虑了一组的情况
-    // len: 30
-    // packet->data = malloc((size_t) flv_tag->data_size - 5);
-    // fread(packet->data, 1, (size_t) flv_tag->data_size - 5, infile);
+  LOG(RTMP_LOGDEBUG, "    AVC video packet:");
+  LOG(RTMP_LOGDEBUG, "      AVC packet type: %u - %s", video.avc_packet_type, video.avc_packet_type <= AVC_END_OF_SEQUENCE ? avc_packet_types[video.avc_packet_type] : "");
+  LOG(RTMP_LOGDEBUG, "      AVC composition time: %i", video.composition_time);
 
-    avc_decoder_configuration_record_t *record = NULL;
-    record = malloc(sizeof(avc_decoder_configuration_record_t));
+  if (AVC_SEQUENCE_HEADER == video.avc_packet_type) {
+    flv_avc_config_t config;
+    if (0 != flv_parse_avc_config(video.data, video.size, &config)) return;
 
     // ISO_14496_15
-    RTMP_Log(RTMP_LOGDEBUG, "      AVCDecoderCOnfigurationRecord:");
-    if (1 != fread_UI8(&(record->configurationVersion), infile)) return NULL;
-    RTMP_Log(RTMP_LOGDEBUG, "        Configuration Version: %d", record->configurationVersion);
-
-    if (1 != fread_UI8(&(record->AVCProfileIndication), infile)) return NULL;
-    RTMP_Log(RTMP_LOGDEBUG, "        AVC Profile Indeication: %d", record->AVCProfileIndication);
-
-    if (1 != fread_UI8(&(record->profile_compatibility), infile)) return NULL;
-    RTMP_Log(RTMP_LOGDEBUG, "        Profile Compatibility: %d", record->profile_compatibility);
-
-    if (1 != fread_UI8(&(record->AVCLevelIndication), infile)) return NULL;
-    RTMP_Log(RTMP_LOGDEBUG, "        AVC Level Indication: %d", record->AVCLevelIndication);
-
-    if (1 != fread_UI8(&(record->lengthSizeMinusOne), infile)) return NULL;
-    record->lengthSizeMinusOne = record->lengthSizeMinusOne & 0x03; // & 0000 0011
-    RTMP_Log(RTMP_LOGDEBUG, "        Minus One: %d", record->lengthSizeMinusOne);
-
-    if (1 != fread_UI8(&(record->numOfSequenceParameterSets), infile)) return NULL;
-    record->numOfSequenceParameterSets = record->numOfSequenceParameterSets & 0x1f; // & 0001 1111
-    assert(1 == record->numOfSequenceParameterSets);
-    RTMP_Log(RTMP_LOGDEBUG, "        SPS num: %d", record->numOfSequenceParameterSets);
-
-    if (2 != fread_UI16(&(record->sequenceParameterSetLength), infile)) return NULL;
-    RTMP_Log(RTMP_LOGDEBUG, "        SPS length: %d", record->sequenceParameterSetLength);
-
-    record->sps = malloc(record->sequenceParameterSetLength);
-    if (record->sequenceParameterSetLength != fread(record->sps, 1, record->sequenceParameterSetLength, infile)) return NULL;
-    RTMP_LogHex(RTMP_LOGDEBUG, record->sps, record->sequenceParameterSetLength);
-
-    if (1 != fread_UI8(&(record->numOfPictureParameterSets), infile)) return NULL;
-    assert(1 == record->numOfPictureParameterSets);
-    RTMP_Log(RTMP_LOGDEBUG, "        PPS num: %d", record->numOfPictureParameterSets);
-
-    if (2 != fread_UI16(&(record->pictureParameterSetLength), infile)) return NULL;
-    RTMP_Log(RTMP_LOGDEBUG, "        PPS length: %d", record->pictureParameterSetLength);
-
-    record->pps = malloc(record->pictureParameterSetLength);
-    if (record->pictureParameterSetLength != fread(record->pps, 1, record->pictureParameterSetLength, infile)) return NULL;
-    RTMP_LogHex(RTMP_LOGDEBUG, record->pps, record->pictureParameterSetLength);
-
-    packet->data = record;
-  } else if (AVC_NALU == packet->avc_packet_type) {
-    avc_nalus_t *nalus = NULL;
-    nalus = malloc(sizeof(avc_nalus_t));
-    nalus->size = flv_tag->data_size - 5;
-    nalus->data = malloc((size_t) nalus->size);
-    fread(nalus->data, 1, (size_t) nalus->size, infile);
-    packet->data = nalus;
-  } else {
-    packet->data = malloc((size_t) flv_tag->data_size - 5);
-    fread(packet->data, 1, (size_t) flv_tag->data_size - 5, infile);
+    LOG(RTMP_LOGDEBUG, "      AVCDecoderCOnfigurationRecord:");
+    LOG(RTMP_LOGDEBUG, "        Configuration Version: %d", config.configuration_version);
+    LOG(RTMP_LOGDEBUG, "        AVC Profile Indeication: %d", config.profile);
+    LOG(RTMP_LOGDEBUG, "        Profile Compatibility: %d", config.profile_compatibility);
+    LOG(RTMP_LOGDEBUG, "        AVC Level Indication: %d", config.level);
+    LOG(RTMP_LOGDEBUG, "        Minus One: %d", config.length_size - 1);
+    LOG(RTMP_LOGDEBUG, "        SPS num: %d", config.sps_count);
+    for (int i = 0; i < config.sps_count; ++i) {
+      LOG(RTMP_LOGDEBUG, "        SPS length: %d", config.sps_size[i]);
+      LOG_HEX(RTMP_LOGDEBUG, config.sps[i], config.sps_size[i]);
+    }
+    LOG(RTMP_LOGDEBUG, "        PPS num: %d", config.pps_count);
+    for (int i = 0; i < config.pps_count; ++i) {
+      LOG(RTMP_LOGDEBUG, "        PPS length: %d", config.pps_size[i]);
+      LOG_HEX(RTMP_LOGDEBUG, config.pps[i], config.pps_size[i]);
+    }
   }
-
-  tag->data = packet;
-  return tag;
 }
 
-void push_tag(flv_tag_t *tag) {
-  if (flv_tag_list_head == NULL) {
-    flv_tag_list_head = tag;
-    flv_tag_list_current = tag;
+void print_hevc_packet(const flv_video_t *video) {
+  LOG(RTMP_LOGDEBUG, "    HEVC video packet:");
+  LOG(RTMP_LOGDEBUG, "      packet type: %u - %s", video->avc_packet_type, video->avc_packet_type <= AVC_END_OF_SEQUENCE ? video_packet_types[video->avc_packet_type] : "other");
+  LOG(RTMP_LOGDEBUG, "      composition time: %i", video->composition_time);
+  if (AVC_SEQUENCE_HEADER != video->avc_packet_type) return;
+
+  flv_hevc_config_t config;
+  if (0 != flv_parse_hevc_config(video->data, video->size, &config)) return;
+
+  // ISO_14496_15 8.3.3
+  LOG(RTMP_LOGDEBUG, "      HEVCDecoderConfigurationRecord:");
+  LOG(RTMP_LOGDEBUG, "        Configuration Version: %d", config.configuration_version);
+  LOG(RTMP_LOGDEBUG, "        Profile: space %d, tier %d, idc %d", config.profile_space, config.tier, config.profile_idc);
+  LOG(RTMP_LOGDEBUG, "        Level: %d", config.level_idc);
+  LOG(RTMP_LOGDEBUG, "        Chroma Format: %d, Bit Depth: %d / %d", config.chroma_format, config.bit_depth_luma, config.bit_depth_chroma);
+  LOG(RTMP_LOGDEBUG, "        Minus One: %d", config.length_size - 1);
+  for (int i = 0; i < config.nalu_count; ++i) {
+    LOG(RTMP_LOGDEBUG, "        NALU type %d, length: %d", config.nalu_types[i], config.nalu_sizes[i]);
+    LOG_HEX(RTMP_LOGDEBUG, config.nalus[i], config.nalu_sizes[i]);
   }
-
-  flv_tag_list_current->next = (struct flv_tag *) tag;
-  flv_tag_list_current = tag;
 }
 
-void print_tag(flv_tag_t *tag) {}
-
-/*
- * flv tag list operation
- */
-size_t get_tag_count() {
-  size_t size = 0;
-  flv_tag_t *current = flv_tag_list_head;
-  if (current != NULL) {
-    do {
-      ++size;
-    } while ((current = (flv_tag_t *) current->next) != NULL);
+void print_av1_packet(const flv_video_t *video) {
+  LOG(RTMP_LOGDEBUG, "    AV1 video packet:");
+  LOG(RTMP_LOGDEBUG, "      packet type: %u - %s", video->avc_packet_type, video->avc_packet_type <= AVC_END_OF_SEQUENCE ? video_packet_types[video->avc_packet_type] : "other");
+
+  const byte *obus = video->data;
+  uint32_t size = video->size;
+  if (AVC_SEQUENCE_HEADER == video->avc_packet_type) {
+    flv_av1_config_t config;
+    if (0 != flv_parse_av1_config(video->data, video->size, &config)) return;
+    LOG(RTMP_LOGDEBUG, "      AV1CodecConfigurationRecord:");
+    LOG(RTMP_LOGDEBUG, "        Version: %d", config.version);
+    LOG(RTMP_LOGDEBUG, "        Profile: %d, Level: %d, Tier: %d", config.profile, config.level, config.tier);
+    LOG(RTMP_LOGDEBUG, "        Bit Depth: %d, Monochrome: %d, Subsampling: %d %d", config.bit_depth, config.monochrome, config.chroma_subsampling_x, config.chroma_subsampling_y);
+    obus = config.config_obus;
+    size = config.config_obus_size;
+  } else if (AVC_NALU != video->avc_packet_type) {
+    return;
   }
-  return size;
-}
 
-size_t get_video_tag_count() {
-  size_t size = 0;
-  flv_tag_t *current = flv_tag_list_head;
-  if (current != NULL) {
-    do {
-      if (TAGTYPE_VIDEODATA == current->tag_type) ++size;
-    } while ((current = (flv_tag_t *) current->next) != NULL);
-  }
-  return size;
+  flv_obu_iter_t iter;
+  const byte *obu;
+  uint32_t obu_size;
+  uint8_t type;
+  flv_obu_iter_init(&iter, obus, size);
+  while (flv_obu_next(&iter, &obu, &obu_size, &type)) LOG(RTMP_LOGDEBUG, "        OBU type %d, size: %u", type, obu_size);
 }
 
-/*
- * convert from BE (FLV) to LE
- */
-size_t fread_UI8(uint8_t *ptr, FILE *file) {
-  assert(NULL != ptr);
-  return fread(ptr, 1, 1, file);
-}
+void print_audio_tag(flv_tag_t *tag) {
+  if (!LOG_ENABLED(RTMP_LOGDEBUG)) return;
 
-size_t fread_UI16(uint16_t *ptr, FILE *file) {
-  assert(NULL != ptr);
-  size_t count = 0;
-  uint8_t bytes[2] = {0};
-  *ptr = 0;
-  count = fread(bytes, 2, 1, file);
-  *ptr = (bytes[0] << 8) | bytes[1];
-  return count * 2;
-}
+  flv_audio_t audio;
+  if (0 != flv_parse_audio(tag, &audio)) {
+    LOG(RTMP_LOGWARNING, "bad audio tag at 0x%08llx", (unsigned long long) tag->offset);
+    return;
+  }
 
-size_t fread_UI24(uint32_t *ptr, FILE *file) {
-  assert(NULL != ptr);
-  size_t count = 0;
-  uint8_t bytes[3] = {0};
-  *ptr = 0;
-  count = fread(bytes, 3, 1, file);
-  *ptr = (bytes[0] << 16) | (bytes[1] << 8) | bytes[2];
-  return count * 3;
-}
+  static const char *sound_rates[] = {"5.5 kHz", "11 kHz", "22 kHz", "44 kHz"};
+  LOG(RTMP_LOGDEBUG, "  Audio tag:");
+  LOG(RTMP_LOGDEBUG, "    Sound format: %u - %s", audio.sound_format, sound_formats[audio.sound_format]);
+  LOG(RTMP_LOGDEBUG, "    Sound rate: %s, size: %s, type: %s", sound_rates[audio.sound_rate], audio.sound_size ? "16 bit" : "8 bit", audio.sound_type ? "stereo" : "mono");
+  if (audio.sound_format != FLV_SOUND_FORMAT_AAC) return;
+
+  LOG(RTMP_LOGDEBUG, "    AAC packet type: %u - %s", audio.aac_packet_type, audio.aac_packet_type <= AAC_RAW ? aac_packet_types[audio.aac_packet_type] : "");
+  if (AAC_SEQUENCE_HEADER == audio.aac_packet_type) {
+    flv_aac_config_t config;
+    if (0 != flv_parse_aac_config(audio.data, audio.size, &config)) {
+      LOG(RTMP_LOGWARNING, "bad AudioSpecificConfig at 0x%08llx", (unsigned long long) tag->offset);
+      return;
+    }
 
-size_t fread_UI32(uint32_t *ptr, FILE *file) {
-  assert(NULL != ptr);
-  size_t count = 0;
-  uint8_t bytes[4] = {0};
-  *ptr = 0;
-  count = fread(bytes, 4, 1, file);
-  *ptr = (bytes[0] << 24) | (bytes[1] << 16) | (bytes[2] << 8) | bytes[3];
-  return count * 4;
+    // ISO_14496_3
+    LOG(RTMP_LOGDEBUG, "      AudioSpecificConfig:");
+    LOG(RTMP_LOGDEBUG, "        Audio Object Type: %u", config.object_type);
+    LOG(RTMP_LOGDEBUG, "        Sampling Frequency: %u (index %u)", config.sample_rate, config.sample_rate_index);
+    LOG(RTMP_LOGDEBUG, "        Channel Configuration: %u", config.channels);
+  }
 }
 
 /*
- * @brief read bits from 1 byte
- * @param[in] value: 1 byte to analysize
- * @param[in] start_bit: start from the low bit side
- * @param[in] count: number of bits
+ * flv tag index operation
  */
-uint8_t flv_get_bits(uint8_t value, uint8_t start_bit, uint8_t count) {
-  uint8_t mask = 0;
+size_t get_tag_count() { return flv_index.count; }
 
-  mask = (uint8_t) (((1 << count) - 1) << start_bit);
-  return (mask & value) >> start_bit;
+size_t get_video_tag_count() {
+  size_t size = 0;
+  for (size_t n = 0; n < flv_index.count; ++n) {
+    if (TAGTYPE_VIDEODATA == flv_index.entries[n].tag_type) ++size;
+  }
+  return size;
 }
@@ -0,0 +1,319 @@
+#include "publish.h"
+#include "log.h"
+#include <errno.h>
+#include <librtmp/log.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/errqueue.h>
+#include <linux/sockios.h>
+#include <netinet/in.h>
+#include <sys/sendfile.h>
+#endif
+
+#ifndef MSG_MORE
+#define MSG_MORE (0)
+#endif
+
+// basic + message header + extended timestamp
+#define CHUNK_HEADER_MAX (1 + 11 + 4)
+
+const char *publish_modes[] = {"copy", "sendfile", "zerocopy"};
+
+static size_t chunk_header(byte *, const flv_tag_t *, uint32_t, bool);
+static int send_packet(publisher_t *, const flv_tag_t *);
+static int send_all(int, const byte *, size_t, int);
+static int send_chunk(publisher_t *, const byte *, size_t, uint64_t, uint32_t);
+static void reap(publisher_t *, bool);
+
+int publish_init(publisher_t *publisher, RTMP *rtmp, flv_reader_t *reader, publish_mode_t mode) {
+  memset(publisher, 0, sizeof(publisher_t));
+  publisher->rtmp = rtmp;
+  publisher->reader = reader;
+  publisher->mode = mode;
+  publisher->socket = RTMP_Socket(rtmp);
+  if (mode == PUBLISH_COPY) return 0;
+
+  if (reader->map == NULL) {
+    LOG(RTMP_LOGWARNING, "%s needs a regular file, publishing with copy", publish_modes[mode]);
+    publisher->mode = PUBLISH_COPY;
+    return 0;
+  }
+
+#if defined(__linux__) && defined(SO_ZEROCOPY)
+  int one = 1;
+  if (mode == PUBLISH_ZEROCOPY && 0 != setsockopt(publisher->socket, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one))) {
+    LOG(RTMP_LOGWARNING, "SO_ZEROCOPY FAILED (%s), publishing with sendfile", strerror(errno));
+    publisher->mode = PUBLISH_SENDFILE;
+  }
+#else
+  if (mode == PUBLISH_ZEROCOPY) {
+    LOG(RTMP_LOGWARNING, "MSG_ZEROCOPY is linux only, publishing with sendfile");
+    publisher->mode = PUBLISH_SENDFILE;
+  }
+#endif
+
+  // Set Chunk Size (protocol control message 1), librtmp has to frame with the same size from now on
+  RTMPPacket packet;
+  char body[RTMP_MAX_HEADER_SIZE + 4];
+  RTMPPacket_Reset(&packet);
+  packet.m_packetType = RTMP_PACKET_TYPE_CHUNK_SIZE;
+  packet.m_headerType = RTMP_PACKET_SIZE_LARGE;
+  packet.m_nChannel = 2;
+  packet.m_body = body + RTMP_MAX_HEADER_SIZE;
+  packet.m_nBodySize = 4;
+  AMF_EncodeInt32(packet.m_body, packet.m_body + 4, PUBLISH_CHUNK_SIZE);
+  if (!RTMP_SendPacket(rtmp, &packet, FALSE)) {
+    LOG(RTMP_LOGERROR, "send Set Chunk Size FAILED");
+    return -1;
+  }
+  rtmp->m_outChunkSize = PUBLISH_CHUNK_SIZE;
+  return 0;
+}
+
+int publish_mode(const char *name) {
+  for (int i = PUBLISH_COPY; i <= PUBLISH_ZEROCOPY; ++i) {
+    if (0 == strcmp(name, publish_modes[i])) return i;
+  }
+  return -1;
+}
+
+/*
+ * one tag as one RTMP message: a type 0 chunk header, then a type 3 header every PUBLISH_CHUNK_SIZE bytes.
+ * the payload never leaves the page cache / mapping, only the headers are built here.
+ */
+int publish_tag(publisher_t *publisher, const flv_tag_t *tag) {
+  // script data needs @setDataFrame, which RTMP_Write adds
+  if (publisher->mode == PUBLISH_COPY || TAGTYPE_SCRIPTDATAOBJECT == tag->tag_type) {
+    if (publisher->pacer) pacer_wait(publisher->pacer, FLV_TAG_HEADER_SIZE + tag->data_size);
+    // RTMP_Write takes the timestamp from the tag header, which is read-only in the mapping
+    if (tag->timestamp != (flv_ui24(tag->head + 4) | ((uint32_t) tag->head[7] << 24)) && TAGTYPE_SCRIPTDATAOBJECT != tag->tag_type) return send_packet(publisher, tag);
+    int count = RTMP_Write(publisher->rtmp, (const char *) tag->head, FLV_TAG_HEADER_SIZE + tag->data_size);
+    if (count <= 0) return -1;
+    publisher->bytes += count;
+    ++publisher->messages;
+    ++publisher->syscalls;
+    return 0;
+  }
+
+  byte header[CHUNK_HEADER_MAX];
+  uint64_t offset = tag->offset + FLV_TAG_HEADER_SIZE;
+  uint32_t remaining = tag->data_size;
+  bool first = true;
+  do {
+    uint32_t len = remaining < PUBLISH_CHUNK_SIZE ? remaining : PUBLISH_CHUNK_SIZE;
+    size_t header_size = chunk_header(header, tag, publisher->rtmp->m_stream_id, first);
+    if (publisher->pacer) pacer_wait(publisher->pacer, header_size + len);
+    if (0 != send_chunk(publisher, header, header_size, offset, len)) {
+      LOG(RTMP_LOGERROR, "%s at 0x%08llx FAILED: %s", publish_modes[publisher->mode], (unsigned long long) tag->offset, strerror(errno));
+      return -1;
+    }
+    publisher->bytes += header_size + len;
+    offset += len;
+    remaining -= len;
+    first = false;
+  } while (remaining > 0);
+
+  ++publisher->messages;
+  if (publisher->mode == PUBLISH_ZEROCOPY) reap(publisher, false);
+  return 0;
+}
+
+void publish_drain(publisher_t *publisher) {
+  // give up after a second, e.g. when the connection is gone
+  for (int i = 0; i < 10 && publisher->zc_completed != publisher->zc_sent; ++i) reap(publisher, true);
+  if (publisher->zc_completed != publisher->zc_sent) LOG(RTMP_LOGWARNING, "%u zerocopy sends not completed", publisher->zc_sent - publisher->zc_completed);
+}
+
+int64_t publish_queued(publisher_t *publisher) {
+  int queued = 0;
+#if defined(__linux__)
+  if (0 != ioctl(publisher->socket, SIOCOUTQ, &queued)) return -1;
+#elif defined(SO_NWRITE)
+  socklen_t len = sizeof(queued);
+  if (0 != getsockopt(publisher->socket, SOL_SOCKET, SO_NWRITE, &queued, &len)) return -1;
+#else
+  return -1;
+#endif
+  return queued;
+}
+
+/*
+ * @param[in] first: type 0 header (timestamp, length, type, stream id), otherwise type 3 (same message continues)
+ */
+static size_t chunk_header(byte *p, const flv_tag_t *tag, uint32_t stream_id, bool first) {
+  uint32_t timestamp = tag->timestamp;
+  bool extended = timestamp >= 0xffffff;
+  size_t n = 0;
+
+  if (first) {
+    uint32_t t = extended ? 0xffffff : timestamp;
+    p[n++] = PUBLISH_CHUNK_STREAM; // fmt 0
+    p[n++] = t >> 16;
+    p[n++] = t >> 8;
+    p[n++] = t;
+    p[n++] = tag->data_size >> 16;
+    p[n++] = tag->data_size >> 8;
+    p[n++] = tag->data_size;
+    p[n++] = tag->tag_type; // flv tag types are the RTMP message types
+    // message stream id is little endian
+    p[n++] = stream_id;
+    p[n++] = stream_id >> 8;
+    p[n++] = stream_id >> 16;
+    p[n++] = stream_id >> 24;
+  } else {
+    p[n++] = 0xc0 | PUBLISH_CHUNK_STREAM; // fmt 3
+  }
+
+  if (extended) {
+    p[n++] = timestamp >> 24;
+    p[n++] = timestamp >> 16;
+    p[n++] = timestamp >> 8;
+    p[n++] = timestamp;
+  }
+  return n;
+}
+
+/*
+ * copy with a rewritten timestamp: the packet RTMP_Write would build, with an absolute (type 0) header
+ */
+static int send_packet(publisher_t *publisher, const flv_tag_t *tag) {
+  RTMP *rtmp = publisher->rtmp;
+  RTMPPacket packet;
+  RTMPPacket_Reset(&packet);
+  if (!RTMPPacket_Alloc(&packet, tag->data_size)) return -1;
+  packet.m_packetType = tag->tag_type;
+  packet.m_headerType = RTMP_PACKET_SIZE_LARGE;
+  packet.m_nChannel = 4; // RTMP_Write's source channel
+  packet.m_nTimeStamp = tag->timestamp;
+  packet.m_nInfoField2 = rtmp->m_stream_id;
+  packet.m_nBodySize = tag->data_size;
+  memcpy(packet.m_body, tag->data, tag->data_size);
+  int ok = RTMP_SendPacket(rtmp, &packet, FALSE);
+  RTMPPacket_Free(&packet);
+  if (!ok) return -1;
+  publisher->bytes += FLV_TAG_HEADER_SIZE + tag->data_size;
+  ++publisher->messages;
+  ++publisher->syscalls;
+  return 0;
+}
+
+static int send_all(int socket, const byte *data, size_t size, int flags) {
+  while (size > 0) {
+    ssize_t n = send(socket, data, size, flags);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    data += n;
+    size -= n;
+  }
+  return 0;
+}
+
+/*
+ * chunk header from memory, then len payload bytes at offset of the file
+ */
+static int send_chunk(publisher_t *publisher, const byte *header, size_t header_size, uint64_t offset, uint32_t len) {
+  int socket = publisher->socket;
+  int fd = publisher->reader->fd;
+
+#ifdef __linux__
+  // the header is copied, only the payload may be pinned until its completion
+  if (0 != send_all(socket, header, header_size, len ? MSG_MORE : 0)) return -1;
+  ++publisher->syscalls;
+
+  if (publisher->mode == PUBLISH_ZEROCOPY) {
+    const byte *data = publisher->reader->map + offset;
+    while (len > 0) {
+      ssize_t n = send(socket, data, len, MSG_ZEROCOPY);
+      ++publisher->syscalls;
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        // optmem is exhausted by pinned pages: wait for completions
+        if (errno == ENOBUFS) {
+          reap(publisher, true);
+          continue;
+        }
+        return -1;
+      }
+      ++publisher->zc_sent;
+      data += n;
+      len -= n;
+    }
+    return 0;
+  }
+
+  off_t off = (off_t) offset;
+  while (len > 0) {
+    ssize_t n = sendfile(socket, fd, &off, len);
+    ++publisher->syscalls;
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    len -= n;
+  }
+  return 0;
+#else
+  // BSD/macOS sendfile() takes the header along, one call per chunk
+  if (len == 0) return send_all(socket, header, header_size, 0);
+
+  struct iovec iov = {(void *) header, header_size};
+  struct sf_hdtr hdtr = {&iov, 1, NULL, 0};
+  off_t off = (off_t) offset;
+  while (len > 0) {
+    off_t n = len; // in: file bytes, out: bytes sent including the header
+    int ret = sendfile(fd, socket, off, &n, iov.iov_len ? &hdtr : NULL, 0);
+    ++publisher->syscalls;
+    if (ret < 0 && errno != EINTR && errno != EAGAIN) return -1;
+
+    if ((size_t) n >= iov.iov_len) {
+      n -= iov.iov_len;
+      iov.iov_len = 0;
+    } else {
+      iov.iov_base = (byte *) iov.iov_base + n;
+      iov.iov_len -= n;
+      n = 0;
+    }
+    off += n;
+    len -= n;
+  }
+  return iov.iov_len ? send_all(socket, iov.iov_base, iov.iov_len, 0) : 0;
+#endif
+}
+
+/*
+ * MSG_ZEROCOPY completions: each one covers the range [ee_info, ee_data] of send calls
+ */
+static void reap(publisher_t *publisher, bool block) {
+#if defined(__linux__) && defined(SO_EE_ORIGIN_ZEROCOPY)
+  if (block) {
+    // POLLERR is always reported
+    struct pollfd pfd = {publisher->socket, 0, 0};
+    poll(&pfd, 1, 100);
+  }
+
+  while (publisher->zc_completed != publisher->zc_sent) {
+    char control[128];
+    struct msghdr msg = {0};
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(publisher->socket, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) return;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) && !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) continue;
+
+      struct sock_extended_err *err = (struct sock_extended_err *) CMSG_DATA(cmsg);
+      if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+      uint32_t count = err->ee_data - err->ee_info + 1;
+      publisher->zc_completed += count;
+      // the kernel fell back to copying, e.g. loopback or no scatter-gather on the nic
+      if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) publisher->zc_copied += count;
+    }
+  }
+#endif
+}
@@ -0,0 +1,54 @@
+#ifndef PUBLISH_H
+#define PUBLISH_H
+
+#include "flv.h"
+#include "pacer.h"
+#include <librtmp/rtmp.h>
+
+/*
+ * publish flv tags as RTMP messages on a connected RTMP (after RTMP_ConnectStream).
+ *
+ *   copy:     RTMP_Write(), librtmp copies the tag into its packet and again into chunks
+ *   sendfile: chunk headers are framed here, payload bytes go from the page cache with sendfile()
+ *   zerocopy: same framing, payload sent from the file mapping with MSG_ZEROCOPY (linux),
+ *             completions are reaped from the socket error queue
+ *
+ * sendfile and zerocopy need a regular (mmap'ed) file and raise the outgoing chunk size to
+ * PUBLISH_CHUNK_SIZE, so a 64 KB chunk costs one header.
+ */
+
+#define PUBLISH_CHUNK_SIZE (65536)
+// chunk stream for our own framing, librtmp uses 2-5
+#define PUBLISH_CHUNK_STREAM (6)
+
+typedef enum { PUBLISH_COPY, PUBLISH_SENDFILE, PUBLISH_ZEROCOPY } publish_mode_t;
+
+extern const char *publish_modes[];
+
+typedef struct {
+  RTMP *rtmp;
+  flv_reader_t *reader;
+  publish_mode_t mode;
+  int socket;
+  pacer_t *pacer; // optional, paces every chunk
+  uint64_t bytes; // payload + chunk headers
+  uint64_t messages;
+  uint64_t syscalls;
+  // MSG_ZEROCOPY: sends are numbered from 0, completions arrive as ranges
+  uint32_t zc_sent;
+  uint32_t zc_completed;
+  uint64_t zc_copied; // completions the kernel served by copying
+} publisher_t;
+
+int publish_init(publisher_t *, RTMP *, flv_reader_t *, publish_mode_t);
+// @brief the message carries tag->timestamp, which may be rewritten from the one in tag->head
+// @return 0, -1 on a send error
+int publish_tag(publisher_t *, const flv_tag_t *);
+// wait for outstanding MSG_ZEROCOPY completions, the mapping must outlive them
+void publish_drain(publisher_t *);
+// @return bytes not yet sent from the socket send queue (SIOCOUTQ / SO_NWRITE), -1 if unknown
+int64_t publish_queued(publisher_t *);
+// @return publish_mode_t by name, -1 if unknown
+int publish_mode(const char *);
+
+#endif
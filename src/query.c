@@ -0,0 +1,227 @@
+#include "columns.h"
+#include <librtmp/log.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * filters and aggregates run column at a time over flat arrays without branches,
+ * so -O2 vectorizes every loop: a filter ANDs its compare into a byte mask.
+ */
+
+typedef struct {
+  int type; // -1: any
+  bool keyframes;
+  uint32_t min_size;
+  uint32_t max_size;
+  uint32_t from; // ms
+  uint32_t to;
+  int nalu_type; // -1: any
+  int64_t gap; // -1: off
+} query_t;
+
+typedef struct {
+  uint64_t tags;
+  uint64_t bytes;
+  uint32_t min_size;
+  uint32_t max_size;
+  uint32_t first; // dts
+  uint32_t last;
+  uint64_t keyframes;
+  uint64_t intervals;
+  uint64_t interval_sum; // ms between keyframes
+  uint32_t max_interval;
+} query_result_t;
+
+void filter(const query_t *, const columns_t *, uint8_t *);
+void aggregate(const columns_t *, const uint8_t *, query_result_t *);
+void merge(query_result_t *, const query_result_t *);
+void print_result(const char *, const query_result_t *);
+
+void usage(char *program_name) {
+  printf("Usage: %s [-v] [-t audio|video|script] [-k] [-s min_size] [-S max_size] [-f from_dts] [-T to_dts] [-n nalu_type] [-g interval_ms] file.flvc [file.flvc ...]\n", program_name);
+  printf("  query the columns of parser -c: count, bytes, duration, sizes and keyframe intervals of the matching tags\n");
+  printf("  -n: tags with a NALU of this AVC (0-31) or HEVC (0-63) type\n");
+  printf("  -g: only list the files with a keyframe interval above interval_ms\n");
+  exit(-1);
+}
+
+int main(int argc, char *argv[]) {
+  RTMP_LogSetLevel(RTMP_LOGINFO);
+
+  char *prog = argv[0];
+  query_t query = {-1, false, 0, UINT32_MAX, 0, UINT32_MAX, -1, -1};
+  bool verbose = false;
+  int c;
+  while ((c = getopt(argc, argv, "vt:ks:S:f:T:n:g:")) != -1) {
+    switch (c) {
+    case 'v':
+      verbose = true;
+      RTMP_LogSetLevel(RTMP_LOGDEBUG);
+      break;
+    case 't':
+      query.type = 0 == strcmp(optarg, "audio") ? TAGTYPE_AUDIODATA : 0 == strcmp(optarg, "video") ? TAGTYPE_VIDEODATA : 0 == strcmp(optarg, "script") ? TAGTYPE_SCRIPTDATAOBJECT : -1;
+      if (query.type < 0) usage(prog);
+      break;
+    case 'k':
+      query.keyframes = true;
+      break;
+    case 's':
+      query.min_size = strtoul(optarg, NULL, 10);
+      break;
+    case 'S':
+      query.max_size = strtoul(optarg, NULL, 10);
+      break;
+    case 'f':
+      query.from = strtoul(optarg, NULL, 10);
+      break;
+    case 'T':
+      query.to = strtoul(optarg, NULL, 10);
+      break;
+    case 'n':
+      query.nalu_type = atoi(optarg);
+      if (query.nalu_type < 0 || query.nalu_type > 63) usage(prog);
+      break;
+    case 'g':
+      query.gap = strtoll(optarg, NULL, 10);
+      break;
+    default:
+      usage(prog);
+      break;
+    }
+  }
+  if (optind >= argc) usage(prog);
+
+  double begin = flv_now();
+  query_result_t total = {0};
+  total.min_size = UINT32_MAX;
+  uint8_t *mask = NULL;
+  size_t mask_size = 0, scanned = 0, files = 0, matched_files = 0;
+  int failed = 0;
+  for (int i = optind; i < argc; ++i) {
+    columns_t columns;
+    if (0 != columns_read(&columns, argv[i])) {
+      RTMP_Log(RTMP_LOGERROR, "%s", columns.error);
+      columns_free(&columns);
+      ++failed;
+      continue;
+    }
+    if (columns.count > mask_size) {
+      mask_size = columns.capacity;
+      free(mask);
+      if (!(mask = malloc(mask_size))) {
+        RTMP_Log(RTMP_LOGERROR, "out of memory");
+        exit(1);
+      }
+    }
+
+    query_result_t result;
+    filter(&query, &columns, mask);
+    aggregate(&columns, mask, &result);
+    ++files;
+    scanned += columns.count;
+    columns_free(&columns);
+
+    if (query.gap >= 0 && result.max_interval <= query.gap) continue;
+    ++matched_files;
+    merge(&total, &result);
+    if (verbose || query.gap >= 0 || argc - optind == 1) print_result(argv[i], &result);
+  }
+
+  double elapsed = flv_now() - begin;
+  if (argc - optind > 1) print_result(query.gap >= 0 ? "matching files" : "total", &total);
+  RTMP_Log(RTMP_LOGINFO, "query: %zu / %zu files, %zu tags in %.3f s, %.0f tags/s", matched_files, files, scanned, elapsed, elapsed > 0 ? scanned / elapsed : 0);
+
+  free(mask);
+  return failed ? -1 : 0;
+}
+
+/*
+ * mask[n] = 1 if tag n matches the query
+ */
+void filter(const query_t *query, const columns_t *columns, uint8_t *mask) {
+  size_t count = columns->count;
+  const uint8_t *type = columns->type, *frame_type = columns->frame_type;
+  const uint32_t *dts = columns->dts, *size = columns->size;
+  const uint64_t *nalus = columns->nalus;
+
+  for (size_t n = 0; n < count; ++n) mask[n] = (dts[n] >= query->from) & (dts[n] <= query->to) & (size[n] >= query->min_size) & (size[n] <= query->max_size);
+  if (query->type >= 0) {
+    uint8_t t = query->type;
+    for (size_t n = 0; n < count; ++n) mask[n] &= type[n] == t;
+  }
+  if (query->keyframes) {
+    for (size_t n = 0; n < count; ++n) mask[n] &= (type[n] == TAGTYPE_VIDEODATA) & (frame_type[n] == FLV_FRAME_KEYFRAME);
+  }
+  if (query->nalu_type >= 0) {
+    uint64_t bit = 1ull << query->nalu_type;
+    for (size_t n = 0; n < count; ++n) mask[n] &= (nalus[n] & bit) != 0;
+  }
+}
+
+void aggregate(const columns_t *columns, const uint8_t *mask, query_result_t *result) {
+  size_t count = columns->count;
+  const uint8_t *type = columns->type, *frame_type = columns->frame_type;
+  const uint32_t *dts = columns->dts, *size = columns->size;
+
+  uint64_t tags = 0, bytes = 0;
+  uint32_t min_size = UINT32_MAX, max_size = 0;
+  for (size_t n = 0; n < count; ++n) {
+    uint32_t m = mask[n];
+    tags += m;
+    bytes += size[n] & -m;
+    uint32_t s = size[n] | (m - 1); // UINT32_MAX when masked out
+    min_size = s < min_size ? s : min_size;
+    max_size = (size[n] & -m) > max_size ? (size[n] & -m) : max_size;
+  }
+
+  memset(result, 0, sizeof(query_result_t));
+  result->tags = tags;
+  result->bytes = bytes;
+  result->min_size = min_size;
+  result->max_size = max_size;
+
+  // duration and keyframe intervals follow the matches in order, the sequence header / keyframe pair at the same dts is one keyframe
+  bool first = true;
+  uint32_t keyframe = 0;
+  for (size_t n = 0; n < count; ++n) {
+    if (!mask[n]) continue;
+    if (first) result->first = dts[n];
+    result->last = dts[n];
+    if (TAGTYPE_VIDEODATA == type[n] && FLV_FRAME_KEYFRAME == frame_type[n] && (result->keyframes == 0 || dts[n] > keyframe)) {
+      if (result->keyframes > 0) {
+        uint32_t interval = dts[n] - keyframe;
+        ++result->intervals;
+        result->interval_sum += interval;
+        if (interval > result->max_interval) result->max_interval = interval;
+      }
+      ++result->keyframes;
+      keyframe = dts[n];
+    }
+    first = false;
+  }
+}
+
+void merge(query_result_t *total, const query_result_t *result) {
+  total->tags += result->tags;
+  total->bytes += result->bytes;
+  if (result->min_size < total->min_size) total->min_size = result->min_size;
+  if (result->max_size > total->max_size) total->max_size = result->max_size;
+  // summed per file
+  total->last += result->last - result->first;
+  total->keyframes += result->keyframes;
+  total->intervals += result->intervals;
+  total->interval_sum += result->interval_sum;
+  if (result->max_interval > total->max_interval) total->max_interval = result->max_interval;
+}
+
+void print_result(const char *name, const query_result_t *result) {
+  printf("%s: %llu tags, %llu bytes, %.3f s", name, (unsigned long long) result->tags, (unsigned long long) result->bytes, (result->last - result->first) / 1000.0);
+  if (result->tags) printf(", size %u / %llu / %u", result->min_size, (unsigned long long) (result->bytes / result->tags), result->max_size);
+  if (result->keyframes) printf(", %llu keyframes", (unsigned long long) result->keyframes);
+  if (result->intervals) printf(", interval %.0f / %u ms", (double) result->interval_sum / result->intervals, result->max_interval);
+  printf("\n");
+}
+
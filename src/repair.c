@@ -0,0 +1,147 @@
+#include "flv.h"
+#include <fcntl.h>
+#include <librtmp/log.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef struct {
+  size_t tags;
+  size_t gaps;
+  size_t skipped;
+  size_t truncated;
+} repair_stat_t;
+
+int repair(const char *, const char *);
+
+void usage(char *program_name) {
+  printf("Usage: %s [-v] [-o outfile] infile [infile ...]\n", program_name);
+  exit(-1);
+}
+
+int main(int argc, char *argv[]) {
+  RTMP_LogSetLevel(RTMP_LOGINFO);
+
+  char *prog = argv[0];
+  char *output = NULL;
+  int c;
+  while ((c = getopt(argc, argv, "vo:")) != -1) {
+    switch (c) {
+    case 'v':
+      RTMP_LogSetLevel(RTMP_LOGDEBUG);
+      break;
+    case 'o':
+      output = optarg;
+      break;
+    default:
+      usage(prog);
+      break;
+    }
+  }
+
+  if (optind >= argc) usage(prog);
+  // a repaired file only makes sense for a single input, otherwise just report
+  if (output != NULL && argc - optind != 1) usage(prog);
+
+  int failed = 0;
+  for (int i = optind; i < argc; ++i) {
+    if (0 != repair(argv[i], output)) ++failed;
+  }
+
+  return failed ? -1 : 0;
+}
+
+/*
+ * walk the tags of infile, validating each one against its trailing PreviousTagSize,
+ * and resync on the next plausible tag header whenever the chain breaks.
+ * valid tags are copied verbatim to outfile (if any), skipped ranges are reported.
+ */
+int repair(const char *infile, const char *outfile) {
+  int fd = open(infile, O_RDONLY);
+  if (fd < 0) {
+    RTMP_Log(RTMP_LOGERROR, "open %s FAILED", infile);
+    return -1;
+  }
+
+  struct stat st;
+  if (0 != fstat(fd, &st) || st.st_size == 0) {
+    RTMP_Log(RTMP_LOGERROR, "empty file: %s", infile);
+    close(fd);
+    return -1;
+  }
+
+  size_t len = (size_t) st.st_size;
+  const byte *buf = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (MAP_FAILED == buf) {
+    RTMP_Log(RTMP_LOGERROR, "mmap %s FAILED", infile);
+    return -1;
+  }
+  madvise((void *) buf, len, MADV_SEQUENTIAL);
+
+  FILE *out = NULL;
+  if (outfile != NULL && NULL == (out = fopen(outfile, "wb"))) {
+    RTMP_Log(RTMP_LOGERROR, "open %s FAILED", outfile);
+    munmap((void *) buf, len);
+    return -1;
+  }
+
+  double begin = flv_now();
+  repair_stat_t stat = {0};
+
+  // flv header + PreviousTagSize0, rebuild a default one if it's damaged
+  size_t pos = 0;
+  byte header[FLV_HEADER_SIZE + FLV_PREV_TAG_SIZE] = {'F', 'L', 'V', 0x01, 0x05, 0x00, 0x00, 0x00, 0x09, 0x00, 0x00, 0x00, 0x00};
+  if (len >= sizeof(header) && 0 == memcmp(buf, "FLV", 3)) {
+    header[4] = buf[4];
+    // a valid DataOffset is 9 (more with an extended header), otherwise resync from the first tag position
+    uint32_t data_offset = flv_ui32(buf + 5);
+    if (data_offset >= FLV_HEADER_SIZE && data_offset <= len - FLV_PREV_TAG_SIZE) {
+      pos = data_offset + FLV_PREV_TAG_SIZE;
+    } else {
+      RTMP_Log(RTMP_LOGWARNING, "%s: bad DataOffset %u, resync after the header", infile, data_offset);
+      pos = sizeof(header);
+    }
+  } else {
+    RTMP_Log(RTMP_LOGWARNING, "%s: bad flv header, rebuilding", infile);
+  }
+  if (out) fwrite(header, 1, sizeof(header), out);
+
+  // copy contiguous runs of valid tags in one write
+  size_t run = pos;
+  while (pos < len) {
+    size_t size = flv_tag_size_at(buf, len, pos);
+    if (size > 0) {
+      ++stat.tags;
+      pos += size;
+      continue;
+    }
+
+    if (out && pos > run) fwrite(buf + run, 1, pos - run, out);
+
+    size_t next = flv_resync(buf, len, pos + 1);
+    if (next == len) {
+      ++stat.truncated;
+      RTMP_Log(RTMP_LOGINFO, "%s: drop tail 0x%08lx-0x%08lx (%lu bytes)", infile, pos, len, len - pos);
+    } else {
+      ++stat.gaps;
+      RTMP_Log(RTMP_LOGINFO, "%s: skip 0x%08lx-0x%08lx (%lu bytes)", infile, pos, next, next - pos);
+    }
+    stat.skipped += next - pos;
+    pos = run = next;
+  }
+  if (out && pos > run) fwrite(buf + run, 1, pos - run, out);
+
+  double elapsed = flv_now() - begin;
+  RTMP_Log(RTMP_LOGINFO, "%s: %lu tags, %lu gaps, %lu bytes skipped%s, %.1f MB/s", infile, stat.tags, stat.gaps, stat.skipped, stat.truncated ? " (truncated)" : "",
+           elapsed > 0 ? len / elapsed / 1024 / 1024 : 0);
+
+  if (out) fclose(out);
+  munmap((void *) buf, len);
+  return 0;
+}
+
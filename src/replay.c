@@ -1,3 +1,9 @@
+#include "columns.h"
+#include "flv.h"
+#include "log.h"
+#include "metrics.h"
+#include "publish.h"
+#include "window.h"
 #include <assert.h>
 #include <librtmp/amf.h>
 #include <librtmp/log.h>
@@ -6,56 +12,165 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
-typedef unsigned char byte;
-enum tag_types { TAGTYPE_AUDIODATA = 8, TAGTYPE_VIDEODATA = 9, TAGTYPE_SCRIPTDATAOBJECT = 18 };
-const char *flv_tag_types[] = {"", "", "", "", "", "", "", "", "audio", "video", "", "", "", "", "", "", "", "", "script data"};
-
-typedef struct flv_tag {
-  byte type;
-  byte head[11];
-  uint32_t offset;
-  size_t size;
-  uint32_t data_offset;
-  size_t data_size;
-} flv_tag_t;
-
-void open_flv();
+void open_flv(char *, char *);
 void open_rtmp();
 void close_rtmp();
 void send_metadata();
 void send_metadata_packet();
 void send_video_tag(uint32_t);
+void wait_for(uint64_t);
 void get_metadata_tag();
 void get_video_tags();
-flv_tag_t *read_tag();
-void read_ui24(uint32_t *, void *);
 int die();
+void report();
+double cpu_seconds(double *, double *);
 static int DumpMetaData(AMFObject *);
 static void sigIntHandler(int sig);
 
 // variable
-FILE *infile;
+flv_reader_t *reader;
+flv_index_t flv_index;
 RTMP *rtmp;
-flv_tag_t **video_tags;
+flv_index_entry_t **video_tags;
 size_t video_tag_size;
-flv_tag_t *metadata_tag;
-byte message[10 * 1024 * 1024];
+flv_tag_t metadata_tag;
+publisher_t publisher;
+pacer_t pacer;
+window_t window;
+bool windowed = false;
+// time-warp: stream ms are played at speed x wall ms, 0: flat out
+double speed = 1;
+bool rescale = false; // timestamps follow the wall clock instead of the recording
+uint32_t first_dts;
+uint64_t pass; // stream ms of one loop over the file
+uint64_t loop_base; // stream ms of the passes before this one
+uint64_t position; // stream ms of the last tag sent
+double max_lag; // s behind the schedule
+uint64_t late; // tags sent more than a frame behind the schedule
+char *url = "rtmp://shgbit.xyz/app/1";
+double begin;
+double begin_cpu; // index build etc. isn't publishing
+
+void usage(char *program_name) {
+  printf("Usage: %s [-m metrics] [-u url] [-z copy|sendfile|zerocopy] [-s speed] [-F] [-t keep|rescale] [-c in.flvc] [-d seconds] [-r kbps] [-B burst] [-q queue] [-w ms] [-W MB] [infile]\n", program_name);
+  printf("  -s: send the tags at their timestamps played speed times faster (default 1, e.g. 4 or 16), 0: as fast as the socket takes them\n");
+  printf("  -F: same as -s 0\n");
+  printf("  -t: keep the recorded timestamps (default) or rescale them to the wall clock of the send, both continue across loops\n");
+  printf("  -r: token bucket rate, -B: bucket size in bytes (default 100 ms of -r)\n");
+  printf("  -q: socket queue bytes above which non-reference frames are dropped, twice that skips to the next keyframe\n");
+  printf("  -c: take the index from parser -c columns, the file isn't read before the first send\n");
+  printf("  -w: prefetch ms ahead of the send (default 2000, stream ms scale with -s, 0: off), -W: window MB, pages further behind are dropped (default 256)\n");
+  exit(-1);
+}
 
 int main(int argc, char *argv[]) {
-  open_flv();
+  int mode = PUBLISH_COPY;
+  double duration = 0;
+  uint64_t rate = 0;
+  uint32_t burst = 0, threshold = 0;
+  uint32_t ahead = 2000;
+  uint64_t window_size = 256;
+  char *columns_file = NULL;
+  int c;
+  while ((c = getopt(argc, argv, "m:u:z:s:Ft:c:d:r:B:q:w:W:")) != -1) {
+    switch (c) {
+    case 'm':
+      metrics_init("replay", optarg, 1000);
+      break;
+    case 'u':
+      url = optarg;
+      break;
+    case 'z':
+      if ((mode = publish_mode(optarg)) < 0) usage(argv[0]);
+      break;
+    case 's':
+      speed = atof(optarg);
+      if (speed < 0) usage(argv[0]);
+      break;
+    case 'F':
+      speed = 0;
+      break;
+    case 't':
+      if (0 == strcmp(optarg, "rescale")) {
+        rescale = true;
+      } else if (0 != strcmp(optarg, "keep")) {
+        usage(argv[0]);
+      }
+      break;
+    case 'c':
+      columns_file = optarg;
+      break;
+    case 'd':
+      duration = atof(optarg);
+      break;
+    case 'r':
+      rate = strtoull(optarg, NULL, 10) * 1000;
+      break;
+    case 'B':
+      burst = atoi(optarg);
+      break;
+    case 'q':
+      threshold = atoi(optarg);
+      break;
+    case 'w':
+      ahead = atoi(optarg);
+      break;
+    case 'W':
+      window_size = strtoull(optarg, NULL, 10);
+      break;
+    default:
+      usage(argv[0]);
+      break;
+    }
+  }
+
+  open_flv(optind < argc ? argv[optind] : "out.flv", columns_file);
+  if (ahead > 0) {
+    // the window counts stream ms, at speed x that many more pass per wall ms; flat out the window alone bounds the prefetch
+    double stream_ahead = ahead * speed;
+    if (0 == window_init(&window, reader, &flv_index, speed == 0 || stream_ahead >= UINT32_MAX ? UINT32_MAX : (uint32_t) stream_ahead, window_size * 1024 * 1024)) {
+      // a file that fits the window was prefetched whole, nothing to do per tag
+      windowed = window.drop;
+    } else {
+      LOG(RTMP_LOGWARNING, "%s", window.error);
+    }
+  }
   open_rtmp();
+  if (0 != publish_init(&publisher, rtmp, reader, mode)) die();
+  LOG(RTMP_LOGINFO, "publish with %s", publish_modes[publisher.mode]);
+  pacer_init(&pacer, rate, burst, threshold);
+  if (rate || threshold) publisher.pacer = &pacer;
+  if (threshold && publish_queued(&publisher) < 0) LOG(RTMP_LOGWARNING, "socket queue depth unavailable, no frames will be dropped");
+  if (threshold) {
+    // the queue can't grow past the send buffer, send() blocks first
+    int sndbuf = 0;
+    socklen_t len = sizeof(sndbuf);
+    if (0 == getsockopt(publisher.socket, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len) && sndbuf > 0 && pacer.critical > (uint32_t) sndbuf / 2) {
+      pacer.threshold = sndbuf / 4;
+      pacer.critical = sndbuf / 2;
+      LOG(RTMP_LOGWARNING, "send buffer is %d bytes, drop threshold lowered to %u", sndbuf, pacer.threshold);
+    }
+  }
 
   // send_metadata_packet();
   send_metadata();
 
-  while (!RTMP_ctrlC) {
-    static int i = 0;
+  begin = flv_now();
+  begin_cpu = cpu_seconds(NULL, NULL);
+  while (!RTMP_ctrlC && (duration <= 0 || flv_now() - begin < duration)) {
+    static size_t i = 0;
     send_video_tag(i++);
 
-    i = i % video_tag_size; // loop video_tags
-    usleep(1000 / 25 * 1000); // fps: 25
+    // loop video_tags, the stream clock keeps running
+    if (i == video_tag_size) {
+      i = 0;
+      loop_base += pass;
+    }
   }
 
   return die();
@@ -63,35 +178,55 @@ int main(int argc, char *argv[]) {
 
 static void sigIntHandler(int sig) {
   RTMP_ctrlC = TRUE;
+  fprintf(stderr, "  Caught signal: %d, cleaning up, just a second...\n", sig);
   signal(SIGINT, SIG_IGN);
 }
 
-void open_flv() {
+void open_flv(char *filename, char *columns_file) {
   RTMP_LogSetLevel(RTMP_LOGINFO);
-  infile = fopen("out.flv", "rb");
+  reader = flv_open(filename);
+  if (!reader) {
+    LOG(RTMP_LOGERROR, "open %s FAILED", filename);
+    exit(-1);
+  }
+
+  // the index walk reads the whole file before the first send, the columns only their own few bytes per tag
+  if (columns_file) {
+    columns_t columns;
+    if (0 != columns_read(&columns, columns_file) || 0 != columns_index(&columns, &flv_index)) {
+      LOG(RTMP_LOGERROR, "%s", columns.error[0] ? columns.error : "out of memory");
+      exit(-1);
+    }
+    columns_free(&columns);
+    flv_index_entry_t *last = flv_index.count ? &flv_index.entries[flv_index.count - 1] : NULL;
+    if (last && last->offset + FLV_TAG_HEADER_SIZE + last->data_size + FLV_PREV_TAG_SIZE > reader->size) {
+      LOG(RTMP_LOGERROR, "%s doesn't match %s", columns_file, filename);
+      exit(-1);
+    }
+  } else if (flv_index_build_parallel(reader, &flv_index, 0) < 0) {
+    LOG(RTMP_LOGWARNING, "stop at damaged tag: %s", reader->error);
+  }
   get_metadata_tag();
   get_video_tags();
 }
 
 void open_rtmp() {
-  char *url = "rtmp://shgbit.xyz/app/1";
-
   rtmp = RTMP_Alloc();
   RTMP_Init(rtmp);
   if (RTMP_SetupURL(rtmp, url) < 0) {
-    RTMP_Log(RTMP_LOGERROR, "RTMP_SetupURL FAILED: %s", url);
+    LOG(RTMP_LOGERROR, "RTMP_SetupURL FAILED: %s", url);
     die();
   }
 
   RTMP_EnableWrite(rtmp);
 
   if (RTMP_Connect(rtmp, NULL) < 0) {
-    RTMP_Log(RTMP_LOGERROR, "Connect FAILED: %s", url);
+    LOG(RTMP_LOGERROR, "Connect FAILED: %s", url);
     die();
   }
 
   if (RTMP_ConnectStream(rtmp, 0) < 0) {
-    RTMP_Log(RTMP_LOGERROR, "ConnectStream FAILED");
+    LOG(RTMP_LOGERROR, "ConnectStream FAILED");
     die();
   }
 
@@ -99,9 +234,13 @@ void open_rtmp() {
 }
 
 int die() {
+  publish_drain(&publisher);
+  if (begin > 0) report();
   RTMP_Close(rtmp);
   RTMP_Free(rtmp);
-  fclose(infile);
+  flv_close(reader);
+  flv_index_free(&flv_index);
+  metrics_stop();
   exit(0);
   return 0;
 }
@@ -115,105 +254,167 @@ void send_metadata_packet() {
   packet.m_headerType = RTMP_PACKET_SIZE_LARGE;
   packet.m_nInfoField2 = rtmp->m_stream_id;
   packet.m_nChannel = 4;
-  packet.m_nBodySize += metadata_tag->data_size + 16;
+  packet.m_nBodySize += metadata_tag.data_size + 16;
   RTMPPacket_Alloc(&packet, packet.m_nBodySize);
 
   AVal str = AVC("@setDataFrame");
   assert(AMF_EncodeString(packet.m_body, packet.m_body + packet.m_nBodySize, &str) != NULL);
-  fseek(infile, metadata_tag->data_offset, SEEK_SET);
-  fread(packet.m_body + 16, 1, metadata_tag->data_size, infile);
+  memcpy(packet.m_body + 16, metadata_tag.data, metadata_tag.data_size);
 
-  RTMP_LogHexString(RTMP_LOGINFO, (uint8_t *) packet.m_body, packet.m_nBodySize);
+  LOG_HEX_STRING(RTMP_LOGINFO, (uint8_t *) packet.m_body, packet.m_nBodySize);
   RTMP_SendPacket(rtmp, &packet, false);
   RTMPPacket_Free(&packet);
 }
 
 void send_metadata() {
-  byte buffer[1024];
-  fseek(infile, metadata_tag->offset, SEEK_SET);
-  fread(buffer, 1, metadata_tag->size, infile);
-  int count = RTMP_Write(rtmp, (char *) buffer, metadata_tag->size);
+  int count = RTMP_Write(rtmp, (const char *) metadata_tag.head, FLV_TAG_HEADER_SIZE + metadata_tag.data_size);
 
-  RTMP_Log(RTMP_LOGINFO, "send metadata: %d", count);
+  LOG(RTMP_LOGINFO, "send metadata: %d", count);
 }
 
+// the tag is written straight from the file mapping, no copy into a message buffer
 void send_video_tag(uint32_t index) {
-  flv_tag_t *current;
+  flv_index_entry_t *current;
+  flv_tag_t tag;
   current = video_tags[index];
-  fseek(infile, current->offset, SEEK_SET);
-  fread(message, 1, current->size, infile);
-  int count = RTMP_Write(rtmp, (char *) message, current->size);
-  RTMP_Log(RTMP_LOGINFO, "send video tag (#%d): %d", index, count);
-}
-
-void get_metadata_tag() {
-  flv_tag_t *tag = malloc(sizeof(flv_tag_t));
-  tag->offset = 13; // 9: flv_header 4: prev
-  fseek(infile, tag->offset, SEEK_SET);
-  fread(tag->head, 1, 11, infile);
-  tag->type = *tag->head;
-
-  read_ui24((uint32_t *) &(tag->data_size), tag->head + 1);
-  tag->data_offset = tag->offset + 11;
-  tag->size = tag->data_size + 11;
-
-  RTMP_Log(RTMP_LOGDEBUG, "%s", flv_tag_types[tag->type]);
-  RTMP_LogHex(RTMP_LOGDEBUG, tag->head, sizeof(tag->head));
-  RTMP_Log(RTMP_LOGDEBUG, "  tag offset: 0x%08x, tag size: %lu", tag->offset, tag->size);
-  RTMP_Log(RTMP_LOGDEBUG, "  data offset: 0x%08x, data size: %lu", tag->data_offset, tag->data_size);
-
-  char *obj_buffer = malloc(tag->data_size);
-  fread(obj_buffer, 1, tag->data_size, infile);
+  if (windowed) window_advance(&window, current - flv_index.entries);
+
+  // out of order timestamps are sent right away
+  uint64_t stream = loop_base + (current->timestamp > first_dts ? current->timestamp - first_dts : 0);
+  if (stream < position) stream = position;
+  position = stream;
+  wait_for(stream);
+
+  METRIC_BEGIN(read);
+  if (flv_read_tag_at(reader, current->offset, &tag) <= 0) {
+    LOG(RTMP_LOGERROR, "read video tag (#%d) FAILED: %s", index, reader->error);
+    return;
+  }
+  METRIC_END(read, METRIC_READ, FLV_TAG_HEADER_SIZE + tag.data_size);
+
+  // uint32 ms wrap like RTMP timestamps do
+  if (!rescale) {
+    tag.timestamp = first_dts + stream;
+  } else if (speed > 0) {
+    tag.timestamp = first_dts + (uint64_t) (stream / speed);
+  } else {
+    tag.timestamp = first_dts + (uint64_t) ((flv_now() - begin) * 1000);
+  }
 
-  AMFObject obj;
-  AMF_Decode(&obj, obj_buffer, tag->data_size, false);
-  DumpMetaData(&obj);
+  if (PACER_DROP == pacer_admit(&pacer, &tag, publisher.pacer ? publish_queued(&publisher) : -1)) {
+    LOG(RTMP_LOGDEBUG, "drop video tag (#%d), frame type %u%s", index, current->frame_type, pacer.skipping ? ", waiting for a keyframe" : "");
+    return;
+  }
 
-  metadata_tag = tag;
+  METRIC_BEGIN(send);
+  if (0 != publish_tag(&publisher, &tag)) {
+    LOG(RTMP_LOGERROR, "send video tag (#%d) FAILED", index);
+    RTMP_ctrlC = TRUE;
+    return;
+  }
+  METRIC_END(send, METRIC_SEND, FLV_TAG_HEADER_SIZE + tag.data_size);
+  LOG(RTMP_LOGDEBUG, "send video tag (#%d): %u", index, tag.data_size);
 }
 
-void get_video_tags() {
-  video_tags = malloc(sizeof(flv_tag_t *) * 4096);
-  flv_tag_t *current;
-
-  // move to first tag address
-  fseek(infile, 13, SEEK_SET);
-  while ((current = read_tag()) != NULL) {
-    if (TAGTYPE_VIDEODATA == current->type) {
-      video_tags[video_tag_size++] = current;
-    }
+/*
+ * sleep until the stream ms are due at speed, or count how late they are
+ */
+void wait_for(uint64_t stream) {
+  if (speed == 0) return;
+  double lag = flv_now() - (begin + stream / speed / 1000);
+  if (lag < 0) {
+    struct timespec ts = {(time_t) -lag, (long) ((-lag - (time_t) -lag) * 1e9)};
+    nanosleep(&ts, NULL);
+    return;
   }
+  if (lag > max_lag) max_lag = lag;
+  // one frame of the file at this speed
+  if (lag * 1000 * speed > (double) pass / video_tag_size) ++late;
 }
 
-flv_tag_t *read_tag() {
-  static uint32_t _offset = 13;
-
-  flv_tag_t *tag = malloc(sizeof(flv_tag_t));
-  tag->offset = _offset;
-
-  if (11 != fread(tag->head, 1, 11, infile)) return NULL;
-  tag->type = *tag->head;
+/*
+ * throughput and process CPU time, cpu-s per Gbit compares the publish paths at any rate
+ */
+void report() {
+  double elapsed = flv_now() - begin;
+  double user, sys;
+  double cpu = cpu_seconds(&user, &sys) - begin_cpu;
+  double gbit = publisher.bytes * 8 / 1e9;
+
+  LOG(RTMP_LOGINFO, "publish: %s, %lu messages, %.1f MB in %.1f s, %.3f Gbps, cpu %.1f%% (process user %.2f s, sys %.2f s), %.3f cpu-s per Gbit, %lu syscalls", publish_modes[publisher.mode],
+      (unsigned long) publisher.messages, publisher.bytes / 1024.0 / 1024, elapsed, elapsed > 0 ? gbit / elapsed : 0, elapsed > 0 ? cpu / elapsed * 100 : 0, user, sys, gbit > 0 ? cpu / gbit : 0,
+      (unsigned long) publisher.syscalls);
+  // stream ms sent over wall ms is the speed achieved, below -s when the socket or the receiver can't keep up
+  uint64_t streamed = position + pass / video_tag_size;
+  char target[32] = "flat out";
+  if (speed > 0) snprintf(target, sizeof(target), "%gx", speed);
+  LOG(RTMP_LOGINFO, "replay: %s, achieved %.2fx, %lu tags, %.1f tags/s, %.1f MB/s, timestamps %s, %lu tags late, max lag %.0f ms", target, elapsed > 0 ? streamed / 1000.0 / elapsed : 0,
+      (unsigned long) publisher.messages, elapsed > 0 ? publisher.messages / elapsed : 0, elapsed > 0 ? publisher.bytes / 1024.0 / 1024 / elapsed : 0, rescale ? "rescaled" : "kept", (unsigned long) late,
+      max_lag * 1000);
+  if (publisher.pacer) {
+    // without a pacing rate the queue drains at what the link achieved
+    double drain = pacer.rate > 0 ? pacer.rate : (elapsed > 0 ? publisher.bytes / elapsed : 0);
+    LOG(RTMP_LOGINFO, "pacer: %lu sent, %lu dropped (%lu disposable/non-reference, %lu skipping to a keyframe, %lu skips), waited %.2f s, max queue %lu bytes, latency bound %.0f ms",
+        (unsigned long) pacer.sent, (unsigned long) (pacer.dropped_disposable + pacer.dropped_skip), (unsigned long) pacer.dropped_disposable, (unsigned long) pacer.dropped_skip,
+        (unsigned long) pacer.skips, pacer.waited, (unsigned long) pacer.max_queued, pacer_latency_bound(&pacer, drain));
+  }
+  if (windowed) {
+    char ahead[32] = "";
+    if (window.ahead != UINT32_MAX) snprintf(ahead, sizeof(ahead), "%u ms / ", window.ahead);
+    LOG(RTMP_LOGINFO, "window: %s%lu MB ahead, %lu prefetches (%.1f MB), %.1f MB released, %lu of %lu tags not cached when sent", ahead, (unsigned long) (window.size / 2 / 1024 / 1024),
+        (unsigned long) window.prefetches, window.prefetched_bytes / 1024.0 / 1024, window.released_bytes / 1024.0 / 1024, (unsigned long) window.misses, (unsigned long) window.tags);
+  }
+  if (publisher.mode == PUBLISH_ZEROCOPY) {
+    LOG(RTMP_LOGINFO, "zerocopy: %u sends, %u completed, %lu copied by the kernel", publisher.zc_sent, publisher.zc_completed, (unsigned long) publisher.zc_copied);
+  }
+}
 
-  read_ui24((uint32_t *) &(tag->data_size), tag->head + 1);
-  tag->data_offset = tag->offset + 11;
-  tag->size = tag->data_size + 11;
+double cpu_seconds(double *user, double *sys) {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  double u = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+  double s = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+  if (user) *user = u;
+  if (sys) *sys = s;
+  return u + s;
+}
 
-  RTMP_Log(RTMP_LOGDEBUG, "%s", flv_tag_types[tag->type]);
-  RTMP_LogHex(RTMP_LOGDEBUG, tag->head, sizeof(tag->head));
-  RTMP_Log(RTMP_LOGDEBUG, "  tag offset: 0x%08x, tag size: %lu", tag->offset, tag->size);
-  RTMP_Log(RTMP_LOGDEBUG, "  data offset: 0x%08x, data size: %lu", tag->data_offset, tag->data_size);
 
-  // update _offset
-  _offset += 11 + tag->data_size + 4;
+void get_metadata_tag() {
+  size_t n = 0;
+  while (n < flv_index.count && TAGTYPE_SCRIPTDATAOBJECT != flv_index.entries[n].tag_type) ++n;
+  if (n == flv_index.count || flv_read_tag_at(reader, flv_index.entries[n].offset, &metadata_tag) <= 0) {
+    LOG(RTMP_LOGERROR, "no metadata tag");
+    exit(-1);
+  }
 
-  if (0 != fseek(infile, tag->data_size + 4, SEEK_CUR)) return NULL;
+  LOG(RTMP_LOGDEBUG, "%s", flv_tag_types[metadata_tag.tag_type]);
+  LOG_HEX(RTMP_LOGDEBUG, metadata_tag.head, FLV_TAG_HEADER_SIZE);
+  LOG(RTMP_LOGDEBUG, "  tag offset: 0x%08llx, data size: %u", (unsigned long long) metadata_tag.offset, metadata_tag.data_size);
 
-  return tag;
+  AMFObject obj;
+  AMF_Decode(&obj, (const char *) metadata_tag.data, metadata_tag.data_size, false);
+  DumpMetaData(&obj);
 }
 
-void read_ui24(uint32_t *out, void *ptr) {
-  uint8_t *bytes = (uint8_t *) ptr;
-  *out = (bytes[0] << 16) | (bytes[1] << 8) | bytes[2];
+void get_video_tags() {
+  video_tags = malloc(sizeof(flv_index_entry_t *) * (flv_index.count + 1));
+  for (size_t n = 0; n < flv_index.count; ++n) {
+    if (TAGTYPE_VIDEODATA == flv_index.entries[n].tag_type) {
+      video_tags[video_tag_size++] = &flv_index.entries[n];
+    }
+  }
+  if (video_tag_size == 0) {
+    LOG(RTMP_LOGERROR, "no video tag");
+    exit(-1);
+  }
+
+  // a pass lasts until the last tag plus one average frame
+  first_dts = video_tags[0]->timestamp;
+  uint32_t last = video_tags[video_tag_size - 1]->timestamp;
+  uint64_t span = last > first_dts ? last - first_dts : 0;
+  pass = span + (video_tag_size > 1 ? span / (video_tag_size - 1) : 40);
+  if (pass == 0) pass = 40 * video_tag_size; // no usable timestamps, 25 fps
 }
 
 // from amf.c
@@ -227,7 +428,7 @@ static int DumpMetaData(AMFObject *obj) {
     case AMF_OBJECT:
     case AMF_ECMA_ARRAY:
     case AMF_STRICT_ARRAY:
-      if (prop->p_name.av_len) RTMP_Log(RTMP_LOGINFO, "%.*s:", prop->p_name.av_len, prop->p_name.av_val);
+      if (prop->p_name.av_len) LOG(RTMP_LOGINFO, "%.*s:", prop->p_name.av_len, prop->p_name.av_val);
       DumpMetaData(&prop->p_vu.p_object);
       break;
     case AMF_NUMBER:
@@ -247,7 +448,7 @@ static int DumpMetaData(AMFObject *obj) {
       snprintf(str, 255, "INVALID TYPE 0x%02x", (unsigned char) prop->p_type);
     }
     if (str[0] && prop->p_name.av_len) {
-      RTMP_Log(RTMP_LOGDEBUG, "  %-22.*s%s", prop->p_name.av_len, prop->p_name.av_val, str);
+      LOG(RTMP_LOGDEBUG, "  %-22.*s%s", prop->p_name.av_len, prop->p_name.av_val, str);
     }
   }
   return FALSE;
@@ -0,0 +1,111 @@
+#include "bus.h"
+#include "flv.h"
+#include "log.h"
+#include <librtmp/log.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static volatile sig_atomic_t stop = 0;
+
+int write_configs(bus_t *, flv_writer_t *);
+void on_signal(int);
+
+void usage(char *program_name) {
+  printf("Usage: %s [-v] [-o out.flv] [-d delay_us] bus.sock\n", program_name);
+  printf("  read the tags dump -b publishes, -o writes them as flv (from the next keyframe), -d slows down every tag\n");
+  exit(-1);
+}
+
+int main(int argc, char *argv[]) {
+  RTMP_LogSetLevel(RTMP_LOGINFO);
+
+  char *output = NULL;
+  useconds_t delay = 0;
+  int c;
+  while ((c = getopt(argc, argv, "vo:d:")) != -1) {
+    switch (c) {
+    case 'v':
+      RTMP_LogSetLevel(RTMP_LOGDEBUG);
+      break;
+    case 'o':
+      output = optarg;
+      break;
+    case 'd':
+      delay = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      break;
+    }
+  }
+  if (optind >= argc) usage(argv[0]);
+
+  bus_t *bus = bus_attach(argv[optind]);
+  if (bus == NULL) exit(1);
+  RTMP_Log(RTMP_LOGINFO, "attached to %s as reader %d", argv[optind], bus->slot);
+
+  flv_writer_t *writer = NULL;
+  if (output && (!(writer = flv_writer_open(output, 0x05)) || 0 != write_configs(bus, writer))) {
+    RTMP_Log(RTMP_LOGERROR, "write %s FAILED", output);
+    exit(1);
+  }
+
+  // no SA_RESTART: a signal ends the futex wait
+  struct sigaction action = {0};
+  action.sa_handler = on_signal;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+
+  double begin = flv_now();
+  bool keyframe = false;
+  int ret = 0;
+  flv_tag_t tag;
+  while (!stop && (ret = bus_next(bus, &tag)) > 0) {
+    LOG(RTMP_LOGDEBUG, "%s, t: %u, %u bytes", flv_tag_types[tag.tag_type], tag.timestamp, tag.data_size);
+
+    if (writer) {
+      flv_video_t video;
+      if (!keyframe && 0 == flv_parse_video(&tag, &video)) keyframe = FLV_FRAME_KEYFRAME == video.frame_type;
+      // in place: the tag is ours until the next bus_next
+      if (keyframe && 0 != flv_write_tag(writer, tag.tag_type, tag.timestamp, tag.data, tag.data_size)) {
+        RTMP_Log(RTMP_LOGERROR, "write %s FAILED", output);
+        break;
+      }
+    }
+    if (delay) usleep(delay);
+  }
+  if (ret < 0 && !stop) RTMP_Log(RTMP_LOGERROR, "bus: %s", bus->error);
+  if (ret == 0 && bus->error[0]) RTMP_Log(RTMP_LOGWARNING, "bus: %s", bus->error);
+
+  double elapsed = flv_now() - begin;
+  RTMP_Log(RTMP_LOGINFO, "subscribe: %llu tags, %.2f MB in %.2f s, %.0f tags/s, %.1f MB/s, %llu wakeups", (unsigned long long) bus->tags, bus->bytes / 1024.0 / 1024, elapsed, elapsed > 0 ? bus->tags / elapsed : 0,
+           elapsed > 0 ? bus->bytes / elapsed / 1024 / 1024 : 0, (unsigned long long) bus->wakeups);
+
+  flv_writer_close(writer);
+  int evicted = bus->evicted > 0;
+  bus_close(bus);
+  return evicted ? 1 : 0;
+}
+
+/*
+ * the sequence headers and metadata sent before we attached
+ */
+int write_configs(bus_t *bus, flv_writer_t *writer) {
+  byte buffer[FLV_TAG_HEADER_SIZE + BUS_CONFIG_SIZE];
+  for (int i = BUS_CONFIG_METADATA; i >= BUS_CONFIG_VIDEO; --i) {
+    uint32_t size = bus_config(bus, i, buffer);
+    if (size == 0) continue;
+    if (0 != flv_write_tag(writer, buffer[0], 0, buffer + FLV_TAG_HEADER_SIZE, size - FLV_TAG_HEADER_SIZE)) return -1;
+  }
+  return 0;
+}
+
+void on_signal(int sig) {
+  (void) sig;
+  stop = 1;
+}
+
@@ -1,3 +1,5 @@
+#include "flv.h"
+#include <assert.h>
 #include <librtmp/amf.h>
 #include <librtmp/log.h>
 #include <librtmp/rtmp.h>
@@ -5,8 +7,6 @@
 #include <stdio.h>
 #include <string.h>
 
-typedef unsigned char byte;
-
 static int DumpMetaData(AMFObject *obj);
 void encode1();
 void encode2();
@@ -75,24 +75,23 @@ void encode1() {
 }
 
 void decode() {
-  uint32_t offset = 0x0d + 11;
-  size_t size = 573;
-  byte buffer[size];
+  flv_reader_t *reader = flv_open("out.flv");
+  flv_tag_t tag;
+  assert(reader != NULL);
 
-  FILE *file = fopen("out.flv", "r");
-  memset(buffer, 0, size);
-  fseek(file, offset, 0);
-  fread(buffer, 1, size, file);
-  RTMP_LogHexString(RTMP_LOGINFO, buffer, size);
-  fclose(file);
+  // first script data tag: onMetaData
+  while (flv_read_tag(reader, &tag) > 0 && TAGTYPE_SCRIPTDATAOBJECT != tag.tag_type) {}
+  assert(TAGTYPE_SCRIPTDATAOBJECT == tag.tag_type);
+  RTMP_LogHexString(RTMP_LOGINFO, tag.data, tag.data_size);
 
   // parse amf
   AMFObject obj;
-  AMF_Decode(&obj, (char *) buffer, size, FALSE);
+  AMF_Decode(&obj, (const char *) tag.data, tag.data_size, FALSE);
 
   // AMF_Dump(&obj);
 
   DumpMetaData(&obj);
+  flv_close(reader);
 }
 
 static int DumpMetaData(AMFObject *obj) {
@@ -0,0 +1,165 @@
+#include "flv.h"
+#include <librtmp/log.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * flv_index_build_parallel() must give exactly the flv_index_build() result:
+ * a real recording, a synthetic file whose payloads are full of valid looking tag chains
+ * (every resync inside them is wrong), and damaged / truncated copies of it.
+ */
+
+static int failures = 0;
+static uint64_t seed = 0x9e3779b97f4a7c15ull;
+
+int compare(const char *, int);
+void write_synthetic(const char *, uint64_t);
+void damage(const char *, const char *, double, bool);
+uint32_t random32();
+
+int main(int argc, char *argv[]) {
+  RTMP_LogSetLevel(RTMP_LOGINFO);
+  int threads[] = {2, 3, 8, 64};
+
+  const char *synthetic = "/tmp/test-index.flv";
+  const char *damaged = "/tmp/test-index-damaged.flv";
+  const char *truncated = "/tmp/test-index-truncated.flv";
+  write_synthetic(synthetic, 96ull * 1024 * 1024);
+  damage(synthetic, damaged, 0.6, false);
+  damage(synthetic, truncated, 0.9, true);
+
+  for (int i = 0; i < (int) (sizeof(threads) / sizeof(threads[0])); ++i) {
+    if (argc > 1) compare(argv[1], threads[i]);
+    compare(synthetic, threads[i]);
+    compare(damaged, threads[i]);
+    compare(truncated, threads[i]);
+  }
+
+  unlink(synthetic);
+  unlink(damaged);
+  unlink(truncated);
+  RTMP_Log(failures ? RTMP_LOGERROR : RTMP_LOGINFO, "test-index: %d failures", failures);
+  return failures ? 1 : 0;
+}
+
+int compare(const char *path, int threads) {
+  flv_reader_t *sequential = flv_open(path);
+  flv_reader_t *parallel = flv_open(path);
+  if (!sequential || !parallel) {
+    RTMP_Log(RTMP_LOGERROR, "open %s FAILED", path);
+    ++failures;
+    return -1;
+  }
+
+  flv_index_t expected = {0}, actual = {0};
+  double t0 = flv_now();
+  int ret_expected = flv_index_build(sequential, &expected);
+  double t1 = flv_now();
+  int ret_actual = flv_index_build_parallel(parallel, &actual, threads);
+  double t2 = flv_now();
+
+  bool same = ret_expected == ret_actual && expected.count == actual.count && sequential->pos == parallel->pos;
+  if (ret_expected < 0) same = same && 0 == strcmp(sequential->error, parallel->error);
+  for (size_t n = 0; same && n < expected.count; ++n) {
+    flv_index_entry_t *a = &expected.entries[n], *b = &actual.entries[n];
+    same = a->offset == b->offset && a->timestamp == b->timestamp && a->data_size == b->data_size && a->tag_type == b->tag_type && a->frame_type == b->frame_type;
+  }
+
+  RTMP_Log(same ? RTMP_LOGINFO : RTMP_LOGERROR, "%s %s, %d threads: %d / %d tags, stop at 0x%llx / 0x%llx, %.1f / %.1f ms", same ? "OK" : "FAILED", path, threads, ret_expected, ret_actual,
+           (unsigned long long) sequential->pos, (unsigned long long) parallel->pos, (t1 - t0) * 1000, (t2 - t1) * 1000);
+  if (!same) ++failures;
+
+  flv_index_free(&expected);
+  flv_index_free(&actual);
+  flv_close(sequential);
+  flv_close(parallel);
+  return same ? 0 : -1;
+}
+
+/*
+ * audio and video tags, one in 16 video payloads (64 to 512 KB) filled with a tag chain
+ * that passes flv_resync(), so about half the range boundaries land in a lookalike
+ */
+void write_synthetic(const char *path, uint64_t size) {
+  flv_writer_t *writer = flv_writer_open(path, 0x05);
+  if (writer == NULL) {
+    RTMP_Log(RTMP_LOGERROR, "create %s FAILED", path);
+    exit(1);
+  }
+
+  byte *payload = malloc(512 * 1024 + 64);
+  uint32_t timestamp = 0;
+  while (writer->written < size) {
+    bool video = random32() % 3 != 0;
+    bool lookalike = video && random32() % 16 == 0;
+    uint32_t length = lookalike ? 64 * 1024 + random32() % (448 * 1024) : video ? 1000 + random32() % (32 * 1024) : 100 + random32() % 400;
+    for (uint32_t i = 0; i < length; ++i) payload[i] = random32();
+
+    if (video) {
+      payload[0] = (random32() % 10 == 0 ? FLV_FRAME_KEYFRAME : FLV_FRAME_INTER) << 4 | FLV_CODEC_ID_AVC;
+      payload[1] = AVC_NALU;
+      if (lookalike) {
+        // fake tags of 0..255 bytes, each with a correct PreviousTagSize
+        uint32_t p = 5;
+        while (p + FLV_TAG_HEADER_SIZE + 255 + FLV_PREV_TAG_SIZE < length) {
+          uint32_t fake = random32() % 256;
+          byte header[FLV_TAG_HEADER_SIZE] = {TAGTYPE_VIDEODATA, 0, 0, fake, 0, 0, 0, 0, 0, 0, 0};
+          memcpy(payload + p, header, sizeof(header));
+          p += FLV_TAG_HEADER_SIZE + fake;
+          uint32_t tag_size = FLV_TAG_HEADER_SIZE + fake;
+          byte trailer[FLV_PREV_TAG_SIZE] = {tag_size >> 24, tag_size >> 16, tag_size >> 8, tag_size};
+          memcpy(payload + p, trailer, sizeof(trailer));
+          p += FLV_PREV_TAG_SIZE;
+        }
+      }
+    } else {
+      payload[0] = FLV_SOUND_FORMAT_AAC << 4 | 0x0f;
+      payload[1] = AAC_RAW;
+    }
+
+    flv_write_tag(writer, video ? TAGTYPE_VIDEODATA : TAGTYPE_AUDIODATA, timestamp, payload, length);
+    timestamp += video ? 40 : 23;
+  }
+
+  free(payload);
+  flv_writer_close(writer);
+}
+
+/*
+ * @param[in] at: fraction of the file, the tag header after it gets a bad type, or the file ends there
+ */
+void damage(const char *from, const char *to, double at, bool truncate) {
+  flv_reader_t *reader = flv_open(from);
+  FILE *file = fopen(to, "wb");
+  if (!reader || !file) {
+    RTMP_Log(RTMP_LOGERROR, "copy %s to %s FAILED", from, to);
+    exit(1);
+  }
+
+  uint64_t cut = (uint64_t) (reader->size * at);
+  if (truncate) {
+    fwrite(reader->map, 1, cut, file);
+  } else {
+    flv_tag_t tag;
+    while (flv_read_tag(reader, &tag) > 0 && tag.offset < cut) {
+    }
+    fwrite(reader->map, 1, reader->size, file);
+    fseek(file, tag.offset, SEEK_SET);
+    fputc(0x55, file);
+  }
+
+  fclose(file);
+  flv_close(reader);
+}
+
+// xorshift64
+uint32_t random32() {
+  seed ^= seed << 13;
+  seed ^= seed >> 7;
+  seed ^= seed << 17;
+  return (uint32_t) (seed >> 32);
+}
+
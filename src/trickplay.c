@@ -0,0 +1,329 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include "columns.h"
+#include "flv.h"
+#include "log.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <librtmp/log.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/*
+ * keyframe-only rendition: the tag index says where the keyframes are, their bytes are copied
+ * file to file (copy_file_range, no decode, no copy through user space) or written from the
+ * mapping as Annex-B. with -c the index comes from the parser columns and only keyframe pages are read.
+ */
+
+enum trickplay_formats { FORMAT_FLV, FORMAT_ANNEXB };
+
+#define IOV_BATCH (64)
+
+typedef struct {
+  int format;
+  int fd;
+  uint64_t pos; // output bytes
+  bool copy_file_range;
+  FILE *table;
+  // FLV: tags to copy, adjacent ones coalesced
+  uint64_t range_begin;
+  uint64_t range_end;
+  // Annex-B
+  struct iovec iov[IOV_BATCH];
+  int iov_count;
+  uint8_t length_size;
+  // stats
+  uint64_t keyframes;
+  uint64_t configs;
+  uint64_t copied; // by copy_file_range
+  uint64_t written; // through user space
+} trickplay_t;
+
+static const byte startcode[] = {0x00, 0x00, 0x00, 0x01};
+
+int load_columns(const char *, flv_index_t *);
+int add_tag(trickplay_t *, flv_reader_t *, const flv_index_entry_t *);
+int add_range(trickplay_t *, flv_reader_t *, uint64_t, uint64_t);
+int flush_range(trickplay_t *, flv_reader_t *);
+int add_iov(trickplay_t *, const byte *, size_t);
+int flush_iov(trickplay_t *);
+int write_all(int, const byte *, size_t);
+
+void usage(char *program_name) {
+  printf("Usage: %s [-v] [-f flv|annexb] [-c in.flvc] [-j threads] [-t table] -o outfile infile\n", program_name);
+  printf("  keyframes only, with the sequence headers (and metadata in flv) they need, no decode\n");
+  printf("  -c: take the index from parser -c columns instead of walking the file\n");
+  printf("  -t: offset table, one line per keyframe: timestamp, offset and size in the output, offset in infile\n");
+  exit(-1);
+}
+
+int main(int argc, char *argv[]) {
+  RTMP_LogSetLevel(RTMP_LOGINFO);
+
+  char *prog = argv[0];
+  char *output = NULL, *table = NULL, *columns_file = NULL;
+  int jobs = 0;
+  trickplay_t trickplay = {0};
+  trickplay.length_size = 4;
+  int c;
+  while ((c = getopt(argc, argv, "vf:c:j:t:o:")) != -1) {
+    switch (c) {
+    case 'v':
+      RTMP_LogSetLevel(RTMP_LOGDEBUG);
+      break;
+    case 'f':
+      if (0 == strcmp(optarg, "flv")) {
+        trickplay.format = FORMAT_FLV;
+      } else if (0 == strcmp(optarg, "annexb")) {
+        trickplay.format = FORMAT_ANNEXB;
+      } else {
+        usage(prog);
+      }
+      break;
+    case 'c':
+      columns_file = optarg;
+      break;
+    case 'j':
+      jobs = atoi(optarg);
+      break;
+    case 't':
+      table = optarg;
+      break;
+    case 'o':
+      output = optarg;
+      break;
+    default:
+      usage(prog);
+      break;
+    }
+  }
+  if (optind >= argc || output == NULL) usage(prog);
+
+  flv_reader_t *reader = flv_open(argv[optind]);
+  if (reader == NULL || reader->map == NULL) {
+    RTMP_Log(RTMP_LOGERROR, "open %s FAILED, regular files only", argv[optind]);
+    exit(1);
+  }
+
+  double begin = flv_now();
+  flv_index_t index = {0};
+  if (columns_file) {
+    // keyframe pages only, no readahead through the rest
+    madvise((void *) reader->map, reader->size, MADV_RANDOM);
+    if (0 != load_columns(columns_file, &index)) exit(1);
+    if (index.count && index.entries[index.count - 1].offset + FLV_TAG_HEADER_SIZE + index.entries[index.count - 1].data_size + FLV_PREV_TAG_SIZE > reader->size) {
+      RTMP_Log(RTMP_LOGERROR, "%s doesn't match %s", columns_file, argv[optind]);
+      exit(1);
+    }
+  } else if (flv_index_build_parallel(reader, &index, jobs) < 0) {
+    RTMP_Log(RTMP_LOGWARNING, "stop at damaged tag: %s", reader->error);
+  }
+  double indexed = flv_now();
+
+  trickplay.fd = 0 == strcmp(output, "-") ? STDOUT_FILENO : open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (trickplay.fd < 0 || (table && !(trickplay.table = fopen(table, "w")))) {
+    RTMP_Log(RTMP_LOGERROR, "create %s FAILED", trickplay.fd < 0 ? output : table);
+    exit(1);
+  }
+#ifdef __linux__
+  trickplay.copy_file_range = trickplay.format == FORMAT_FLV;
+#endif
+
+  if (trickplay.format == FORMAT_FLV) {
+    // video only header, PreviousTagSize0
+    byte header[FLV_HEADER_SIZE + FLV_PREV_TAG_SIZE] = {'F', 'L', 'V', 0x01, 0x01, 0, 0, 0, FLV_HEADER_SIZE, 0, 0, 0, 0};
+    if (0 != write_all(trickplay.fd, header, sizeof(header))) exit(1);
+    trickplay.pos = sizeof(header);
+    trickplay.written = sizeof(header);
+  }
+  if (trickplay.table) fprintf(trickplay.table, "# timestamp\toffset\tsize\tsource offset\n");
+
+  int ret = 0;
+  for (size_t n = 0; n < index.count && ret == 0; ++n) ret = add_tag(&trickplay, reader, &index.entries[n]);
+  if (ret == 0) ret = trickplay.format == FORMAT_FLV ? flush_range(&trickplay, reader) : flush_iov(&trickplay);
+  if (ret != 0) RTMP_Log(RTMP_LOGERROR, "write %s FAILED: %s", output, strerror(errno));
+
+  double end = flv_now();
+  uint64_t out = trickplay.copied + trickplay.written;
+  RTMP_Log(RTMP_LOGINFO, "trickplay: %llu keyframes, %llu sequence headers of %zu tags, %.1f MB of %.1f MB (%.1f%%), %.1f MB copy_file_range, index %.3f s, copy %.3f s",
+           (unsigned long long) trickplay.keyframes, (unsigned long long) trickplay.configs, index.count, out / 1024.0 / 1024, reader->size / 1024.0 / 1024,
+           reader->size ? out * 100.0 / reader->size : 0, trickplay.copied / 1024.0 / 1024, indexed - begin, end - indexed);
+
+  if (trickplay.table) fclose(trickplay.table);
+  if (trickplay.fd != STDOUT_FILENO) close(trickplay.fd);
+  flv_index_free(&index);
+  flv_close(reader);
+  return ret == 0 ? 0 : 1;
+}
+
+/*
+ * the index from parser -c columns, frame type included
+ */
+int load_columns(const char *path, flv_index_t *index) {
+  columns_t columns;
+  if (0 != columns_read(&columns, path)) {
+    RTMP_Log(RTMP_LOGERROR, "%s", columns.error);
+    columns_free(&columns);
+    return -1;
+  }
+
+  int ret = columns_index(&columns, index);
+  if (ret != 0) RTMP_Log(RTMP_LOGERROR, "out of memory at %zu tags", columns.count);
+  columns_free(&columns);
+  return ret;
+}
+
+/*
+ * keyframes and the sequence headers (flv: and the first metadata), everything else is skipped unread
+ */
+int add_tag(trickplay_t *trickplay, flv_reader_t *reader, const flv_index_entry_t *entry) {
+  bool metadata = trickplay->format == FORMAT_FLV && TAGTYPE_SCRIPTDATAOBJECT == entry->tag_type && trickplay->pos == FLV_HEADER_SIZE + FLV_PREV_TAG_SIZE;
+  if (!metadata && (TAGTYPE_VIDEODATA != entry->tag_type || FLV_FRAME_KEYFRAME != entry->frame_type)) return 0;
+
+  flv_tag_t tag;
+  flv_video_t video;
+  if (flv_read_tag_at(reader, entry->offset, &tag) <= 0) {
+    RTMP_Log(RTMP_LOGERROR, "read tag at 0x%llx FAILED: %s", (unsigned long long) entry->offset, reader->error);
+    return -1;
+  }
+  bool parsed = !metadata && 0 == flv_parse_video(&tag, &video);
+  bool config = parsed && flv_video_is_config(&video);
+  bool keyframe = !metadata && !config;
+  // Annex-B is AVC / HEVC only
+  bool annexb = parsed && (FLV_CODEC_ID_AVC == video.codec_id || FLV_CODEC_ID_HEVC == video.codec_id) && (config || AVC_NALU == video.avc_packet_type);
+  if (trickplay->format == FORMAT_ANNEXB && !annexb) return 0;
+  if (keyframe) ++trickplay->keyframes;
+  if (config) ++trickplay->configs;
+  LOG(RTMP_LOGDEBUG, "%s, t: %u, offset: 0x%08llx, data size: %u", metadata ? "metadata" : config ? "sequence header" : "keyframe", tag.timestamp, (unsigned long long) tag.offset, tag.data_size);
+
+  uint64_t pos = trickplay->pos;
+  if (trickplay->format == FORMAT_FLV) {
+    if (0 != add_range(trickplay, reader, entry->offset, entry->offset + FLV_TAG_HEADER_SIZE + tag.data_size + FLV_PREV_TAG_SIZE)) return -1;
+  } else if (config && FLV_CODEC_ID_HEVC == video.codec_id) {
+    flv_hevc_config_t hevc;
+    if (0 != flv_parse_hevc_config(video.data, video.size, &hevc)) {
+      RTMP_Log(RTMP_LOGWARNING, "bad HEVCDecoderConfigurationRecord at 0x%llx", (unsigned long long) tag.offset);
+      return 0;
+    }
+    trickplay->length_size = hevc.length_size;
+    for (int i = 0; i < hevc.nalu_count; ++i) {
+      if (0 != add_iov(trickplay, startcode, sizeof(startcode)) || 0 != add_iov(trickplay, hevc.nalus[i], hevc.nalu_sizes[i])) return -1;
+    }
+  } else if (config) {
+    flv_avc_config_t avc;
+    if (0 != flv_parse_avc_config(video.data, video.size, &avc)) {
+      RTMP_Log(RTMP_LOGWARNING, "bad AVCDecoderConfigurationRecord at 0x%llx", (unsigned long long) tag.offset);
+      return 0;
+    }
+    trickplay->length_size = avc.length_size;
+    for (int i = 0; i < avc.sps_count; ++i) {
+      if (0 != add_iov(trickplay, startcode, sizeof(startcode)) || 0 != add_iov(trickplay, avc.sps[i], avc.sps_size[i])) return -1;
+    }
+    for (int i = 0; i < avc.pps_count; ++i) {
+      if (0 != add_iov(trickplay, startcode, sizeof(startcode)) || 0 != add_iov(trickplay, avc.pps[i], avc.pps_size[i])) return -1;
+    }
+  } else {
+    // AVCC / HVCC to Annex-B: start codes between the NALUs, the NALUs straight from the mapping
+    flv_nalu_iter_t iter;
+    const byte *nalu;
+    uint32_t size;
+    flv_nalu_iter_init(&iter, video.data, video.size, trickplay->length_size);
+    while (flv_nalu_next(&iter, &nalu, &size)) {
+      if (0 != add_iov(trickplay, startcode, sizeof(startcode)) || 0 != add_iov(trickplay, nalu, size)) return -1;
+    }
+  }
+
+  if (keyframe && trickplay->table) fprintf(trickplay->table, "%u\t%llu\t%llu\t%llu\n", tag.timestamp, (unsigned long long) pos, (unsigned long long) (trickplay->pos - pos), (unsigned long long) tag.offset);
+  return 0;
+}
+
+/*
+ * FLV
+ */
+int add_range(trickplay_t *trickplay, flv_reader_t *reader, uint64_t begin, uint64_t end) {
+  if (begin != trickplay->range_end && 0 != flush_range(trickplay, reader)) return -1;
+  if (trickplay->range_begin == trickplay->range_end) trickplay->range_begin = begin;
+  trickplay->range_end = end;
+  trickplay->pos += end - begin;
+  return 0;
+}
+
+int flush_range(trickplay_t *trickplay, flv_reader_t *reader) {
+  uint64_t offset = trickplay->range_begin, length = trickplay->range_end - offset;
+  trickplay->range_begin = trickplay->range_end = 0;
+
+#ifdef __linux__
+  while (trickplay->copy_file_range && length > 0) {
+    loff_t in = offset;
+    ssize_t n = copy_file_range(reader->fd, &in, trickplay->fd, NULL, length, 0);
+    if (n > 0) {
+      offset += n;
+      length -= n;
+      trickplay->copied += n;
+    } else if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0 && errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP && errno != EBADF) {
+      return -1;
+    } else {
+      // a pipe, another filesystem on an old kernel..., write the rest from the mapping
+      LOG(RTMP_LOGDEBUG, "copy_file_range: %s, writing instead", n < 0 ? strerror(errno) : "no progress");
+      trickplay->copy_file_range = false;
+    }
+  }
+#endif
+
+  if (0 != write_all(trickplay->fd, reader->map + offset, length)) return -1;
+  trickplay->written += length;
+  return 0;
+}
+
+/*
+ * Annex-B
+ */
+int add_iov(trickplay_t *trickplay, const byte *data, size_t size) {
+  if (trickplay->iov_count == IOV_BATCH && 0 != flush_iov(trickplay)) return -1;
+  trickplay->iov[trickplay->iov_count++] = (struct iovec){(void *) data, size};
+  trickplay->pos += size;
+  return 0;
+}
+
+int flush_iov(trickplay_t *trickplay) {
+  struct iovec *iov = trickplay->iov;
+  int count = trickplay->iov_count;
+  trickplay->iov_count = 0;
+  while (count > 0) {
+    ssize_t n = writev(trickplay->fd, iov, count);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) return -1;
+    trickplay->written += n;
+    // partial write: skip what went out
+    while (count > 0 && (size_t) n >= iov->iov_len) {
+      n -= iov->iov_len;
+      ++iov;
+      --count;
+    }
+    if (count > 0) {
+      iov->iov_base = (byte *) iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return 0;
+}
+
+int write_all(int fd, const byte *data, size_t size) {
+  while (size > 0) {
+    ssize_t n = write(fd, data, size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    data += n;
+    size -= n;
+  }
+  return 0;
+}
+
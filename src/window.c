@@ -0,0 +1,118 @@
+#include "window.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifdef __linux__
+typedef unsigned char mincore_vec_t;
+#else
+typedef char mincore_vec_t;
+#endif
+
+static void prefetch(window_t *, uint64_t, uint64_t);
+static void release(window_t *, uint64_t, uint64_t);
+static bool resident(window_t *, uint64_t, uint64_t);
+
+static inline uint64_t entry_end(const flv_index_entry_t *entry) { return entry->offset + FLV_TAG_HEADER_SIZE + entry->data_size + FLV_PREV_TAG_SIZE; }
+
+int window_init(window_t *window, flv_reader_t *reader, const flv_index_t *index, uint32_t ahead, uint64_t size) {
+  memset(window, 0, sizeof(window_t));
+  if (reader->map == NULL) {
+    snprintf(window->error, sizeof(window->error), "readahead window needs a regular file");
+    return -1;
+  }
+  window->reader = reader;
+  window->index = index;
+  window->ahead = ahead;
+  window->size = size < 2 * WINDOW_CHUNK ? 2 * WINDOW_CHUNK : size;
+  window->page = sysconf(_SC_PAGESIZE);
+  window->drop = reader->size > window->size;
+
+  // an index walk faulted in the whole file (not so with replay -c), start from a cold cache instead; a file that fits stays cached
+  if (window->drop) {
+    release(window, 0, reader->size);
+    window->released_bytes = 0;
+  } else {
+    prefetch(window, 0, reader->size);
+    window->prefetched = reader->size;
+    window->until = index->count;
+  }
+  return 0;
+}
+
+void window_advance(window_t *window, size_t n) {
+  const flv_index_t *index = window->index;
+  if (n >= index->count) return;
+  const flv_index_entry_t *entry = &index->entries[n];
+
+  // looped back to the start
+  if (window->drop && entry->offset < window->cursor) {
+    window->until = n;
+    window->prefetched = window->released = entry->offset;
+  }
+  window->cursor = entry->offset;
+
+  ++window->tags;
+  if (!resident(window, entry->offset, entry_end(entry))) ++window->misses;
+
+  // up to ahead ms of stream, at most half the window
+  if (window->until < n) window->until = n;
+  if (window->prefetched < entry->offset) window->prefetched = entry->offset;
+  uint64_t limit = entry->offset + window->size / 2;
+  while (window->until < index->count && index->entries[window->until].timestamp <= (uint64_t) entry->timestamp + window->ahead && entry_end(&index->entries[window->until]) <= limit) ++window->until;
+  uint64_t target = window->until > n ? entry_end(&index->entries[window->until - 1]) : entry_end(entry);
+  // in chunks, or once half the lookahead is used up when it is shorter than a chunk
+  if (target > window->prefetched && (target - window->prefetched >= WINDOW_CHUNK || 2 * (target - window->prefetched) >= target - entry->offset)) {
+    prefetch(window, window->prefetched, target);
+    window->prefetched = target;
+  }
+
+  if (window->drop && entry->offset > window->released + window->size / 2 + WINDOW_CHUNK) {
+    uint64_t to = entry->offset - window->size / 2;
+    release(window, window->released, to);
+    window->released = to;
+  }
+}
+
+static void prefetch(window_t *window, uint64_t from, uint64_t to) {
+  ++window->prefetches;
+  window->prefetched_bytes += to - from;
+#ifdef __linux__
+  // readahead(2) without blocking on the request queue
+  posix_fadvise(window->reader->fd, from, to - from, POSIX_FADV_WILLNEED);
+#else
+  struct radvisory advisory = {.ra_offset = from, .ra_count = to - from > INT_MAX ? INT_MAX : (int) (to - from)};
+  fcntl(window->reader->fd, F_RDADVISE, &advisory);
+#endif
+}
+
+static void release(window_t *window, uint64_t from, uint64_t to) {
+  // whole pages only, the ends may still be in use
+  uint64_t begin = (from + window->page - 1) & ~(uint64_t) (window->page - 1);
+  uint64_t end = to & ~(uint64_t) (window->page - 1);
+  if (end <= begin) return;
+
+  window->released_bytes += end - begin;
+  madvise((void *) (window->reader->map + begin), end - begin, MADV_DONTNEED);
+#ifdef __linux__
+  posix_fadvise(window->reader->fd, begin, end - begin, POSIX_FADV_DONTNEED);
+#endif
+}
+
+static bool resident(window_t *window, uint64_t from, uint64_t to) {
+  mincore_vec_t vec[256];
+  uint64_t begin = from & ~(uint64_t) (window->page - 1);
+  while (begin < to) {
+    size_t pages = (to - begin + window->page - 1) / window->page;
+    if (pages > sizeof(vec)) pages = sizeof(vec);
+    if (0 != mincore((void *) (window->reader->map + begin), pages * window->page, vec)) return true;
+    for (size_t i = 0; i < pages; ++i) {
+      if (!(vec[i] & 1)) return false;
+    }
+    begin += pages * window->page;
+  }
+  return true;
+}
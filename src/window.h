@@ -0,0 +1,46 @@
+#ifndef WINDOW_H
+#define WINDOW_H
+
+#include "flv.h"
+
+/*
+ * bounded readahead window for replay of files larger than RAM: tags are prefetched
+ * (posix_fadvise WILLNEED, F_RDADVISE on macOS) ahead_ms of stream time before they are sent,
+ * and pages further than half the window behind the cursor are unmapped and dropped from the
+ * page cache (DONTNEED), so neither the RSS nor the cache grows with the file.
+ *
+ *   released ... cursor ... prefetched
+ *   <= size / 2             <= size / 2, <= ahead_ms
+ *
+ * files up to the window size are never dropped, a looping replay keeps them cached.
+ */
+
+#define WINDOW_CHUNK (2 * 1024 * 1024) // smallest prefetch / release, fewer syscalls
+
+typedef struct {
+  flv_reader_t *reader;
+  const flv_index_t *index;
+  uint32_t ahead; // ms, UINT32_MAX: only bounded by size
+  uint64_t size; // bytes
+  bool drop;
+  size_t page;
+  size_t until; // first index entry past the prefetched range
+  uint64_t cursor;
+  uint64_t prefetched; // file offset, prefetched up to
+  uint64_t released; // file offset, dropped up to
+  // stats
+  uint64_t prefetches;
+  uint64_t prefetched_bytes;
+  uint64_t released_bytes;
+  uint64_t tags;
+  uint64_t misses; // tags not (completely) in the page cache when sent
+  char error[128];
+} window_t;
+
+// @param[in] ahead: ms of stream to prefetch, size: window bytes
+// @return 0, -1 if the reader has no mapping (pipe)
+int window_init(window_t *, flv_reader_t *, const flv_index_t *, uint32_t, uint64_t);
+// @brief index entry n is sent next: count a miss if it isn't cached, prefetch ahead of it, release behind it
+void window_advance(window_t *, size_t);
+
+#endif